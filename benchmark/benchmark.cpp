@@ -6,9 +6,15 @@
 
 #include <benchmark/benchmark.h>
 #include <netflow9.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
 #include <vector>
 #include "test_lib.h"
+#include "types.h"
 
 std::vector<uint8_t> generate_packet()
 {
@@ -119,8 +125,245 @@ static void bm_nf9_options(benchmark::State &state)
     nf9_free(st);
 }
 
+// Number of exporters and templates per exporter used in template lookup
+// benchmarks.
+const size_t NEXPORTERS = 64;
+const size_t NTEMPLATES = 32;
+
+// Template IDs as seen from real exporters: a few dozen of them per device,
+// mostly allocated sequentially above 255, with some sparse outliers.
+static std::vector<uint16_t> realistic_template_ids()
+{
+    std::vector<uint16_t> ids;
+    for (size_t i = 0; ids.size() < NTEMPLATES; ++i) {
+        if (i % 4 == 3)
+            ids.push_back(uint16_t(256 + rand() % (65536 - 256)));
+        else
+            ids.push_back(uint16_t(256 + i));
+    }
+    return ids;
+}
+
+static parsed_template make_template(pmr::memory_resource *mr)
+{
+    parsed_template tmpl(mr);
+    tmpl.add_field(NF9_FIELD_IPV4_SRC_ADDR, 4);
+    tmpl.add_field(NF9_FIELD_IPV4_DST_ADDR, 4);
+    tmpl.total_length = 8;
+    return tmpl;
+}
+
+// Key of the global template hash map, which stored templates of all
+// exporters before per-exporter template tables were introduced.
+struct global_stream_id
+{
+    sockaddr_in addr;
+    uint32_t source_id;
+    uint16_t tid;
+
+    bool operator==(const global_stream_id &other) const
+    {
+        return addr.sin_addr.s_addr == other.addr.sin_addr.s_addr &&
+               addr.sin_port == other.addr.sin_port &&
+               source_id == other.source_id && tid == other.tid;
+    }
+};
+
+struct global_stream_id_hash
+{
+    size_t operator()(const global_stream_id &sid) const
+    {
+        size_t ret = sid.source_id;
+        ret ^= sid.addr.sin_addr.s_addr;
+        ret ^= uint32_t(sid.addr.sin_port) << 16;
+        ret |= sid.tid << 16;
+        return ret;
+    }
+};
+
+// Template lookup in a single hash map keyed by exporter address, source ID
+// and template ID.
+static void bm_template_lookup_hash_map(benchmark::State &state)
+{
+    pmr::memory_resource *mr = pmr::get_default_resource();
+    pmr::unordered_map<global_stream_id, data_template *,
+                       global_stream_id_hash>
+        templates;
+    std::vector<global_stream_id> lookups;
+
+    for (uint32_t exporter = 0; exporter < NEXPORTERS; ++exporter) {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x0a000000 + exporter);
+
+        for (uint16_t tid : realistic_template_ids()) {
+            global_stream_id sid = {addr, 0, tid};
+            auto [it, inserted] = templates.emplace(sid, nullptr);
+            if (inserted)
+                it->second = data_template::create(make_template(mr), mr);
+            lookups.push_back(sid);
+        }
+    }
+    std::shuffle(lookups.begin(), lookups.end(), std::mt19937());
+
+    size_t i = 0;
+    for (auto _ : state) {
+        auto it = templates.find(lookups[i++ % lookups.size()]);
+        benchmark::DoNotOptimize(it);
+    }
+
+    for (const auto &[sid, tmpl] : templates)
+        data_template::destroy(tmpl, mr);
+}
+
+// Template lookup in per-exporter sorted template tables.
+static void bm_template_lookup_table(benchmark::State &state)
+{
+    std::vector<template_table> tables;
+    std::vector<std::pair<uint32_t, uint16_t>> lookups;
+
+    for (uint32_t exporter = 0; exporter < NEXPORTERS; ++exporter) {
+        std::vector<uint16_t> ids = realistic_template_ids();
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        template_table &table =
+            tables.emplace_back(pmr::get_default_resource());
+        for (uint16_t tid : ids) {
+            table.assign(tid, make_template(pmr::get_default_resource()));
+            lookups.emplace_back(exporter, tid);
+        }
+    }
+    std::shuffle(lookups.begin(), lookups.end(), std::mt19937());
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &[exporter, tid] = lookups[i++ % lookups.size()];
+        data_template *tmpl = tables[exporter].find(tid);
+        benchmark::DoNotOptimize(tmpl);
+    }
+}
+
+// Decode data flowsets from many exporters, each using many templates.
+static void bm_nf9_decode_many_templates(benchmark::State &state)
+{
+    nf9_state *st = nf9_init(0);
+    nf9_packet *pkt;
+    std::vector<std::pair<nf9_addr, std::vector<uint8_t>>> packets;
+
+    nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, 100 * 1000 * 1000);
+
+    for (uint32_t exporter = 0; exporter < NEXPORTERS; ++exporter) {
+        nf9_addr addr = {};
+        addr.family = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(0x0a000000 + exporter);
+
+        for (uint16_t tid : realistic_template_ids()) {
+            std::vector<uint8_t> packet =
+                netflow_packet_builder()
+                    .add_data_template_flowset(0)
+                    .add_data_template(tid)
+                    .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                    .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+                    .build();
+            nf9_decode(st, &pkt, packet.data(), packet.size(), &addr);
+            nf9_free_packet(pkt);
+
+            packets.emplace_back(addr,
+                                 netflow_packet_builder()
+                                     .add_data_flowset(tid)
+                                     .add_data_field(uint32_t(401023))
+                                     .add_data_field(uint32_t(401024))
+                                     .build());
+        }
+    }
+    std::shuffle(packets.begin(), packets.end(), std::mt19937());
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const auto &[addr, packet] = packets[i++ % packets.size()];
+        nf9_decode(st, &pkt, packet.data(), packet.size(), &addr);
+        nf9_free_packet(pkt);
+    }
+    nf9_free(st);
+}
+
+static size_t resident_set_size()
+{
+    std::ifstream in("/proc/self/statm");
+    size_t pages = 0;
+    in >> pages >> pages;
+    return pages * getpagesize();
+}
+
+// Refresh templates of many exporters while time passes, like a collector
+// running for hours: the memory limit keeps the store full, so expired
+// templates are constantly replaced with new ones of different sizes.
+// Every iteration is a second of simulated time.  The counters compare the
+// growth of the resident set size with the memory used for templates;
+// the difference grows with heap fragmentation.
+static void bm_template_churn(benchmark::State &state)
+{
+    const size_t NPACKETS = 4096;
+    const size_t PACKETS_PER_SECOND = 64;
+
+    size_t initial_rss = resident_set_size();
+    nf9_state *st = nf9_init(int(state.range(0)));
+    nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, 1000 * 1000);
+    nf9_ctl(st, NF9_OPT_TEMPLATE_EXPIRE_TIME, 60);
+
+    std::mt19937 rng;
+    std::vector<std::pair<nf9_addr, std::vector<uint8_t>>> packets;
+    for (size_t i = 0; i < NPACKETS; ++i) {
+        nf9_addr addr = {};
+        addr.family = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(0x0a000000 + rng() % NEXPORTERS);
+
+        netflow_packet_builder builder;
+        builder.add_data_template_flowset(0).add_data_template(
+            uint16_t(256 + rng() % 1024));
+        for (size_t field = 0, n = 1 + rng() % 32; field < n; ++field)
+            builder.add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4);
+        packets.emplace_back(addr, builder.build());
+    }
+
+    uint32_t now = 0;
+    size_t i = 0;
+    for (auto _ : state) {
+        ++now;
+        for (size_t j = 0; j < PACKETS_PER_SECOND; ++j) {
+            auto &[addr, packet] = packets[i++ % packets.size()];
+            // Patch the UNIX timestamp in the header.
+            uint32_t timestamp = htonl(now);
+            memcpy(packet.data() + 8, &timestamp, sizeof(timestamp));
+
+            nf9_packet *pkt;
+            if (nf9_decode(st, &pkt, packet.data(), packet.size(), &addr) ==
+                0)
+                nf9_free_packet(pkt);
+        }
+    }
+
+    const nf9_stats *stats = nf9_get_stats(st);
+    state.SetItemsProcessed(state.iterations() * PACKETS_PER_SECOND);
+    state.counters["simulated_hours"] = now / 3600.0;
+    state.counters["memory_usage"] =
+        nf9_get_stat(stats, NF9_STAT_MEMORY_USAGE);
+    state.counters["rss_growth"] = resident_set_size() - initial_rss;
+    nf9_free_stats(stats);
+    nf9_free(st);
+}
+
 BENCHMARK(bm_nf9_decode);
 BENCHMARK(bm_nf9_decode_large_data_flowset);
 BENCHMARK(bm_nf9_options);
+BENCHMARK(bm_template_lookup_hash_map);
+BENCHMARK(bm_template_lookup_table);
+BENCHMARK(bm_nf9_decode_many_templates);
+BENCHMARK(bm_template_churn)
+    ->Arg(0)
+    ->Arg(NF9_POOL_ALLOCATOR)
+    ->Arg(NF9_HUGE_PAGES)
+    ->Iterations(4 * 3600);
 
 BENCHMARK_MAIN();
@@ -0,0 +1,274 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netflow9.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* ======================= libnetflow example =======================
+ *
+ * This example shows how you can export decoder statistics to
+ * Prometheus.
+ *
+ * The program listens for NetFlow packets on a UDP port and decodes
+ * them.  It also listens for HTTP requests on a TCP port, and answers
+ * every request with decoder statistics in OpenMetrics format, as
+ * returned by nf9_format_metrics().  Both are handled in a single
+ * thread, because nf9_format_metrics() must not run while a packet is
+ * being decoded.  The HTTP connection is non-blocking, so a slow client
+ * doesn't stop decoding.
+ *
+ * */
+
+#define BUFSIZE 4096
+#define METRICS_BUFSIZE (1024 * 1024)
+#define MAX_MEM_USAGE (100 * 1000 * 1000)
+
+const char *usage =
+    "usage: %s PORT HTTP_PORT\n"
+    "\n"
+    "Arguments:\n"
+    " PORT        port to listen on for netflow data\n"
+    " HTTP_PORT   port to serve metrics on\n";
+
+/* Create a socket of given type bound to a port on all addresses. */
+static int bind_socket(int type, uint16_t port);
+
+/* Decode a received packet. */
+static void process(nf9_state *decoder, const uint8_t *buf, size_t size,
+                    const struct sockaddr_in *source);
+
+/* Accept a HTTP connection.  Only one connection is served at a time. */
+static void accept_client(int listen_fd, struct pollfd *client);
+
+/* Read the request or send the metrics, as far as it can be done without
+ * blocking. */
+static void serve_client(const nf9_state *decoder, struct pollfd *client);
+
+/* Buffers for the response, allocated once. */
+static char header[256];
+static char metrics[METRICS_BUFSIZE];
+
+/* Lengths of the response and of the part that has been sent. */
+static size_t response_len;
+static size_t response_sent;
+
+int main(int argc, char **argv)
+{
+    struct pollfd fds[3];
+    struct sockaddr_in peer;
+    uint8_t buf[BUFSIZE];
+    socklen_t addr_len;
+    ssize_t len;
+    nf9_state *decoder;
+    int err;
+
+    if (argc != 3) {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fds[0].fd = bind_socket(SOCK_DGRAM, atoi(argv[1]));
+    fds[0].events = POLLIN;
+    fds[1].fd = bind_socket(SOCK_STREAM, atoi(argv[2]));
+    fds[1].events = POLLIN;
+    fds[2].fd = -1;
+    fds[2].events = 0;
+    if (listen(fds[1].fd, 16)) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Initialize the decoder. */
+    decoder = nf9_init(0);
+
+    /* Set maximum memory usage. */
+    err = nf9_ctl(decoder, NF9_OPT_MAX_MEM_USAGE, MAX_MEM_USAGE);
+    if (err != 0) {
+        fprintf(stderr, "nf9_ctl: %s\n", nf9_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        /* New connections wait in the backlog while one is served. */
+        fds[1].events = fds[2].fd < 0 ? POLLIN : 0;
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[2].fd >= 0 && fds[2].revents != 0)
+            serve_client(decoder, &fds[2]);
+        else if (fds[1].revents & POLLIN)
+            accept_client(fds[1].fd, &fds[2]);
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        addr_len = sizeof(peer);
+        len = recvfrom(fds[0].fd, buf, BUFSIZE, 0, (struct sockaddr *)&peer,
+                       &addr_len);
+        if (len < 0) {
+            perror("recvfrom");
+            continue;
+        }
+
+        /* Decode the received packet. */
+        process(decoder, buf, len, &peer);
+    }
+}
+
+int bind_socket(int type, uint16_t port)
+{
+    int fd;
+    int one = 1;
+    struct sockaddr_in addr;
+
+    fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+void process(nf9_state *decoder, const uint8_t *buf, size_t size,
+             const struct sockaddr_in *source)
+{
+    nf9_packet *packet;
+    nf9_addr addr;
+    int err;
+
+    addr.family = AF_INET;
+    addr.in = *source;
+
+    err = nf9_decode(decoder, &packet, buf, size, &addr);
+    if (err != 0) {
+        fprintf(stderr, "nf9_decode: %s\n", nf9_strerror(err));
+        return;
+    }
+
+    nf9_free_packet(packet);
+}
+
+void accept_client(int listen_fd, struct pollfd *client)
+{
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        perror("accept");
+        return;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
+        perror("fcntl");
+        close(fd);
+        return;
+    }
+
+    client->fd = fd;
+    client->events = POLLIN;
+    response_len = 0;
+    response_sent = 0;
+}
+
+/* Close the HTTP connection. */
+static void close_client(struct pollfd *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->events = 0;
+}
+
+/* Format the metrics and the HTTP header. */
+static void format_response(const nf9_state *decoder)
+{
+    size_t len;
+    int header_len;
+
+    len = nf9_format_metrics(decoder, metrics, sizeof(metrics));
+    if (len >= sizeof(metrics)) {
+        fprintf(stderr, "metrics don't fit in %d bytes\n", METRICS_BUFSIZE);
+        len = sizeof(metrics) - 1;
+    }
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: application/openmetrics-text; "
+                          "version=1.0.0; charset=utf-8\r\n"
+                          "Content-Length: %zu\r\n"
+                          "\r\n",
+                          len);
+
+    response_len = header_len + len;
+    response_sent = 0;
+}
+
+void serve_client(const nf9_state *decoder, struct pollfd *client)
+{
+    char request[BUFSIZE];
+    size_t header_len;
+    ssize_t n;
+
+    if (client->events & POLLIN) {
+        /* We don't care what was requested; everything gets the metrics. */
+        n = recv(client->fd, request, sizeof(request), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            perror("recv");
+            close_client(client);
+            return;
+        }
+
+        format_response(decoder);
+        client->events = POLLOUT;
+    }
+
+    header_len = strlen(header);
+    while (response_sent < response_len) {
+        if (response_sent < header_len)
+            n = send(client->fd, header + response_sent,
+                     header_len - response_sent, MSG_NOSIGNAL | MSG_MORE);
+        else
+            n = send(client->fd, metrics + response_sent - header_len,
+                     response_len - response_sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            perror("send");
+            break;
+        }
+        response_sent += n;
+    }
+
+    close_client(client);
+}
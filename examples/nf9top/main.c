@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netflow9.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ======================= libnetflow example =======================
+ *
+ * This example shows how you can monitor a decoder running in another
+ * process.
+ *
+ * The decoder publishes its statistics with nf9_publish_stats().  This
+ * program opens them by name and, every second, prints current values
+ * and per-second rates.  Reading the statistics doesn't slow down the
+ * decoder.
+ *
+ * */
+
+const char *usage =
+    "usage: %s NAME\n"
+    "\n"
+    "Arguments:\n"
+    " NAME   name of the shared memory object passed to nf9_publish_stats\n";
+
+static const char *stat_names[NF9_NUM_STATS] = {
+    "processed packets",
+    "malformed packets",
+    "data flowsets",
+    "data templates",
+    "option templates",
+    "missing templates",
+    "expired objects",
+    "memory usage",
+    "queued flowsets",
+    "replayed flowsets",
+    "quota hits",
+    "evicted objects",
+};
+
+int main(int argc, char **argv)
+{
+    nf9_stats_reader *reader;
+    uint64_t values[NF9_NUM_STATS];
+    uint64_t prev_values[NF9_NUM_STATS];
+    uint64_t timestamp;
+    uint64_t prev_timestamp;
+    double seconds;
+    size_t count;
+    size_t i;
+    int err;
+
+    if (argc != 2) {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The decoder may be creating the statistics right now. */
+    reader = nf9_open_stats_reader(argv[1]);
+    if (reader == NULL && errno == EAGAIN) {
+        sleep(1);
+        reader = nf9_open_stats_reader(argv[1]);
+    }
+    if (reader == NULL) {
+        fprintf(stderr, "nf9_open_stats_reader: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(prev_values, 0, sizeof(prev_values));
+    prev_timestamp = 0;
+
+    while (1) {
+        count = NF9_NUM_STATS;
+        err = nf9_read_published_stats(reader, values, &count, &timestamp);
+        if (err == NF9_ERR_SYSTEM && errno == EAGAIN) {
+            /* The decoder didn't finish an update, try again later. */
+            sleep(1);
+            continue;
+        }
+        if (err != 0) {
+            fprintf(stderr, "nf9_read_published_stats: %s\n",
+                    nf9_strerror(err));
+            nf9_close_stats_reader(reader);
+            exit(EXIT_FAILURE);
+        }
+
+        /* Clear the screen. */
+        printf("\033[H\033[2J");
+        printf("%-20s %16s %12s\n", "", "total", "per second");
+
+        seconds = (double)(timestamp - prev_timestamp) / 1e9;
+        for (i = 0; i < count; ++i) {
+            if (i == NF9_STAT_MEMORY_USAGE || prev_timestamp == 0 ||
+                timestamp == prev_timestamp)
+                printf("%-20s %16" PRIu64 "\n", stat_names[i], values[i]);
+            else
+                printf("%-20s %16" PRIu64 " %12.1f\n", stat_names[i],
+                       values[i],
+                       (double)(values[i] - prev_values[i]) / seconds);
+        }
+        fflush(stdout);
+
+        memcpy(prev_values, values, sizeof(values));
+        prev_timestamp = timestamp;
+        sleep(1);
+    }
+
+    nf9_close_stats_reader(reader);
+    return 0;
+}
@@ -58,6 +58,8 @@ enum nf9_error {
     NF9_ERR_MALFORMED,
 
     NF9_ERR_OUTDATED,
+
+    NF9_ERR_SYSTEM /**< A system call failed, see `errno`. */,
 };
 
 /**
@@ -101,8 +103,66 @@ enum nf9_state_flag {
      * with nf9_get_sampling_rate().
      */
     NF9_STORE_SAMPLING_RATES = 2,
+
+    /**
+     * If this flag is present, byte and packet counters of data records are
+     * multiplied by their sampling rates during decoding, and can be
+     * retrieved with nf9_get_upscaled_counter() and
+     * nf9_get_upscaled_column().  Implies ::NF9_STORE_SAMPLING_RATES.
+     */
+    NF9_UPSCALE_COUNTERS = 4,
+
+    /**
+     * If this flag is present, memory usage includes the overhead of heap
+     * allocations (chunk headers and rounding to the allocator's size
+     * classes), not just the requested sizes.  This makes
+     * ::NF9_STAT_MEMORY_USAGE and ::NF9_OPT_MAX_MEM_USAGE closer to the real
+     * memory footprint of the decoder, at the cost of storing fewer
+     * templates and options within the same limit.
+     */
+    NF9_ACCURATE_MEMORY_USAGE = 8,
+
+    /**
+     * If this flag is present, templates, options and sampling rates are
+     * allocated from pools of fixed-size blocks, which are reused after the
+     * objects are freed.  This avoids heap fragmentation when templates are
+     * constantly refreshed, but the pools are never shrunk: the decoder
+     * keeps the memory it used at its peak.
+     */
+    NF9_POOL_ALLOCATOR = 16,
+
+    /**
+     * Like ::NF9_POOL_ALLOCATOR, but pools are backed by huge pages if the
+     * system provides them.
+     */
+    NF9_HUGE_PAGES = 32,
+
+    /**
+     * If this flag is present, values of text fields of data records
+     * (::NF9_FIELD_IF_NAME, ::NF9_FIELD_IF_DESC, ::NF9_FIELD_SAMPLER_NAME,
+     * ::NF9_FIELD_APPLICATION_NAME and ::NF9_FIELD_APPLICATION_DESCRIPTION)
+     * are added to a dictionary of the decoder during decoding.  Their IDs
+     * can be retrieved with nf9_get_string_id() and compared instead of the
+     * strings.
+     */
+    NF9_INTERN_STRINGS = 64,
+};
+
+/**
+ * @brief Counters of data records that can be upscaled by sampling rates.
+ */
+enum nf9_counter {
+    NF9_COUNTER_IN_BYTES /**< ::NF9_FIELD_IN_BYTES */,
+    NF9_COUNTER_IN_PKTS /**< ::NF9_FIELD_IN_PKTS */,
+    NF9_COUNTER_OUT_BYTES /**< ::NF9_FIELD_OUT_BYTES */,
+    NF9_COUNTER_OUT_PKTS /**< ::NF9_FIELD_OUT_PKTS */,
 };
 
+/**
+ * @brief Number of values in enum ::nf9_counter.
+ */
+#define NF9_NUM_COUNTERS 4
+
 /**
  * @brief Type of a NetFlow flowset.
  */
@@ -156,8 +216,82 @@ enum nf9_stat {
      * Current memory usage for storing template and options, in bytes.
      */
     NF9_STAT_MEMORY_USAGE,
+
+    /**
+     * Number of data flowsets queued because their template was not known.
+     * See ::NF9_OPT_MAX_PENDING_BYTES.
+     */
+    NF9_STAT_QUEUED_FLOWSETS,
+
+    /**
+     * Number of queued data flowsets that were decoded after their template
+     * arrived.
+     */
+    NF9_STAT_REPLAYED_FLOWSETS,
+
+    /**
+     * Number of times that templates or options of an exporter didn't fit
+     * in its quota.  See ::NF9_OPT_MAX_EXPORTER_MEM_USAGE.
+     */
+    NF9_STAT_QUOTA_HITS,
+
+    /**
+     * Number of templates and options that were deleted before they
+     * expired, to make room for new ones.  See ::NF9_OPT_EVICTION_POLICY
+     * and ::NF9_OPT_MAX_EXPORTER_MEM_USAGE.
+     */
+    NF9_STAT_EVICTED_OBJECTS,
+};
+
+/**
+ * @brief Number of values in enum ::nf9_stat.
+ */
+#define NF9_NUM_STATS 12
+
+/**
+ * @brief Stages of decoding whose durations are measured if the library
+ * was built with the `NF9_ENABLE_TIMING` CMake option.
+ */
+enum nf9_stage {
+
+    /**
+     * Decoding the packet header and finding the exporter.
+     */
+    NF9_STAGE_HEADER,
+
+    /**
+     * Decoding a data template flowset.
+     */
+    NF9_STAGE_DATA_TEMPLATE_FLOWSET,
+
+    /**
+     * Decoding an option template flowset.
+     */
+    NF9_STAGE_OPTION_TEMPLATE_FLOWSET,
+
+    /**
+     * Decoding a data flowset, including option records.
+     */
+    NF9_STAGE_DATA_FLOWSET,
+
+    /**
+     * Deleting expired templates, options or exporters when the memory
+     * limit is reached.
+     */
+    NF9_STAGE_EXPIRE_OBJECTS,
 };
 
+/**
+ * @brief Number of values in enum ::nf9_stage.
+ */
+#define NF9_NUM_STAGES 5
+
+/**
+ * @brief Number of buckets in a histogram returned by
+ * nf9_get_stage_histogram().
+ */
+#define NF9_HISTOGRAM_BUCKETS 496
+
 /**
  * @brief Flags describing options of a NetFlow decoder.
  */
@@ -167,7 +301,8 @@ enum nf9_opt {
      * Memory limit in bytes for cached templates and options.
      *
      * @note This is an approximate value, real memory usage may be
-     * larger than what is set by this option.
+     * larger than what is set by this option.  See
+     * ::NF9_ACCURATE_MEMORY_USAGE.
      */
     NF9_OPT_MAX_MEM_USAGE,
 
@@ -186,6 +321,104 @@ enum nf9_opt {
      * values.
      */
     NF9_OPT_OPTION_EXPIRE_TIME,
+
+    /**
+     * Minimum interval (in milliseconds) between updates of statistics
+     * published with nf9_publish_stats().  The default is 100.
+     */
+    NF9_OPT_STATS_PUBLISH_INTERVAL,
+
+    /**
+     * Maximum total size (in bytes) of data flowsets that are kept for each
+     * exporter while waiting for their templates.  The default is 0, which
+     * disables queuing.
+     *
+     * When a template arrives, queued flowsets that use it are decoded and
+     * added to the packet that carried the template, after the template
+     * flowset.  Flowsets that don't fit in the limit, or that wait for
+     * longer than ::NF9_OPT_MAX_PENDING_AGE, are dropped and counted in
+     * ::NF9_STAT_MISSING_TEMPLATE_ERRORS.
+     */
+    NF9_OPT_MAX_PENDING_BYTES,
+
+    /**
+     * Duration (in seconds) that data flowsets wait for their templates.
+     * The default is 30.  See ::NF9_OPT_MAX_PENDING_BYTES.
+     */
+    NF9_OPT_MAX_PENDING_AGE,
+
+    /**
+     * Memory limit in bytes for data records of a single decoded packet.
+     * nf9_decode() fails with ::NF9_ERR_OUT_OF_MEMORY for packets whose
+     * records don't fit in the limit.  The default is 0, which means no
+     * limit.
+     */
+    NF9_OPT_MAX_PACKET_MEM_USAGE,
+
+    /**
+     * Memory limit in bytes for templates, options and queued data
+     * flowsets (see ::NF9_OPT_MAX_PENDING_BYTES) of a single exporter.
+     * The default is 0, which means no limit.
+     *
+     * When a new template or options of an exporter don't fit in this
+     * limit, flowsets queued for the same exporter and then its templates
+     * and options, in the order of ::NF9_OPT_EVICTION_POLICY, are deleted
+     * to make room, and the event is counted in ::NF9_STAT_QUOTA_HITS.  A
+     * data flowset which doesn't fit is not queued, which is counted there
+     * too.  When ::NF9_OPT_MAX_MEM_USAGE is reached, exporters over this
+     * limit lose their templates and options first, before expired objects
+     * of other exporters are deleted.
+     */
+    NF9_OPT_MAX_EXPORTER_MEM_USAGE,
+
+    /**
+     * What to delete when ::NF9_OPT_MAX_MEM_USAGE is reached and deleting
+     * expired objects doesn't free enough memory, one of enum
+     * ::nf9_eviction_policy.  The default is ::NF9_EVICTION_EXPIRED.
+     *
+     * The policy also chooses which templates and options of an exporter
+     * are deleted when it reaches ::NF9_OPT_MAX_EXPORTER_MEM_USAGE.
+     */
+    NF9_OPT_EVICTION_POLICY,
+
+    /**
+     * Memory limit in bytes for the dictionary of strings (see
+     * nf9_get_string()), which is part of ::NF9_OPT_MAX_MEM_USAGE.  The
+     * default is 0, which means a quarter of ::NF9_OPT_MAX_MEM_USAGE.
+     *
+     * Strings are never removed from the dictionary.  When it's full,
+     * names of interfaces from option records are copied to the options
+     * instead, and values of data records get no IDs.
+     */
+    NF9_OPT_MAX_STRING_MEM_USAGE,
+};
+
+/**
+ * @brief Policies of deleting templates and options which haven't expired
+ * yet.  See ::NF9_OPT_EVICTION_POLICY.
+ */
+enum nf9_eviction_policy {
+
+    /**
+     * Delete only expired objects; new templates and options that don't
+     * fit are rejected.  Exporters over their quota lose their least
+     * recently received templates.
+     */
+    NF9_EVICTION_EXPIRED,
+
+    /**
+     * Delete templates and options that were least recently used to decode
+     * a packet.
+     */
+    NF9_EVICTION_LRU,
+
+    /**
+     * Delete templates and options that were used to decode the fewest
+     * packets.  Use counts are halved whenever an exporter sends the
+     * template again, so that formerly busy templates don't stay forever.
+     * When a count saturates, all of them are halved.
+     */
+    NF9_EVICTION_LFU,
 };
 
 /**
@@ -444,6 +677,7 @@ typedef union nf9_addr {
 typedef struct nf9_state nf9_state;
 typedef struct nf9_packet nf9_packet;
 typedef struct nf9_stats nf9_stats;
+typedef struct nf9_stats_reader nf9_stats_reader;
 
 /**
  * @brief Structure that defines NetFlow field.
@@ -455,6 +689,61 @@ typedef struct nf9_fieldval
     const uint8_t* value; /**< field value */
 } nf9_fieldval;
 
+/**
+ * @brief Statistics of a single exporter device.
+ *
+ * An exporter is identified by the source address and source ID of its
+ * packets.  Counters are reset when the exporter expires.
+ */
+typedef struct nf9_exporter_stats
+{
+    nf9_addr addr;              /**< source address of packets */
+    uint32_t source_id;         /**< source ID in packet headers */
+    uint32_t exporter_index;    /**< see nf9_get_exporter_index() */
+    uint32_t last_seen;         /**< timestamp of the last packet header */
+    uint64_t packets;           /**< number of packets */
+    uint64_t bytes;             /**< total size of packets */
+    uint64_t records;           /**< number of data flowsets */
+    uint64_t templates;         /**< number of template flowsets */
+    uint64_t missing_templates; /**< data flowsets with unknown template */
+    uint64_t malformed_packets; /**< packets that failed to decode */
+    uint64_t quota_hits;        /**< see ::NF9_STAT_QUOTA_HITS */
+    uint64_t memory_usage;      /**< see ::NF9_OPT_MAX_EXPORTER_MEM_USAGE */
+} nf9_exporter_stats;
+
+/**
+ * @brief Memory allocation callbacks used by a decoder.
+ *
+ * See nf9_init_ex().  Both callbacks are called with @p ctx as their last
+ * argument, and only from threads that call functions of the library.
+ * Memory returned by nf9_allocator::malloc must be aligned like memory
+ * returned by malloc().
+ */
+typedef struct nf9_allocator
+{
+    /** Allocate @p size bytes, or return NULL on failure. */
+    void* (*malloc)(size_t size, void* ctx);
+
+    /** Free memory returned by nf9_allocator::malloc. */
+    void (*free)(void* ptr, void* ctx);
+
+    /** User context passed to the callbacks. */
+    void* ctx;
+} nf9_allocator;
+
+/**
+ * @brief Capacity of a decoder created with nf9_init_fixed().
+ */
+typedef struct nf9_capacity
+{
+    size_t exporters;    /**< number of exporter devices */
+    size_t templates;    /**< number of templates of all exporters */
+    size_t option_sets;  /**< number of exporters that send options */
+    size_t samplers;     /**< number of sampling rates of all exporters */
+    size_t packets;      /**< number of decoded packets not yet freed */
+    size_t packet_bytes; /**< memory for records of a single packet */
+} nf9_capacity;
+
 /**
  * @brief Get an error message for an error code.
  *
@@ -478,10 +767,56 @@ NF9_API const char* nf9_strerror(int err);
  */
 NF9_API nf9_state* nf9_init(int flags);
 
+/**
+ * @brief Create a NetFlow9 decoder which allocates memory with given
+ * callbacks.
+ *
+ * Like nf9_init(), but the decoder, the templates and options it stores,
+ * and packets it decodes are allocated with @p allocator instead of the
+ * global heap.  This lets every decoding thread use its own allocator
+ * arena.  Slabs of ::NF9_HUGE_PAGES pools are mapped directly from the
+ * system.
+ *
+ * @param flags Bitmask of flags from enum ::nf9_state_flag.
+ * @param allocator Allocation callbacks, copied by the function.  If NULL,
+ * this function is equivalent to nf9_init().
+ * @return An instance of the decoder, or NULL if it couldn't be allocated.
+ */
+NF9_API nf9_state* nf9_init_ex(int flags, const nf9_allocator* allocator);
+
+/**
+ * @brief Create a NetFlow9 decoder which doesn't allocate memory after it's
+ * created.
+ *
+ * Memory for the given number of objects is allocated up front, and all
+ * further allocations are served from it.  When the decoder runs out of
+ * space, it evicts expired objects like when ::NF9_OPT_MAX_MEM_USAGE is
+ * reached; if that doesn't help, functions fail with
+ * ::NF9_ERR_OUT_OF_MEMORY.  In particular, nf9_decode() fails if records
+ * of a packet need more than @p capacity->packet_bytes bytes (see
+ * ::NF9_OPT_MAX_PACKET_MEM_USAGE), or when packets which weren't freed
+ * use up the memory reserved for @p capacity->packets packets.
+ *
+ * Memory usage is counted like with ::NF9_ACCURATE_MEMORY_USAGE, and
+ * ::NF9_OPT_MAX_MEM_USAGE is initially set to the size of the memory
+ * reserved for templates, options and sampling rates.
+ *
+ * @param flags Bitmask of flags from enum ::nf9_state_flag.
+ * @param capacity Number of objects to reserve memory for.  All fields
+ * except @p option_sets and @p samplers must be non-zero.
+ * @param allocator Callbacks used to allocate the memory, or NULL to use
+ * the global heap.
+ * @return An instance of the decoder, or NULL if it couldn't be allocated.
+ */
+NF9_API nf9_state* nf9_init_fixed(int flags, const nf9_capacity* capacity,
+                                  const nf9_allocator* allocator);
+
 /**
  * @brief Free a NetFlow9 decoder.
  *
- * @param state A state object created by nf9_init().
+ * All packets decoded by @p state must be freed before the decoder.
+ *
+ * @param state A state object created by nf9_init() or nf9_init_ex().
  */
 NF9_API void nf9_free(nf9_state* state);
 
@@ -546,6 +881,18 @@ NF9_API uint32_t nf9_get_source_id(const nf9_packet* pkt);
  */
 NF9_API uint32_t nf9_get_uptime(const nf9_packet* pkt);
 
+/**
+ * @brief Get the index of the exporter that sent a NetFlow packet.
+ *
+ * Every distinct (source address, source ID) pair seen by the decoder
+ * is assigned a small, dense index.  Indices of exporters that expired
+ * can be reused for new exporters.
+ *
+ * @param pkt Decoded NetFlow packet, created by nf9_decode().
+ * @return Index of the exporter device within the decoder.
+ */
+NF9_API uint32_t nf9_get_exporter_index(const nf9_packet* pkt);
+
 /**
  * @brief Get the type of flowset in a NetFlow packet.
  *
@@ -612,6 +959,11 @@ NF9_API int nf9_get_all_fields(const nf9_packet* pkt, unsigned flowset,
 /**
  * @brief Get the value of an option from a NetFlow packet.
  *
+ * Option values are those that were current for the exporter when @p pkt
+ * was decoded; options received later do not affect them.  This function
+ * does not access the decoder, so it can be called from any thread without
+ * locking.
+ *
  * @param pkt Decoded NetFlow packet.
  * @param field The option to get, one of `NF9_FIELD_*`.
  * @param[out] dst Pointer to location where value of the option will be
@@ -623,9 +975,102 @@ NF9_API int nf9_get_all_fields(const nf9_packet* pkt, unsigned flowset,
 NF9_API int nf9_get_option(const nf9_packet* pkt, nf9_field field, void* dst,
                            size_t* length);
 
+/**
+ * @brief Get the value of an option from a record with given scope.
+ *
+ * Exporters send options of interfaces, samplers and other parts of the
+ * device in separate records, which are told apart by their scope fields.
+ * nf9_get_option() returns values from the most recent record of any scope,
+ * while this function uses the most recent record in which @p scope_field
+ * has the value @p scope_value.  Sampler options are often sent with system
+ * scope, so records are also indexed by ::NF9_FIELD_FLOW_SAMPLER_ID.  Only
+ * fields of up to 8 bytes are indexed.
+ *
+ * Like nf9_get_option(), this function does not access the decoder.
+ *
+ * @param pkt Decoded NetFlow packet.
+ * @param scope_field Field that identifies the record, one of
+ * `NF9_SCOPE_FIELD_*` or ::NF9_FIELD_FLOW_SAMPLER_ID.
+ * @param scope_value Value of @p scope_field, in host byte order.
+ * @param field The option to get, one of `NF9_FIELD_*`.
+ * @param[out] dst Pointer to location where value of the option will be
+ * written.
+ * @param[in,out] length Initially points to size of @p dst.  On success,
+ * overwritten with number of bytes written to @p dst.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_option_scoped(const nf9_packet* pkt,
+                                  nf9_field scope_field, uint64_t scope_value,
+                                  nf9_field field, void* dst, size_t* length);
+
+/**
+ * @brief Get the name of an interface of the exporter of a NetFlow packet.
+ *
+ * Names and descriptions of interfaces are taken from option records with
+ * ::NF9_SCOPE_FIELD_INTERFACE scope, from the ::NF9_FIELD_IF_NAME and
+ * ::NF9_FIELD_IF_DESC fields.  Like nf9_get_option(), this function sees
+ * the options that were current when @p pkt was decoded.
+ *
+ * The returned strings are valid until @p pkt is freed.  Names are stored
+ * in the dictionary of the decoder (see nf9_get_string()) where possible,
+ * so exporters and option refreshes with the same names share them, but
+ * names which don't fit in ::NF9_OPT_MAX_STRING_MEM_USAGE are copied to
+ * the options seen by @p pkt, and are freed with them.  Only the lifetime
+ * of @p pkt is guaranteed for either kind.
+ *
+ * @param pkt Decoded NetFlow packet.
+ * @param ifindex SNMP index of the interface, as in ::NF9_FIELD_INPUT_SNMP
+ * and ::NF9_FIELD_OUTPUT_SNMP.
+ * @param[out] name Set to the null-terminated name of the interface, or
+ * NULL if it's not known.  The string is valid until @p pkt is freed.
+ * @param[out] description If not NULL, set to the null-terminated
+ * description of the interface, or NULL if it's not known.
+ * @return 0 on success; ::NF9_ERR_NOT_FOUND if the interface is not known.
+ */
+NF9_API int nf9_get_interface_name(const nf9_packet* pkt, uint32_t ifindex,
+                                   const char** name,
+                                   const char** description);
+
+/**
+ * @brief Get names of interfaces of all flows in a flowset.
+ *
+ * This is like calling nf9_get_interface_name() with the value of @p field
+ * of every flow, but without copying the values out of the flows.  The
+ * names are valid until @p pkt is freed.
+ *
+ * @param pkt Decoded NetFlow packet.
+ * @param flowset Index of the flowset.
+ * @param field Field with the SNMP index of the interface, usually
+ * ::NF9_FIELD_INPUT_SNMP or ::NF9_FIELD_OUTPUT_SNMP.
+ * @param[out] names Array where the name for each flow will be written, or
+ * NULL if the flow has no such field or the interface is not known.
+ * @param[in,out] size Initially points to size of @p names.  On success,
+ * overwritten with number of names written to @p names.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_interface_names(const nf9_packet* pkt, unsigned flowset,
+                                    nf9_field field, const char** names,
+                                    size_t* size);
+
+/**
+ * @brief Get the version of the option values seen by a NetFlow packet.
+ *
+ * Every option record received by the decoder that changes the exporter's
+ * option values publishes a new version of them.  Two packets with the same
+ * version see exactly the same options, so values derived from them can be
+ * cached.
+ *
+ * @param pkt Decoded NetFlow packet.
+ * @return Version of the options, or 0 if the exporter has no options.
+ */
+NF9_API uint64_t nf9_get_options_version(const nf9_packet* pkt);
+
 /**
  * @brief Get the sampling rate used for a flow within a NetFlow packet.
  *
+ * Sampling rates are resolved when the packet is decoded, using sampler
+ * options received up to that point, so this function is a simple lookup.
+ *
  * @pre @p flowset must be < `nf9_get_num_flowsets(pkt)`.
  * @pre @p flow must be < `nf9_get_num_flows(pkt, flowset)`.
  * @pre Flag NF9_STORE_SAMPLING_RATES need to be set in nf9_init().
@@ -642,6 +1087,82 @@ NF9_API int nf9_get_sampling_rate(const nf9_packet* pkt, unsigned flowset,
                                   unsigned flownum, uint32_t* sampling,
                                   int* sampling_info);
 
+/**
+ * @brief Get a byte or packet counter of a flow, multiplied by its sampling
+ * rate.
+ *
+ * If the sampling rate of the flow is not known, the counter is returned
+ * as it is.  If the flow has no such field, the value is 0.
+ *
+ * @pre Flag ::NF9_UPSCALE_COUNTERS needs to be set in nf9_init().
+ *
+ * @param pkt Decoded NetFlow packet, created with nf9_decode().
+ * @param flowset Index of the flowset.
+ * @param flownum Index of the flow within the flowset.
+ * @param counter The counter to get, one of the values of enum ::nf9_counter.
+ * @param[out] value The upscaled counter value, in host byte order.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_upscaled_counter(const nf9_packet* pkt, unsigned flowset,
+                                     unsigned flownum, int counter,
+                                     uint64_t* value);
+
+/**
+ * @brief Get a byte or packet counter of all flows in a data flowset,
+ * multiplied by their sampling rates.
+ *
+ * The returned array has `nf9_get_num_flows(pkt, flowset)` elements and is
+ * valid as long as @p pkt exists.  Values are the same as returned by
+ * nf9_get_upscaled_counter().
+ *
+ * @pre Flag ::NF9_UPSCALE_COUNTERS needs to be set in nf9_init().
+ *
+ * @param pkt Decoded NetFlow packet, created with nf9_decode().
+ * @param flowset Index of the flowset.
+ * @param counter The counter to get, one of the values of enum ::nf9_counter.
+ * @return Array of upscaled counter values in host byte order, or NULL if
+ * @p flowset is not a data flowset.
+ */
+NF9_API const uint64_t* nf9_get_upscaled_column(const nf9_packet* pkt,
+                                                unsigned flowset,
+                                                int counter);
+
+/**
+ * @brief Get the dictionary ID of the value of a text field of a flow.
+ *
+ * Values with the same text, without their null padding, have the same ID
+ * in all packets decoded by the same decoder, so they can be grouped and
+ * compared as integers.  The text can be retrieved with nf9_get_string().
+ *
+ * @pre Flag ::NF9_INTERN_STRINGS needs to be set in nf9_init().
+ *
+ * @param pkt Decoded NetFlow packet, created with nf9_decode().
+ * @param flowset Index of the flowset.
+ * @param flownum Index of the flow within the flowset.
+ * @param field One of the text fields listed for ::NF9_INTERN_STRINGS.
+ * @param[out] id The ID of the value, which is never 0.
+ * @return 0 on success; ::NF9_ERR_NOT_FOUND if the flow has no such field,
+ * its value is empty or it didn't fit in the dictionary (see
+ * ::NF9_OPT_MAX_STRING_MEM_USAGE);
+ * on other errors, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_string_id(const nf9_packet* pkt, unsigned flowset,
+                              unsigned flownum, nf9_field field,
+                              uint32_t* id);
+
+/**
+ * @brief Get a string from the dictionary of a NetFlow decoder.
+ *
+ * Strings are never removed from the dictionary.  This function can be
+ * called from another thread while packets are being decoded.
+ *
+ * @param state NetFlow decoder.
+ * @param id ID returned by nf9_get_string_id().
+ * @return The null-terminated string, valid as long as the decoder, or NULL
+ * if there is no string with this ID.
+ */
+NF9_API const char* nf9_get_string(const nf9_state* state, uint32_t id);
+
 /**
  * @brief Get statistics of a NetFlow decoder.
  *
@@ -652,6 +1173,21 @@ NF9_API int nf9_get_sampling_rate(const nf9_packet* pkt, unsigned flowset,
  */
 NF9_API const nf9_stats* nf9_get_stats(const nf9_state* state);
 
+/**
+ * @brief Get statistics of a NetFlow decoder without allocating memory.
+ *
+ * Statistics are stored in @p values, indexed by enum ::nf9_stat.  This
+ * function can be called from another thread while packets are being
+ * decoded; it doesn't slow down decoding.
+ *
+ * @param state NetFlow decoder.
+ * @param[out] values Array for the statistics.
+ * @param count Size of @p values; at most ::NF9_NUM_STATS values are stored.
+ * @return Number of values stored in @p values.
+ */
+NF9_API size_t nf9_get_stats_into(const nf9_state* state, uint64_t* values,
+                                  size_t count);
+
 /**
  * @brief Get a specific statistic.
  *
@@ -668,6 +1204,234 @@ NF9_API uint64_t nf9_get_stat(const nf9_stats* stats, int stat);
  */
 NF9_API void nf9_free_stats(const nf9_stats* stats);
 
+/**
+ * @brief Get the number of exporters known to a NetFlow decoder.
+ *
+ * @param state NetFlow decoder.
+ * @return Number of exporters whose statistics can be read with
+ * nf9_get_exporter_stats().
+ */
+NF9_API size_t nf9_get_num_exporters(const nf9_state* state);
+
+/**
+ * @brief Get statistics of all exporters known to a NetFlow decoder.
+ *
+ * Exporters are stored in unspecified order.  Statistics are kept in the
+ * same memory as templates, so they are subject to the memory limit and
+ * are removed together with expired exporters.  This function must not be
+ * called concurrently with nf9_decode() on the same decoder.
+ *
+ * @param state NetFlow decoder.
+ * @param[out] out Array where statistics will be written.
+ * @param[in,out] size Initially points to size of @p out.  On success,
+ * overwritten with number of exporters written to @p out.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_exporter_stats(const nf9_state* state,
+                                   nf9_exporter_stats* out, size_t* size);
+
+/**
+ * @brief Format statistics of a NetFlow decoder as OpenMetrics text.
+ *
+ * The output contains all values of enum ::nf9_stat, statistics of every
+ * exporter (see nf9_get_exporter_stats()) and, if the library was built
+ * with the `NF9_ENABLE_TIMING` CMake option, histograms of durations of
+ * decoding stages.  It can be served as is to Prometheus.  This function
+ * doesn't allocate memory.
+ *
+ * Statistics of exporters are read from the exporter table without
+ * locking, so this function must not be called concurrently with
+ * nf9_decode() on the same decoder, like nf9_get_exporter_stats().
+ *
+ * Like snprintf(), the output is truncated to fit in @p len bytes,
+ * including the terminating null byte.
+ *
+ * @param state NetFlow decoder.
+ * @param[out] buf Buffer for the output.
+ * @param len Size of @p buf.
+ * @return Length of the whole output, excluding the terminating null byte.
+ * If the returned value is @p len or more, the output was truncated.
+ */
+NF9_API size_t nf9_format_metrics(const nf9_state* state, char* buf,
+                                  size_t len);
+
+/**
+ * @brief Publish statistics of a NetFlow decoder in shared memory.
+ *
+ * Creates a POSIX shared memory object named @p name, which other
+ * processes can read with nf9_open_stats_reader().  Statistics are
+ * updated by nf9_decode(), at most once per
+ * ::NF9_OPT_STATS_PUBLISH_INTERVAL.  The object is removed by nf9_free().
+ *
+ * If the object already exists, e.g. because a previous instance of the
+ * program crashed, it's reused, so that readers which have it open keep
+ * seeing the updates; then it's not removed by nf9_free().  Calling this
+ * function again with the same name only updates the statistics.
+ *
+ * Only one decoder can publish to a name at a time.  While a decoder in
+ * any process publishes to @p name, this function fails for other
+ * decoders with ::NF9_ERR_SYSTEM and `errno` set to `EBUSY`.
+ *
+ * @param state NetFlow decoder.
+ * @param name Name of the shared memory object, e.g. "/nf9-stats".  See
+ * shm_open(3).
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_publish_stats(nf9_state* state, const char* name);
+
+/**
+ * @brief Open statistics published by a NetFlow decoder in another process.
+ *
+ * The returned object must be closed with nf9_close_stats_reader().  If
+ * the decoder is still creating the shared memory object, this function
+ * fails with `errno` set to `EAGAIN`, and can be called again.
+ *
+ * @param name Name passed to nf9_publish_stats().
+ * @return A reader object, or NULL on error, with `errno` set.
+ */
+NF9_API nf9_stats_reader* nf9_open_stats_reader(const char* name);
+
+/**
+ * @brief Read a consistent snapshot of published statistics.
+ *
+ * This function doesn't block the decoder, and doesn't wait for it
+ * indefinitely: if the statistics change during every one of a limited
+ * number of attempts, e.g. because the decoder crashed in the middle of an
+ * update, it fails with ::NF9_ERR_SYSTEM and `errno` set to `EAGAIN`.
+ *
+ * @param reader Object returned by nf9_open_stats_reader().
+ * @param[out] values Array for the statistics, indexed by enum ::nf9_stat.
+ * @param[in,out] count Initially points to size of @p values.  On success,
+ * overwritten with number of values written to @p values.
+ * @param[out] timestamp If not NULL, time of the last update in
+ * nanoseconds since the epoch.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_read_published_stats(const nf9_stats_reader* reader,
+                                     uint64_t* values, size_t* count,
+                                     uint64_t* timestamp);
+
+/**
+ * @brief Close a reader of published statistics.
+ *
+ * @param reader Object returned by nf9_open_stats_reader().
+ */
+NF9_API void nf9_close_stats_reader(nf9_stats_reader* reader);
+
+/**
+ * @brief Save templates, options and sampling rates of a NetFlow decoder
+ * to a file.
+ *
+ * The file can be loaded with nf9_load_state(), e.g. after restarting the
+ * program, so that data flowsets can be decoded before exporters resend
+ * their templates.  Options are saved with the records stored under each
+ * scope and the names of interfaces.  The file is written atomically and
+ * synced to disk: if saving fails, the previous file at @p path is left as
+ * it was.
+ *
+ * @param state NetFlow decoder.
+ * @param path Path of the file.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_save_state(const nf9_state* state, const char* path);
+
+/**
+ * @brief Load templates, options and sampling rates saved with
+ * nf9_save_state().
+ *
+ * The file must have been saved by the same version of the library on a
+ * machine with the same byte order.  Loaded objects expire like the ones
+ * received from exporters, based on their original timestamps.  Templates,
+ * options and sampling rates already known to the decoder were received
+ * after the file was saved, so they are kept, and so is the time when their
+ * exporter was last seen.
+ *
+ * The file is loaded as a whole: if it's malformed or the decoder runs out
+ * of memory, nothing loaded from it is kept.
+ *
+ * @param state NetFlow decoder.
+ * @param path Path of the file.
+ * @return 0 on success, ::NF9_ERR_MALFORMED if the file is not a valid
+ * saved state; on other errors, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_load_state(nf9_state* state, const char* path);
+
+/**
+ * @brief Share templates with NetFlow decoders in other processes.
+ *
+ * Attaches the decoder to a template store in a POSIX shared memory object
+ * named @p name, creating it if it doesn't exist.  Templates received by
+ * any attached decoder are copied to the store, replacing what's stored
+ * for the same exporter and template ID, and a decoder that gets a data
+ * flowset with an unknown template looks it up there.  Known templates
+ * are checked for redefinitions by other decoders at most once per second
+ * of the exporter's time.  Shared templates older than
+ * ::NF9_OPT_TEMPLATE_EXPIRE_TIME, or with timestamps in the future of the
+ * packet, e.g. after the clock of the exporter stepped back, are ignored.
+ * Templates with more than 64 fields are not shared.
+ *
+ * The store has a fixed number of slots; when it's full, the oldest
+ * templates are replaced.  Readers never block writers.  The shared memory
+ * object is not removed by nf9_free(); remove it with shm_unlink() when no
+ * decoder uses it.
+ *
+ * @param state NetFlow decoder.
+ * @param name Name of the shared memory object, e.g. "/nf9-templates".
+ * @param num_slots Maximum number of templates in the store.  All
+ * decoders attached to the same store must use the same value.
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_attach_template_store(nf9_state* state, const char* name,
+                                      size_t num_slots);
+
+/**
+ * @brief Get a quantile of durations of a decoding stage.
+ *
+ * Durations are kept in log-linear histograms, so the returned value is
+ * within 12.5% of the exact quantile.
+ *
+ * @pre The library needs to be built with the `NF9_ENABLE_TIMING` CMake
+ * option.
+ *
+ * @param state NetFlow decoder.
+ * @param stage The stage, one of the values of enum ::nf9_stage.
+ * @param quantile Quantile to get, between 0 and 1 (e.g. 0.99).
+ * @param[out] nanoseconds Upper bound of the histogram bucket which holds
+ * the quantile, in nanoseconds.
+ * @return 0 on success, ::NF9_ERR_NOT_FOUND if nothing was measured yet, or
+ * ::NF9_ERR_INVALID_ARGUMENT if the arguments are invalid or timing was not
+ * enabled.
+ */
+NF9_API int nf9_get_stage_quantile(const nf9_state* state, int stage,
+                                   double quantile, uint64_t* nanoseconds);
+
+/**
+ * @brief Get the histogram of durations of a decoding stage.
+ *
+ * @pre The library needs to be built with the `NF9_ENABLE_TIMING` CMake
+ * option.
+ *
+ * @param state NetFlow decoder.
+ * @param stage The stage, one of the values of enum ::nf9_stage.
+ * @param[out] counts Array of ::NF9_HISTOGRAM_BUCKETS elements for numbers
+ * of measurements in each bucket.  Bounds of the buckets are returned by
+ * nf9_get_histogram_bucket_bound().
+ * @return 0 on success; on error, a value from enum ::nf9_error.
+ */
+NF9_API int nf9_get_stage_histogram(const nf9_state* state, int stage,
+                                    uint64_t* counts);
+
+/**
+ * @brief Get the smallest duration in nanoseconds that falls into a
+ * histogram bucket.
+ *
+ * Bucket @p bucket holds durations from nf9_get_histogram_bucket_bound(bucket)
+ * up to, but excluding nf9_get_histogram_bucket_bound(bucket + 1).
+ *
+ * @param bucket Index of the bucket, less than ::NF9_HISTOGRAM_BUCKETS.
+ */
+NF9_API uint64_t nf9_get_histogram_bucket_bound(unsigned bucket);
+
 /**
  * @brief Set NetFlow9 decoder options.
  *
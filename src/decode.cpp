@@ -5,8 +5,10 @@
  */
 
 #include "decode.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include "dictionary.h"
 #include "sampling.h"
 #include "storage.h"
 
@@ -64,8 +66,7 @@ struct buffer
 struct context
 {
     buffer& buf;
-    uint32_t source_id;
-    const nf9_addr& srcaddr;
+    uint32_t exporter;
     nf9_packet& result;
     nf9_state& state;
 };
@@ -122,7 +123,7 @@ static int decode_template_field(buffer& buf, uint16_t& type, uint16_t& length)
     return 0;
 }
 
-static int decode_data_template(buffer& buf, data_template& tmpl,
+static int decode_data_template(buffer& buf, parsed_template& tmpl,
                                 nf9_packet& result)
 {
     uint16_t type;
@@ -131,14 +132,58 @@ static int decode_data_template(buffer& buf, data_template& tmpl,
     if (int err = decode_template_field(buf, type, length); err != 0)
         return err;
 
-    tmpl.fields.emplace_back(NF9_DATA_FIELD(type), length);
-    tmpl.total_length += length;
+    if (!tmpl.add_field(NF9_DATA_FIELD(type), length))
+        return NF9_ERR_MALFORMED;
     tmpl.timestamp = result.timestamp;
     tmpl.is_option = false;
 
     return 0;
 }
 
+static int decode_data_flowset(context& ctx, uint16_t flowset_id);
+
+// Check that `size' charged bytes of a flowset, and the array of flowsets,
+// which may be reallocated while it grows, fit in the memory limit of the
+// packet before any of them is allocated.
+static bool flowset_fits(const limited_memory_resource& mr,
+                         const context& ctx, size_t size)
+{
+    return mr.fits(size + mr.charged_size(3 * (ctx.result.flowsets.size() + 1) *
+                                          sizeof(flowset)));
+}
+
+// Reserve room for at most `max_fields' fields of a template, so that the
+// memory limit of the packet is only checked once.
+static bool reserve_fields(const context& ctx, parsed_template& tmpl,
+                           size_t max_fields)
+{
+    // Each field takes its type and length in the flowset.
+    max_fields =
+        std::min(max_fields, ctx.buf.remaining() / (2 * sizeof(uint16_t)));
+    if (ctx.result.memory &&
+        !flowset_fits(*ctx.result.memory, ctx,
+                      ctx.result.memory->charged_size(
+                          max_fields * sizeof(template_field))))
+        return false;
+    tmpl.fields.reserve(max_fields);
+    return true;
+}
+
+// Decode data flowsets that arrived before the template with given ID.
+static void replay_pending_flowsets(context& ctx, uint16_t tid)
+{
+    if (ctx.state.exporters[ctx.exporter].pending.empty())
+        return;
+
+    for (pending_flowset& pf : take_pending_flowsets(
+             ctx.state, ctx.exporter, tid, ctx.result.timestamp)) {
+        buffer buf{pf.data.data(), pf.data.size(), pf.data.data()};
+        context sub_ctx = {buf, ctx.exporter, ctx.result, ctx.state};
+        if (decode_data_flowset(sub_ctx, tid) == 0)
+            ctx.state.stats.add(NF9_STAT_REPLAYED_FLOWSETS);
+    }
+}
+
 static int decode_data_template_flowset(context& ctx)
 {
     while (ctx.buf.remaining() > 0) {
@@ -146,10 +191,12 @@ static int decode_data_template_flowset(context& ctx)
         if (!ctx.buf.get(&header, sizeof(header)))
             return NF9_ERR_MALFORMED;
 
-        flowset f = flowset();
+        flowset f(ctx.result.mr);
         f.type = NF9_FLOWSET_TEMPLATE;
-        data_template& tmpl = f.dtemplate;
+        parsed_template tmpl(ctx.result.mr);
         uint16_t field_count = ntohs(header.field_count);
+        if (!reserve_fields(ctx, tmpl, field_count))
+            return NF9_ERR_OUT_OF_MEMORY;
 
         while (field_count-- > 0 && ctx.buf.remaining() > 0) {
             if (int err = decode_data_template(ctx.buf, tmpl, ctx.result);
@@ -157,18 +204,18 @@ static int decode_data_template_flowset(context& ctx)
                 return err;
         }
 
-        stream_id sid = {device_id{ctx.srcaddr, ctx.source_id},
-                         ntohs(header.template_id)};
+        stream_id sid = {ctx.exporter, ntohs(header.template_id)};
 
-        if (int err = save_template(tmpl, sid, ctx.state, ctx.result); err != 0)
+        if (int err = save_template(tmpl, sid, ctx.state); err != 0)
             return err;
 
         ctx.result.flowsets.emplace_back(std::move(f));
+        replay_pending_flowsets(ctx, sid.tid);
     }
     return 0;
 }
 
-static int decode_option_template(buffer& buf, data_template& tmpl,
+static int decode_option_template(buffer& buf, parsed_template& tmpl,
                                   uint16_t option_scope_length,
                                   uint16_t option_length, uint32_t timestamp)
 {
@@ -181,9 +228,8 @@ static int decode_option_template(buffer& buf, data_template& tmpl,
         if (length == 0)
             return NF9_ERR_MALFORMED;
 
-        nf9_field field_type = NF9_SCOPE_FIELD(type);
-        tmpl.fields.emplace_back(field_type, length);
-        tmpl.total_length += length;
+        if (!tmpl.add_field(NF9_SCOPE_FIELD(type), length))
+            return NF9_ERR_MALFORMED;
         if (option_scope_length < sizeof(type) + sizeof(length))
             return NF9_ERR_MALFORMED;
         option_scope_length -= sizeof(type) + sizeof(length);
@@ -195,9 +241,8 @@ static int decode_option_template(buffer& buf, data_template& tmpl,
         if (length == 0)
             return NF9_ERR_MALFORMED;
 
-        nf9_field field_type = NF9_DATA_FIELD(type);
-        tmpl.fields.emplace_back(field_type, length);
-        tmpl.total_length += length;
+        if (!tmpl.add_field(NF9_DATA_FIELD(type), length))
+            return NF9_ERR_MALFORMED;
         if (option_length < sizeof(type) + sizeof(length))
             return NF9_ERR_MALFORMED;
         option_length -= sizeof(type) + sizeof(length);
@@ -215,9 +260,14 @@ static int decode_option_template_flowset(context& ctx)
     if (!ctx.buf.get(&header, sizeof(header)))
         return NF9_ERR_MALFORMED;
 
-    flowset f = flowset();
+    flowset f(ctx.result.mr);
     f.type = NF9_FLOWSET_OPTIONS;
-    data_template& tmpl = f.dtemplate;
+    parsed_template tmpl(ctx.result.mr);
+    if (!reserve_fields(ctx, tmpl,
+                        (ntohs(header.option_scope_length) +
+                         ntohs(header.option_length)) /
+                            (2 * sizeof(uint16_t))))
+        return NF9_ERR_OUT_OF_MEMORY;
 
     if (int err = decode_option_template(
             ctx.buf, tmpl, ntohs(header.option_scope_length),
@@ -225,13 +275,13 @@ static int decode_option_template_flowset(context& ctx)
         err != 0)
         return err;
 
-    stream_id sid = {device_id{ctx.srcaddr, ctx.source_id},
-                     ntohs(header.template_id)};
+    stream_id sid = {ctx.exporter, ntohs(header.template_id)};
 
-    if (int err = save_template(tmpl, sid, ctx.state, ctx.result); err != 0)
+    if (int err = save_template(tmpl, sid, ctx.state); err != 0)
         return err;
 
     ctx.result.flowsets.emplace_back(std::move(f));
+    replay_pending_flowsets(ctx, sid.tid);
 
     // omit padding bytes
     ctx.buf.advance(ctx.buf.remaining());
@@ -240,7 +290,7 @@ static int decode_option_template_flowset(context& ctx)
 
 static int decode_flow(context& ctx, data_template& tmpl, flowset& result)
 {
-    if (tmpl.fields.empty()) {
+    if (tmpl.num_fields() == 0) {
         ctx.buf.advance(ctx.buf.remaining());
         return 0;
     }
@@ -250,11 +300,12 @@ static int decode_flow(context& ctx, data_template& tmpl, flowset& result)
         return 0;
     }
 
-    flow f = flow();
+    pmr::memory_resource* mr = ctx.result.mr;
+    flow f = flow(mr);
 
-    for (const template_field& tf : tmpl.fields) {
-        uint32_t type = tf.first;
-        size_t field_length = tf.second;
+    for (size_t i = 0; i < tmpl.num_fields(); ++i) {
+        uint32_t type = tmpl.field_type(i);
+        size_t field_length = tmpl.fields()[i].length;
 
         if (field_length > ctx.buf.remaining())
             return NF9_ERR_MALFORMED;
@@ -262,23 +313,22 @@ static int decode_flow(context& ctx, data_template& tmpl, flowset& result)
         if (field_length == 0)
             break;
 
-        pmr::vector<uint8_t> field_value(field_length, 0);
+        pmr::vector<uint8_t> field_value(field_length, 0, mr);
         ctx.buf.get(field_value.data(), field_length);
 
-        f[type] = field_value;
+        f[type] = std::move(field_value);
     }
 
-    if (tmpl.is_option) {
-        device_id dev_id = {ctx.srcaddr, ctx.source_id};
+    if (tmpl.is_option()) {
         device_options dev_opts = {f, ctx.result.timestamp};
-        if (int err = save_option(ctx.state, dev_id, dev_opts); err != 0)
+        if (int err = save_option(ctx.state, ctx.exporter, dev_opts); err != 0)
             return err;
 
         if (ctx.state.store_sampling_rates) {
             // Save sampling rates if the user enabled that.
 
             // FIXME: handle error once proper enums are defined.
-            save_sampling_info(ctx.state, f, dev_id);
+            save_sampling_info(ctx.state, f, ctx.exporter);
         }
     }
 
@@ -286,35 +336,167 @@ static int decode_flow(context& ctx, data_template& tmpl, flowset& result)
     return 0;
 }
 
+// Resolve sampling rates of all records of a decoded flowset.  Records were
+// read back to back from @records, each one tmpl.total_length bytes long.
+static void annotate_sampling_rates(context& ctx, const data_template& tmpl,
+                                    const uint8_t* records, flowset& f)
+{
+    size_t offset = 0;
+    size_t length = 0;
+
+    if (!tmpl.find_field(NF9_FIELD_FLOW_SAMPLER_ID, offset, length) ||
+        length > sizeof(uint32_t)) {
+        f.samplings.assign(f.flows.size(),
+                           {0, NF9_SAMPLING_SAMPLER_ID_NOT_FOUND});
+        return;
+    }
+
+    // Records of a flowset use very few distinct samplers, so look up each
+    // one only once.
+    const size_t CACHE_SIZE = 8;
+    std::pair<uint32_t, record_sampling> cache[CACHE_SIZE];
+    size_t cached = 0;
+
+    f.samplings.reserve(f.flows.size());
+    for (size_t i = 0; i < f.flows.size(); ++i) {
+        uint8_t bytes[sizeof(uint32_t)] = {};
+        memcpy(bytes + sizeof(bytes) - length,
+               records + i * tmpl.total_length + offset, length);
+        uint32_t sampler;
+        memcpy(&sampler, bytes, sizeof(sampler));
+        sampler = ntohl(sampler);
+
+        size_t j = 0;
+        while (j < cached && cache[j].first != sampler)
+            ++j;
+
+        if (j == cached) {
+            record_sampling rs =
+                find_sampling_rate(ctx.state, ctx.exporter, sampler);
+            if (cached == CACHE_SIZE) {
+                f.samplings.push_back(rs);
+                continue;
+            }
+            cache[cached++] = {sampler, rs};
+        }
+        f.samplings.push_back(cache[j].second);
+    }
+}
+
+// Check that records of a data flowset fit in the memory limit of the packet
+// before any of them is allocated.
+static bool records_fit(const context& ctx, const data_template& tmpl)
+{
+    if (!ctx.result.memory || tmpl.total_length == 0)
+        return true;
+
+    const limited_memory_resource& mr = *ctx.result.memory;
+    size_t num_records = ctx.buf.remaining() / tmpl.total_length;
+
+    // A record is a hash table with a node and a value per field.  While
+    // the table grows, the old and new bucket arrays are both allocated.
+    size_t record_size =
+        2 * mr.charged_size((2 * tmpl.num_fields() + 16) * sizeof(void*));
+    for (size_t i = 0; i < tmpl.num_fields(); ++i)
+        record_size +=
+            mr.charged_size(2 * sizeof(void*) + sizeof(flow::value_type)) +
+            mr.charged_size(tmpl.fields()[i].length);
+
+    // Arrays of records, sampling rates, counters and string IDs, each of
+    // which may be reallocated while it grows.  Upscaling counters also
+    // needs a temporary array of rates.
+    size_t size =
+        num_records * record_size +
+        mr.charged_size(3 * num_records * sizeof(flow)) +
+        mr.charged_size(num_records * sizeof(record_sampling)) +
+        mr.charged_size(num_records * NF9_NUM_COUNTERS * sizeof(uint64_t)) +
+        mr.charged_size(num_records * sizeof(uint64_t)) +
+        mr.charged_size(num_records * NUM_TEXT_FIELDS * sizeof(uint32_t));
+    return flowset_fits(mr, ctx, size);
+}
+
 static int decode_data_flowset(context& ctx, uint16_t flowset_id)
 {
-    stream_id sid = {device_id{ctx.srcaddr, ctx.source_id}, flowset_id};
+    stream_id sid = {ctx.exporter, flowset_id};
 
-    flowset f = flowset();
+    flowset f(ctx.result.mr);
     f.type = NF9_FLOWSET_DATA;
 
-    if (ctx.state.templates.count(sid) == 0) {
-        ++ctx.state.stats.missing_template_errors;
+    template_table& table = ctx.state.exporters[sid.exporter].templates;
+    data_template* tmpl = table.find(sid.tid);
+
+    // The template may have been received, refreshed or redefined by a
+    // decoder in another process.  A known template is looked up at most
+    // once per second of the exporter's time.  Shared templates that would
+    // have expired, or are from the future because the exporter's clock
+    // stepped back, are ignored.
+    if (ctx.state.template_store &&
+        (tmpl == nullptr || tmpl->last_used != ctx.result.timestamp)) {
+        if (tmpl != nullptr && ctx.result.timestamp - tmpl->timestamp >
+                                   ctx.state.template_expire_time) {
+            ctx.state.stats.add(NF9_STAT_EXPIRED_OBJECTS);
+            delete_template(ctx.state, sid);
+            tmpl = nullptr;
+        }
+
+        const device_id& dev_id = ctx.state.exporters[sid.exporter].dev_id;
+        const shared_template_store& store = *ctx.state.template_store;
+        parsed_template shared(ctx.state.heap);
+        if ((tmpl == nullptr ||
+             store.newer(dev_id, sid.tid, tmpl->timestamp)) &&
+            store.get(dev_id, sid.tid, shared) &&
+            ctx.result.timestamp - shared.timestamp <=
+                ctx.state.template_expire_time &&
+            save_template(shared, sid, ctx.state) == 0)
+            tmpl = table.find(sid.tid);
+    }
+
+    // Keep the flowset until the template arrives.
+    if (tmpl == nullptr && ctx.state.max_pending_bytes > 0 &&
+        queue_pending_flowset(ctx.state, ctx.exporter, sid.tid,
+                              ctx.result.timestamp, ctx.buf.ptr,
+                              ctx.buf.remaining())) {
         ctx.buf.advance(ctx.buf.remaining());
         return 0;
     }
 
-    data_template& tmpl = ctx.state.templates[sid];
+    if (tmpl == nullptr) {
+        ctx.state.stats.add(NF9_STAT_MISSING_TEMPLATE_ERRORS);
+        ++ctx.state.exporters[ctx.exporter].counters.missing_templates;
+        ctx.buf.advance(ctx.buf.remaining());
+        return 0;
+    }
 
-    uint32_t tmpl_lifetime = ctx.result.timestamp - tmpl.timestamp;
+    uint32_t tmpl_lifetime = ctx.result.timestamp - tmpl->timestamp;
 
     if (tmpl_lifetime > ctx.state.template_expire_time) {
-        ++ctx.state.stats.expired_templates;
-        ctx.state.templates.erase(sid);
+        ctx.state.stats.add(NF9_STAT_EXPIRED_OBJECTS);
+        delete_template(ctx.state, sid);
         ctx.buf.advance(ctx.buf.remaining());
         return 0;
     }
 
+    if (!records_fit(ctx, *tmpl))
+        return NF9_ERR_OUT_OF_MEMORY;
+
+    tmpl->last_used = ctx.result.timestamp;
+    if (tmpl->hits == UINT16_MAX)
+        age_hits(ctx.state);
+    ++tmpl->hits;
+
+    const uint8_t* records = ctx.buf.ptr;
     while (ctx.buf.remaining() > 0) {
-        if (int err = decode_flow(ctx, tmpl, f); err != 0)
+        if (int err = decode_flow(ctx, *tmpl, f); err != 0)
             return err;
     }
 
+    if (ctx.state.store_sampling_rates)
+        annotate_sampling_rates(ctx, *tmpl, records, f);
+    if (ctx.state.upscale_counters)
+        upscale_counters(*tmpl, records, f);
+    if (ctx.state.intern_strings)
+        intern_text_fields(ctx.state, *tmpl, records, f);
+
     ctx.result.flowsets.emplace_back(std::move(f));
 
     return 0;
@@ -342,23 +524,31 @@ static int decode_flowset(context& ctx)
     buffer tmpbuf{ctx.buf.ptr, flowset_length, ctx.buf.ptr};
     ctx.buf.advance(flowset_length);
 
-    context sub_ctx = {tmpbuf, ctx.source_id, ctx.srcaddr, ctx.result,
-                       ctx.state};
+    context sub_ctx = {tmpbuf, ctx.exporter, ctx.result, ctx.state};
 
     uint16_t flowset_id = ntohs(header.flowset_id);
 
     switch (get_flowset_type(flowset_id)) {
-        case NF9_FLOWSET_TEMPLATE:
-            ctx.state.stats.data_templates++;
+        case NF9_FLOWSET_TEMPLATE: {
+            NF9_TIME_STAGE(ctx.state, NF9_STAGE_DATA_TEMPLATE_FLOWSET);
+            ctx.state.stats.add(NF9_STAT_TOTAL_DATA_TEMPLATES);
+            ++ctx.state.exporters[ctx.exporter].counters.templates;
             return decode_data_template_flowset(sub_ctx);
-        case NF9_FLOWSET_OPTIONS:
-            ctx.state.stats.option_templates++;
+        }
+        case NF9_FLOWSET_OPTIONS: {
+            NF9_TIME_STAGE(ctx.state, NF9_STAGE_OPTION_TEMPLATE_FLOWSET);
+            ctx.state.stats.add(NF9_STAT_TOTAL_OPTION_TEMPLATES);
+            ++ctx.state.exporters[ctx.exporter].counters.templates;
             return decode_option_template_flowset(sub_ctx);
-        case NF9_FLOWSET_DATA:
-            ctx.state.stats.records++;
+        }
+        case NF9_FLOWSET_DATA: {
+            NF9_TIME_STAGE(ctx.state, NF9_STAGE_DATA_FLOWSET);
+            ctx.state.stats.add(NF9_STAT_TOTAL_RECORDS);
+            ++ctx.state.exporters[ctx.exporter].counters.records;
             return decode_data_flowset(sub_ctx, flowset_id);
+        }
         default:
-            ctx.state.stats.malformed_packets++;
+            ctx.state.stats.add(NF9_STAT_MALFORMED_PACKETS);
             return NF9_ERR_MALFORMED;
     }
 
@@ -372,14 +562,31 @@ int decode(const uint8_t* data, size_t len, const nf9_addr& srcaddr,
     buffer buf{data, len, data};
     netflow_header header;
 
-    if (int err = decode_header(buf, header, result->timestamp,
-                                result->system_uptime);
-        err != 0)
-        return NF9_ERR_MALFORMED;
+    {
+        NF9_TIME_STAGE(*state, NF9_STAGE_HEADER);
+
+        if (int err = decode_header(buf, header, result->timestamp,
+                                    result->system_uptime);
+            err != 0)
+            return NF9_ERR_MALFORMED;
 
-    result->src_id = ntohl(header.source_id);
+        result->src_id = ntohl(header.source_id);
 
-    context ctx = {buf, ntohl(header.source_id), srcaddr, *result, *state};
+        // Resolve the exporter once per packet, all further lookups use its
+        // index.
+        if (int err = register_exporter(*state,
+                                        device_id{srcaddr, result->src_id},
+                                        result->timestamp, result->exporter);
+            err != 0)
+            return err;
+
+        exporter_counters& counters =
+            state->exporters[result->exporter].counters;
+        ++counters.packets;
+        counters.bytes += len;
+    }
+
+    context ctx = {buf, result->exporter, *result, *state};
 
     size_t num_flowsets = ntohs(header.count);
     for (size_t i = 0; i < num_flowsets && buf.remaining() > 0; ++i) {
@@ -387,5 +594,15 @@ int decode(const uint8_t* data, size_t len, const nf9_addr& srcaddr,
             return err;
     }
 
+    // Pin the options of the exporter as they are after this packet.
+    exporter& exp = state->exporters[result->exporter];
+    result->options = exp.options;
+    if (exp.options) {
+        exp.options_last_used = result->timestamp;
+        if (exp.options_hits == UINT16_MAX)
+            age_hits(*state);
+        ++exp.options_hits;
+    }
+
     return 0;
 }
@@ -0,0 +1,134 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include "dictionary.h"
+#include <algorithm>
+#include <cstring>
+#include "storage.h"
+
+// Block k holds FIRST_BLOCK_SIZE << k entries.
+static size_t block_size(size_t block)
+{
+    return string_dictionary::FIRST_BLOCK_SIZE << block;
+}
+
+// Block and position within the block of the entry with given index.
+static std::pair<size_t, size_t> locate(size_t index)
+{
+    const int first_bit = __builtin_ctzll(string_dictionary::FIRST_BLOCK_SIZE);
+    size_t n = index + string_dictionary::FIRST_BLOCK_SIZE;
+    size_t block = 63 - __builtin_clzll(n) - first_bit;
+    return {block, n - block_size(block)};
+}
+
+string_dictionary::~string_dictionary()
+{
+    for (const auto& [text, _] : ids_)
+        mr_->deallocate(const_cast<char*>(text.data()), text.size() + 1, 1);
+    for (size_t i = 0; i < MAX_BLOCKS && blocks_[i]; ++i)
+        mr_->deallocate(blocks_[i], block_size(i) * sizeof(const char*),
+                        alignof(const char*));
+}
+
+uint32_t string_dictionary::find(std::string_view text) const
+{
+    auto it = ids_.find(text);
+    return it != ids_.end() ? it->second : 0;
+}
+
+const char* string_dictionary::find(uint32_t id) const
+{
+    if (id == 0 || id > size_.load(std::memory_order_acquire))
+        return nullptr;
+    auto [block, position] = locate(id - 1);
+    return blocks_[block][position];
+}
+
+// Size of a node of the index.
+static constexpr size_t NODE_SIZE =
+    2 * sizeof(void*) + sizeof(std::pair<std::string_view, uint32_t>);
+
+size_t string_dictionary::insert_size(size_t length) const
+{
+    // The string, its node in the index and the bucket array of the index
+    // if it grows, and a new block of entries.
+    size_t bytes =
+        mr_->charged_size(length + 1, 1) + mr_->charged_size(NODE_SIZE) +
+        mr_->charged_size((2 * ids_.bucket_count() + 16) * sizeof(void*));
+    if (auto [block, position] = locate(size()); position == 0)
+        bytes += mr_->charged_size(block_size(block) * sizeof(const char*));
+    return bytes;
+}
+
+size_t string_dictionary::memory() const
+{
+    return memory_ + mr_->charged_size(ids_.bucket_count() * sizeof(void*));
+}
+
+uint32_t string_dictionary::intern(std::string_view text)
+{
+    if (uint32_t id = find(text); id != 0)
+        return id;
+
+    uint32_t n = size_.load(std::memory_order_relaxed);
+    auto [index, position] = locate(n);
+    if (index == MAX_BLOCKS)
+        return 0;
+
+    const char**& block = blocks_[index];
+    if (!block) {
+        block = static_cast<const char**>(mr_->allocate(
+            block_size(index) * sizeof(*block), alignof(const char*)));
+        memory_ += mr_->charged_size(block_size(index) * sizeof(*block));
+    }
+
+    char* copy = static_cast<char*>(mr_->allocate(text.size() + 1, 1));
+    memcpy(copy, text.data(), text.size());
+    copy[text.size()] = '\0';
+    try {
+        ids_.emplace(std::string_view(copy, text.size()), n + 1);
+    } catch (...) {
+        mr_->deallocate(copy, text.size() + 1, 1);
+        throw;
+    }
+
+    memory_ +=
+        mr_->charged_size(text.size() + 1, 1) + mr_->charged_size(NODE_SIZE);
+
+    // Readers in other threads see the entry once they see the new size.
+    block[position] = copy;
+    size_.store(n + 1, std::memory_order_release);
+    return n + 1;
+}
+
+size_t text_field_column(nf9_field field)
+{
+    return std::find(std::begin(TEXT_FIELDS), std::end(TEXT_FIELDS), field) -
+           std::begin(TEXT_FIELDS);
+}
+
+void intern_text_fields(nf9_state& st, const data_template& tmpl,
+                        const uint8_t* records, flowset& f)
+{
+    const size_t n = f.flows.size();
+    f.string_ids.assign(NUM_TEXT_FIELDS * n, 0);
+
+    for (size_t column = 0; column < NUM_TEXT_FIELDS; ++column) {
+        size_t offset;
+        size_t length;
+        if (!tmpl.find_field(TEXT_FIELDS[column], offset, length))
+            continue;
+
+        uint32_t* ids = f.string_ids.data() + column * n;
+        for (size_t i = 0; i < n; ++i) {
+            // Values are padded with null characters.
+            const char* text = reinterpret_cast<const char*>(
+                records + i * tmpl.total_length + offset);
+            ids[i] = intern_string(
+                st, std::string_view(text, strnlen(text, length)));
+        }
+    }
+}
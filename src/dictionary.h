@@ -0,0 +1,34 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <netflow9.h>
+#include "types.h"
+
+/* Fields with text values which are interned with NF9_INTERN_STRINGS, in the
+ * order of columns of flowset::string_ids. */
+constexpr nf9_field TEXT_FIELDS[] = {
+    NF9_FIELD_IF_NAME,
+    NF9_FIELD_IF_DESC,
+    NF9_FIELD_SAMPLER_NAME,
+    NF9_FIELD_APPLICATION_NAME,
+    NF9_FIELD_APPLICATION_DESCRIPTION,
+};
+
+constexpr size_t NUM_TEXT_FIELDS = sizeof(TEXT_FIELDS) / sizeof(TEXT_FIELDS[0]);
+
+/* Column of `field' in flowset::string_ids, or NUM_TEXT_FIELDS if it's not a
+ * text field. */
+size_t text_field_column(nf9_field field);
+
+/* Fill f.string_ids with IDs of values of text fields of records of a data
+ * flowset.  Records were read back to back from @records. */
+void intern_text_fields(nf9_state& st, const data_template& tmpl,
+                        const uint8_t* records, flowset& f);
+
+#endif
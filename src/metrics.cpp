@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include <arpa/inet.h>
+#include <netflow9.h>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include "storage.h"
+#include "types.h"
+
+namespace {
+
+// Appends formatted text to a fixed buffer.  Once the buffer is full, only
+// counts the length that would be needed, like snprintf().
+class metrics_writer
+{
+public:
+    metrics_writer(char* buf, size_t len) : buf_(buf), len_(len), pos_(0)
+    {
+        if (len_ > 0)
+            buf_[0] = '\0';
+    }
+
+    __attribute__((format(printf, 2, 3))) void append(const char* fmt, ...)
+    {
+        char* dst = pos_ < len_ ? buf_ + pos_ : nullptr;
+        size_t avail = pos_ < len_ ? len_ - pos_ : 0;
+
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(dst, avail, fmt, args);
+        va_end(args);
+        if (n > 0)
+            pos_ += n;
+    }
+
+    size_t length() const
+    {
+        return pos_;
+    }
+
+private:
+    char* buf_;
+    size_t len_;
+    size_t pos_;
+};
+
+struct stat_metric
+{
+    nf9_stat stat;
+    const char* name;
+    bool is_counter;
+    const char* help;
+};
+
+const stat_metric STAT_METRICS[] = {
+    {NF9_STAT_PROCESSED_PACKETS, "nf9_processed_packets", true,
+     "Number of processed packets."},
+    {NF9_STAT_MALFORMED_PACKETS, "nf9_malformed_packets", true,
+     "Number of malformed packets."},
+    {NF9_STAT_TOTAL_RECORDS, "nf9_data_flowsets", true,
+     "Number of data flowsets."},
+    {NF9_STAT_TOTAL_DATA_TEMPLATES, "nf9_data_template_flowsets", true,
+     "Number of data template flowsets."},
+    {NF9_STAT_TOTAL_OPTION_TEMPLATES, "nf9_option_template_flowsets",
+     true, "Number of option template flowsets."},
+    {NF9_STAT_MISSING_TEMPLATE_ERRORS, "nf9_missing_template_errors",
+     true, "Number of data flowsets with unknown templates."},
+    {NF9_STAT_EXPIRED_OBJECTS, "nf9_expired_objects", true,
+     "Number of expired templates and options."},
+    {NF9_STAT_MEMORY_USAGE, "nf9_memory_usage_bytes", false,
+     "Memory used for templates and options."},
+    {NF9_STAT_QUEUED_FLOWSETS, "nf9_queued_flowsets", true,
+     "Number of data flowsets queued while waiting for templates."},
+    {NF9_STAT_REPLAYED_FLOWSETS, "nf9_replayed_flowsets", true,
+     "Number of queued data flowsets decoded after templates arrived."},
+    {NF9_STAT_QUOTA_HITS, "nf9_quota_hits", true,
+     "Number of times exporters reached their memory quota."},
+    {NF9_STAT_EVICTED_OBJECTS, "nf9_evicted_objects", true,
+     "Number of templates and options deleted before they expired."},
+};
+
+struct exporter_metric
+{
+    uint64_t exporter_counters::*counter;
+    const char* name;
+    const char* help;
+};
+
+const exporter_metric EXPORTER_METRICS[] = {
+    {&exporter_counters::packets, "nf9_exporter_packets",
+     "Number of packets received from the exporter."},
+    {&exporter_counters::bytes, "nf9_exporter_bytes",
+     "Size of packets received from the exporter."},
+    {&exporter_counters::records, "nf9_exporter_data_flowsets",
+     "Number of data flowsets received from the exporter."},
+    {&exporter_counters::templates, "nf9_exporter_template_flowsets",
+     "Number of template flowsets received from the exporter."},
+    {&exporter_counters::missing_templates,
+     "nf9_exporter_missing_template_errors",
+     "Number of data flowsets with unknown templates."},
+    {&exporter_counters::malformed_packets, "nf9_exporter_malformed_packets",
+     "Number of malformed packets received from the exporter."},
+    {&exporter_counters::quota_hits, "nf9_exporter_quota_hits",
+     "Number of times the exporter reached its memory quota."},
+};
+
+// Format the exporter address, port and source ID as labels.  Exporters
+// are told apart by the source port too, so it's needed to keep the label
+// sets unique.
+void format_exporter_labels(const device_id& dev_id, char* buf, size_t len)
+{
+    char addr[INET6_ADDRSTRLEN] = "";
+    uint16_t port = 0;
+    if (dev_id.addr.family == AF_INET) {
+        inet_ntop(AF_INET, &dev_id.addr.in.sin_addr, addr, sizeof(addr));
+        port = ntohs(dev_id.addr.in.sin_port);
+    }
+    else if (dev_id.addr.family == AF_INET6) {
+        inet_ntop(AF_INET6, &dev_id.addr.in6.sin6_addr, addr, sizeof(addr));
+        port = ntohs(dev_id.addr.in6.sin6_port);
+    }
+
+    snprintf(buf, len,
+             "exporter=\"%s\",port=\"%" PRIu16 "\",source_id=\"%" PRIu32
+             "\"",
+             addr, port, dev_id.id);
+}
+
+// The exporter table is not locked, see nf9_format_metrics().
+void format_exporters(const nf9_state* state, metrics_writer& out)
+{
+    char labels[INET6_ADDRSTRLEN + 64];
+
+    for (const exporter_metric& metric : EXPORTER_METRICS) {
+        out.append("# TYPE %s counter\n# HELP %s %s\n", metric.name,
+                   metric.name, metric.help);
+        for (const auto& [dev_id, index] : state->exporter_ids) {
+            format_exporter_labels(dev_id, labels, sizeof(labels));
+            out.append("%s_total{%s} %" PRIu64 "\n", metric.name, labels,
+                       state->exporters[index].counters.*metric.counter);
+        }
+    }
+
+    out.append(
+        "# TYPE nf9_exporter_last_seen_seconds gauge\n"
+        "# HELP nf9_exporter_last_seen_seconds Timestamp of the last "
+        "packet header.\n");
+    for (const auto& [dev_id, index] : state->exporter_ids) {
+        format_exporter_labels(dev_id, labels, sizeof(labels));
+        out.append("nf9_exporter_last_seen_seconds{%s} %" PRIu32 "\n", labels,
+                   state->exporters[index].timestamp);
+    }
+
+    out.append(
+        "# TYPE nf9_exporter_memory_usage_bytes gauge\n"
+        "# HELP nf9_exporter_memory_usage_bytes Memory used for templates, "
+        "options and queued flowsets of the exporter.\n");
+    for (const auto& [dev_id, index] : state->exporter_ids) {
+        format_exporter_labels(dev_id, labels, sizeof(labels));
+        out.append("nf9_exporter_memory_usage_bytes{%s} %zu\n", labels,
+                   exporter_memory(*state, index));
+    }
+}
+
+#ifdef NF9_ENABLE_TIMING
+const char* const STAGE_NAMES[NF9_NUM_STAGES] = {
+    "header",
+    "data_template_flowset",
+    "option_template_flowset",
+    "data_flowset",
+    "expire_objects",
+};
+
+// Histogram buckets are reported at powers of two, which keeps the output
+// small while still showing the shape of the distribution.
+void format_timings(const nf9_state* state, metrics_writer& out)
+{
+    const size_t SUB_BUCKETS = 8;
+
+    out.append(
+        "# TYPE nf9_stage_duration_seconds histogram\n"
+        "# HELP nf9_stage_duration_seconds Durations of decoding stages.\n");
+
+    for (int stage = 0; stage < NF9_NUM_STAGES; ++stage) {
+        const latency_histogram& hist = state->timings[stage];
+
+        size_t last = 0;
+        for (size_t i = 0; i < NF9_HISTOGRAM_BUCKETS; ++i)
+            if (hist.count(i) != 0)
+                last = i;
+
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < NF9_HISTOGRAM_BUCKETS; ++i) {
+            cumulative += hist.count(i);
+            size_t next = i + 1;
+            if (next % SUB_BUCKETS == 0 && next <= last + SUB_BUCKETS &&
+                next < NF9_HISTOGRAM_BUCKETS)
+                out.append(
+                    "nf9_stage_duration_seconds_bucket{stage=\"%s\","
+                    "le=\"%.9g\"} %" PRIu64 "\n",
+                    STAGE_NAMES[stage],
+                    static_cast<double>(
+                        latency_histogram::bucket_lower_bound(next)) /
+                        1e9,
+                    cumulative);
+        }
+        out.append(
+            "nf9_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+            "%" PRIu64 "\n"
+            "nf9_stage_duration_seconds_count{stage=\"%s\"} %" PRIu64 "\n"
+            "nf9_stage_duration_seconds_sum{stage=\"%s\"} %.9g\n",
+            STAGE_NAMES[stage], cumulative, STAGE_NAMES[stage], cumulative,
+            STAGE_NAMES[stage], static_cast<double>(hist.sum()) / 1e9);
+    }
+}
+#endif
+
+}  // namespace
+
+size_t nf9_format_metrics(const nf9_state* state, char* buf, size_t len)
+{
+    metrics_writer out(buf, len);
+
+    uint64_t values[NF9_NUM_STATS];
+    nf9_get_stats_into(state, values, NF9_NUM_STATS);
+
+    for (const stat_metric& metric : STAT_METRICS) {
+        out.append("# TYPE %s %s\n# HELP %s %s\n", metric.name,
+                   metric.is_counter ? "counter" : "gauge", metric.name,
+                   metric.help);
+        out.append("%s%s %" PRIu64 "\n", metric.name,
+                   metric.is_counter ? "_total" : "", values[metric.stat]);
+    }
+
+    format_exporters(state, out);
+#ifdef NF9_ENABLE_TIMING
+    format_timings(state, out);
+#endif
+
+    out.append("# EOF\n");
+    return out.length();
+}
@@ -6,11 +6,14 @@
 
 #include <netflow9.h>
 #include <netinet/in.h>
-#include <climits>
+#include <cmath>
 #include <cstring>
-#include <mutex>
+#include <new>
 #include <vector>
 #include "decode.h"
+#include "dictionary.h"
+#include "pool.h"
+#include "storage.h"
 #include "types.h"
 
 const char* nf9_strerror(int err)
@@ -28,57 +31,217 @@ const char* nf9_strerror(int err)
             return "malformed packet";
         case NF9_ERR_OUTDATED:
             return "entity is outdated";
+        case NF9_ERR_SYSTEM:
+            return "system error";
         default:
             return "unknown error";
     }
 }
 
-nf9_state* nf9_init(int flags)
+// Memory reserved in nf9_init_fixed() for each object of the decoder.
+// These are generous estimates for templates of up to 32 fields and option
+// records of up to 16 fields, doubled for rounding to size classes.
+static const size_t FIXED_EXPORTER_SIZE = 2 * 512;
+static const size_t FIXED_TEMPLATE_SIZE = 2 * 256;
+static const size_t FIXED_OPTION_SET_SIZE = 2 * 2048;
+static const size_t FIXED_SAMPLER_SIZE = 2 * 128;
+
+// Memory of a packet besides its records, and slack for rounding records
+// to size classes.
+static const size_t FIXED_PACKET_OVERHEAD = 2048;
+
+static nf9_state* create_state(int flags, const nf9_allocator* allocator,
+                               const nf9_capacity* capacity)
 {
-    std::unique_ptr mr =
-        std::make_unique<limited_memory_resource>(MAX_MEMORY_USAGE);
+    std::unique_ptr<callback_memory_resource> callbacks;
+    if (allocator)
+        callbacks = std::make_unique<callback_memory_resource>(*allocator);
+    pmr::memory_resource* upstream =
+        callbacks ? callbacks.get() : pmr::new_delete_resource();
+
+    size_t max_memory = MAX_MEMORY_USAGE;
+    std::unique_ptr<pool_memory_resource> pool;
+    std::unique_ptr<pool_memory_resource> packet_pool;
+    try {
+        if (capacity) {
+            max_memory = capacity->exporters * FIXED_EXPORTER_SIZE +
+                         capacity->templates * FIXED_TEMPLATE_SIZE +
+                         capacity->option_sets * FIXED_OPTION_SET_SIZE +
+                         capacity->samplers * FIXED_SAMPLER_SIZE;
+            pool = std::make_unique<pool_memory_resource>(max_memory, upstream);
+            packet_pool = std::make_unique<pool_memory_resource>(
+                capacity->packets *
+                    (2 * capacity->packet_bytes + FIXED_PACKET_OVERHEAD),
+                upstream);
+        }
+        else if (flags & (NF9_POOL_ALLOCATOR | NF9_HUGE_PAGES)) {
+            pool = std::make_unique<pool_memory_resource>(
+                bool(flags & NF9_HUGE_PAGES), upstream);
+        }
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+    pmr::memory_resource* heap = packet_pool ? packet_pool.get() : upstream;
+
+    std::unique_ptr mr = std::make_unique<limited_memory_resource>(
+        max_memory, bool(flags & NF9_ACCURATE_MEMORY_USAGE), upstream,
+        std::move(pool));
     auto* addr = mr.get();
-    nf9_state* st = new nf9_state{
+
+    void* mem;
+    try {
+        mem = upstream->allocate(sizeof(nf9_state), alignof(nf9_state));
+    } catch (const std::exception&) {
+        return nullptr;
+    }
+
+    nf9_state* st = new (mem) nf9_state{
+        /*allocator=*/std::move(callbacks),
+        /*packet_pool=*/std::move(packet_pool),
+        /*heap=*/heap,
         /*flags=*/flags,
         /*stats=*/{},
         /*template_expire_time=*/TEMPLATE_EXPIRE_TIME,
         /*option_expire_time=*/OPTION_EXPIRE_TIME,
+        /*max_pending_bytes=*/0,
+        /*max_pending_age=*/MAX_PENDING_AGE,
+        /*max_packet_memory=*/capacity ? capacity->packet_bytes : 0,
+        /*max_exporter_memory=*/0,
+        /*max_string_memory=*/0,
+        /*eviction_policy=*/NF9_EVICTION_EXPIRED,
         /*memory=*/std::move(mr),
-        /*templates=*/
-        pmr::unordered_map<stream_id, data_template>(addr),
-        /*options=*/
-        pmr::unordered_map<device_id, device_options>(addr),
-        /*options_mutex=*/{},
-        /*store_samplings=*/bool(flags & NF9_STORE_SAMPLING_RATES),
+        /*exporter_ids=*/
+        pmr::unordered_map<device_id, uint32_t>(addr),
+        /*exporters=*/pmr::vector<exporter>(addr),
+        /*free_exporter=*/NO_EXPORTER,
+        /*options_version=*/0,
+        /*store_samplings=*/
+        bool(flags & (NF9_STORE_SAMPLING_RATES | NF9_UPSCALE_COUNTERS)),
+        /*upscale_counters=*/bool(flags & NF9_UPSCALE_COUNTERS),
+        /*intern_strings=*/bool(flags & NF9_INTERN_STRINGS),
         /*sampling_rates=*/pmr::unordered_map<sampler_id, uint32_t>(addr),
         /*simple_sampling_rates=*/
         pmr::unordered_map<simple_sampler_id, uint32_t>(addr),
+        /*shm_stats=*/nullptr,
+        /*template_store=*/nullptr,
+        /*strings=*/string_dictionary(addr),
+#ifdef NF9_ENABLE_TIMING
+        /*timings=*/{},
+#endif
     };
 
+    // Hash tables of a fixed decoder never grow.
+    if (capacity) {
+        try {
+            st->exporter_ids.reserve(capacity->exporters);
+            st->exporters.reserve(capacity->exporters);
+            st->sampling_rates.reserve(capacity->samplers);
+            st->simple_sampling_rates.reserve(capacity->samplers);
+        } catch (const std::exception&) {
+            nf9_free(st);
+            return nullptr;
+        }
+    }
+
     return st;
 }
 
+nf9_state* nf9_init(int flags)
+{
+    return create_state(flags, nullptr, nullptr);
+}
+
+nf9_state* nf9_init_ex(int flags, const nf9_allocator* allocator)
+{
+    return create_state(flags, allocator, nullptr);
+}
+
+nf9_state* nf9_init_fixed(int flags, const nf9_capacity* capacity,
+                          const nf9_allocator* allocator)
+{
+    if (capacity->exporters == 0 || capacity->templates == 0 ||
+        capacity->packets == 0 || capacity->packet_bytes == 0)
+        return nullptr;
+
+    // The memory limit is the size of the region, so allocations must be
+    // charged at their real size.
+    flags |= NF9_ACCURATE_MEMORY_USAGE;
+    return create_state(flags, allocator, capacity);
+}
+
 void nf9_free(nf9_state* state)
 {
-    delete state;
+    // The state is allocated from its own allocator, which must outlive it.
+    std::unique_ptr<callback_memory_resource> allocator =
+        std::move(state->allocator);
+    pmr::memory_resource* upstream =
+        allocator ? allocator.get() : pmr::new_delete_resource();
+
+    state->~nf9_state();
+    upstream->deallocate(state, sizeof(nf9_state), alignof(nf9_state));
+}
+
+nf9_packet::nf9_packet(nf9_state* st, const nf9_addr& address)
+    : mr(st->heap), flowsets(st->heap), addr(address), state(st)
+{
+    // Records of a fixed decoder are always checked against its packet
+    // region, so that running out of it is detected before allocating.
+    if (st->packet_pool) {
+        memory.emplace(st->max_packet_memory > 0 ? st->max_packet_memory
+                                                 : SIZE_MAX,
+                       bool(st->flags & NF9_ACCURATE_MEMORY_USAGE),
+                       st->packet_pool.get());
+        mr = &*memory;
+    }
+    else if (st->max_packet_memory > 0) {
+        memory.emplace(st->max_packet_memory,
+                       bool(st->flags & NF9_ACCURATE_MEMORY_USAGE),
+                       st->heap);
+        mr = &*memory;
+    }
 }
 
 int nf9_decode(nf9_state* state, nf9_packet** result, const uint8_t* buf,
                size_t len, const nf9_addr* addr)
 {
-    *result = new nf9_packet;
-    (*result)->addr = *addr;
-    (*result)->state = state;
-    state->stats.processed_packets++;
+    state->stats.add(NF9_STAT_PROCESSED_PACKETS);
 
-    if (int err = decode(buf, len, *addr, state, *result); err != 0) {
-        state->stats.malformed_packets++;
+    // Exceptions allocate memory, so a fixed decoder doesn't rely on them.
+    if (state->packet_pool &&
+        !state->packet_pool->can_allocate(sizeof(nf9_packet))) {
+        *result = nullptr;
+        return NF9_ERR_OUT_OF_MEMORY;
+    }
+
+    try {
+        void* mem =
+            state->heap->allocate(sizeof(nf9_packet), alignof(nf9_packet));
+        *result = new (mem) nf9_packet(state, *addr);
+    } catch (const std::exception&) {
+        *result = nullptr;
+        return NF9_ERR_OUT_OF_MEMORY;
+    }
+
+    // Memory limits are checked before allocating, so this only fails if
+    // the system or the allocator callbacks run out of memory.
+    int err;
+    try {
+        err = decode(buf, len, *addr, state, *result);
+    } catch (const std::exception&) {
+        err = NF9_ERR_OUT_OF_MEMORY;
+    }
+    if (err != 0) {
+        state->stats.add(NF9_STAT_MALFORMED_PACKETS);
+        if ((*result)->exporter != NO_EXPORTER)
+            ++state->exporters[(*result)->exporter].counters.malformed_packets;
         nf9_free_packet(*result);
         *result = nullptr;
-        return err;
     }
 
-    return 0;
+    if (state->shm_stats)
+        state->shm_stats->maybe_publish(*state);
+
+    return err;
 }
 
 size_t nf9_get_num_flowsets(const nf9_packet* pkt)
@@ -111,6 +274,11 @@ uint32_t nf9_get_uptime(const nf9_packet* pkt)
     return pkt->system_uptime;
 }
 
+uint32_t nf9_get_exporter_index(const nf9_packet* pkt)
+{
+    return pkt->exporter;
+}
+
 int nf9_get_field(const nf9_packet* pkt, unsigned flowset, unsigned flownum,
                   nf9_field field, void* dst, size_t* length)
 {
@@ -118,10 +286,11 @@ int nf9_get_field(const nf9_packet* pkt, unsigned flowset, unsigned flownum,
         return NF9_ERR_INVALID_ARGUMENT;
     if (flownum >= pkt->flowsets[flowset].flows.size())
         return NF9_ERR_INVALID_ARGUMENT;
-    if (pkt->flowsets[flowset].flows[flownum].count(field) == 0)
+    const flow& f = pkt->flowsets[flowset].flows[flownum];
+    auto it = f.find(field);
+    if (it == f.end())
         return NF9_ERR_NOT_FOUND;
-    const pmr::vector<uint8_t>& value =
-        pkt->flowsets[flowset].flows[flownum].at(field);
+    const pmr::vector<uint8_t>& value = it->second;
 
     if (*length < value.size())
         return NF9_ERR_INVALID_ARGUMENT;
@@ -154,18 +323,14 @@ int nf9_get_all_fields(const nf9_packet* pkt, unsigned flowset,
     return 0;
 }
 
-int nf9_get_option(const nf9_packet* pkt, nf9_field field, void* dst,
-                   size_t* length)
+static int get_option(const flow& options, nf9_field field, void* dst,
+                      size_t* length)
 {
-    std::lock_guard<std::mutex> lock(pkt->state->options_mutex);
-    device_id dev_id = {pkt->addr, pkt->src_id};
-    if (pkt->state->options.count(dev_id) == 0)
-        return NF9_ERR_NOT_FOUND;
-    if (pkt->state->options.at(dev_id).options_flow.count(field) == 0)
+    auto it = options.find(field);
+    if (it == options.end())
         return NF9_ERR_NOT_FOUND;
 
-    const pmr::vector<uint8_t>& value =
-        pkt->state->options.at(dev_id).options_flow.at(field);
+    const pmr::vector<uint8_t>& value = it->second;
 
     if (*length < value.size())
         return NF9_ERR_INVALID_ARGUMENT;
@@ -176,6 +341,99 @@ int nf9_get_option(const nf9_packet* pkt, nf9_field field, void* dst,
     return 0;
 }
 
+int nf9_get_option(const nf9_packet* pkt, nf9_field field, void* dst,
+                   size_t* length)
+{
+    if (pkt->options == nullptr)
+        return NF9_ERR_NOT_FOUND;
+
+    return get_option(pkt->options->options_flow, field, dst, length);
+}
+
+int nf9_get_option_scoped(const nf9_packet* pkt, nf9_field scope_field,
+                          uint64_t scope_value, nf9_field field, void* dst,
+                          size_t* length)
+{
+    if (pkt->options == nullptr)
+        return NF9_ERR_NOT_FOUND;
+
+    auto it = pkt->options->scoped.find(scope_key{scope_field, scope_value});
+    if (it == pkt->options->scoped.end())
+        return NF9_ERR_NOT_FOUND;
+
+    return get_option(it->second, field, dst, length);
+}
+
+// Interface with SNMP index in `value', or nullptr if it's not known.
+static const interface_info* find_interface(const option_snapshot& options,
+                                            const pmr::vector<uint8_t>& value)
+{
+    if (value.empty() || value.size() > sizeof(uint32_t))
+        return nullptr;
+
+    uint32_t index = 0;
+    for (uint8_t byte : value)
+        index = index << 8 | byte;
+    auto it = options.interfaces.find(index);
+    return it != options.interfaces.end() ? &it->second : nullptr;
+}
+
+// Name or description of an interface: from the dictionary of the decoder,
+// or the copy in the options pinned by the packet.
+static const char* interface_text(const nf9_packet& pkt, uint32_t id,
+                                  const pmr::string& copy)
+{
+    if (id != 0)
+        return pkt.state->strings.find(id);
+    return copy.empty() ? nullptr : copy.c_str();
+}
+
+int nf9_get_interface_name(const nf9_packet* pkt, uint32_t ifindex,
+                           const char** name, const char** description)
+{
+    if (pkt->options == nullptr)
+        return NF9_ERR_NOT_FOUND;
+
+    auto it = pkt->options->interfaces.find(ifindex);
+    if (it == pkt->options->interfaces.end())
+        return NF9_ERR_NOT_FOUND;
+
+    *name = interface_text(*pkt, it->second.name, it->second.name_copy);
+    if (description)
+        *description = interface_text(*pkt, it->second.description,
+                                      it->second.description_copy);
+    return 0;
+}
+
+int nf9_get_interface_names(const nf9_packet* pkt, unsigned flowset,
+                            nf9_field field, const char** names, size_t* size)
+{
+    if (flowset >= pkt->flowsets.size())
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    const pmr::vector<flow>& flows = pkt->flowsets[flowset].flows;
+    size_t n = std::min(flows.size(), *size);
+    for (size_t i = 0; i < n; ++i) {
+        const interface_info* info = nullptr;
+        if (pkt->options) {
+            if (auto it = flows[i].find(field); it != flows[i].end())
+                info = find_interface(*pkt->options, it->second);
+        }
+        names[i] =
+            info ? interface_text(*pkt, info->name, info->name_copy) : nullptr;
+    }
+
+    *size = n;
+    return 0;
+}
+
+uint64_t nf9_get_options_version(const nf9_packet* pkt)
+{
+    if (pkt->options == nullptr)
+        return 0;
+    return pkt->options->version;
+}
+
 int nf9_get_sampling_rate(const nf9_packet* pkt, unsigned flowset,
                           unsigned flownum, uint32_t* sampling,
                           int* sampling_info)
@@ -188,84 +446,122 @@ int nf9_get_sampling_rate(const nf9_packet* pkt, unsigned flowset,
     if (!st->store_sampling_rates)
         return NF9_ERR_INVALID_ARGUMENT;
 
-    // Get SAMPLER_ID from the flow
-    uint32_t stored_sid;
-    size_t len = sizeof(stored_sid);
-    if (nf9_get_field(pkt, flowset, flownum, NF9_FIELD_FLOW_SAMPLER_ID,
-                      &stored_sid, &len)) {
+    if (flowset >= pkt->flowsets.size() ||
+        flownum >= pkt->flowsets[flowset].samplings.size()) {
         if (set_sampling_info)
             *sampling_info = NF9_SAMPLING_SAMPLER_ID_NOT_FOUND;
         return NF9_ERR_NOT_FOUND;
     }
 
-#ifdef NF9_IS_BIG_ENDIAN
-    stored_sid >>= (sizeof(stored_sid) - len) * CHAR_BIT;
-#else
-    stored_sid <<= (sizeof(stored_sid) - len) * CHAR_BIT;
-#endif
-    stored_sid = ntohl(stored_sid);
-
-    // Lookup the value in stored sampling rates
-    device_id dev_id = {pkt->addr, pkt->src_id};
-    sampler_id sid = {dev_id, stored_sid};
-    if (auto sid_it = st->sampling_rates.find(sid);
-        sid_it != st->sampling_rates.end()) {
-        *sampling = sid_it->second;
-        if (set_sampling_info)
-            *sampling_info = NF9_SAMPLING_MATCH_IP_SOURCE_ID_SAMPLER_ID;
-        return 0;
-    }
+    // The rate was resolved when the record was decoded.
+    const record_sampling& rs = pkt->flowsets[flowset].samplings[flownum];
+    if (set_sampling_info)
+        *sampling_info = rs.info;
 
-    // Lookup the value in stored simple sampling rates -
-    // don't match by source_id
-    simple_sampler_id simple_sid = {dev_id.addr, stored_sid};
-    if (auto simple_sid_it = st->simple_sampling_rates.find(simple_sid);
-        simple_sid_it != st->simple_sampling_rates.end()) {
-        *sampling = simple_sid_it->second;
-        if (set_sampling_info)
-            *sampling_info = NF9_SAMPLING_MATCH_IP_SAMPLER_ID;
-        return 0;
-    }
+    if (rs.info != NF9_SAMPLING_MATCH_IP_SOURCE_ID_SAMPLER_ID &&
+        rs.info != NF9_SAMPLING_MATCH_IP_SAMPLER_ID)
+        return NF9_ERR_NOT_FOUND;
 
-    if (set_sampling_info)
-        *sampling_info = NF9_SAMPLING_OPTION_RECORD_NOT_FOUND;
-    return NF9_ERR_NOT_FOUND;
+    *sampling = rs.rate;
+    return 0;
+}
+
+int nf9_get_upscaled_counter(const nf9_packet* pkt, unsigned flowset,
+                             unsigned flownum, int counter, uint64_t* value)
+{
+    if (counter < 0 || counter >= NF9_NUM_COUNTERS)
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    const uint64_t* column = nf9_get_upscaled_column(pkt, flowset, counter);
+    if (column == nullptr)
+        return NF9_ERR_INVALID_ARGUMENT;
+    if (flownum >= pkt->flowsets[flowset].flows.size())
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    *value = column[flownum];
+    return 0;
+}
+
+const uint64_t* nf9_get_upscaled_column(const nf9_packet* pkt,
+                                        unsigned flowset, int counter)
+{
+    if (!pkt->state->upscale_counters)
+        return nullptr;
+    if (counter < 0 || counter >= NF9_NUM_COUNTERS)
+        return nullptr;
+    if (flowset >= pkt->flowsets.size())
+        return nullptr;
+
+    const struct flowset& f = pkt->flowsets[flowset];
+    if (f.upscaled.empty())
+        return nullptr;
+    return f.upscaled.data() + counter * f.flows.size();
+}
+
+int nf9_get_string_id(const nf9_packet* pkt, unsigned flowset,
+                      unsigned flownum, nf9_field field, uint32_t* id)
+{
+    if (!pkt->state->intern_strings)
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    size_t column = text_field_column(field);
+    if (column == NUM_TEXT_FIELDS)
+        return NF9_ERR_INVALID_ARGUMENT;
+    if (flowset >= pkt->flowsets.size() ||
+        flownum >= pkt->flowsets[flowset].flows.size())
+        return NF9_ERR_NOT_FOUND;
+
+    const struct flowset& f = pkt->flowsets[flowset];
+    if (f.string_ids.empty())
+        return NF9_ERR_NOT_FOUND;
+    uint32_t value = f.string_ids[column * f.flows.size() + flownum];
+    if (value == 0)
+        return NF9_ERR_NOT_FOUND;
+
+    *id = value;
+    return 0;
+}
+
+const char* nf9_get_string(const nf9_state* state, uint32_t id)
+{
+    return state->strings.find(id);
 }
 
 void nf9_free_packet(const nf9_packet* pkt)
 {
-    delete pkt;
+    if (pkt == nullptr)
+        return;
+
+    pmr::memory_resource* heap = pkt->state->heap;
+    pkt->~nf9_packet();
+    heap->deallocate(const_cast<nf9_packet*>(pkt), sizeof(nf9_packet),
+                     alignof(nf9_packet));
 }
 
 const nf9_stats* nf9_get_stats(const nf9_state* state)
 {
     nf9_stats* stats = new nf9_stats;
-    *stats = state->stats;
-    stats->memory_usage = state->memory->get_current();
+    nf9_get_stats_into(state, stats->values, NF9_NUM_STATS);
     return stats;
 }
 
+size_t nf9_get_stats_into(const nf9_state* state, uint64_t* values,
+                          size_t count)
+{
+    uint64_t all[NF9_NUM_STATS];
+    state->stats.read(all);
+    all[NF9_STAT_MEMORY_USAGE] = state->memory->get_current();
+
+    count = std::min<size_t>(count, NF9_NUM_STATS);
+    std::copy(all, all + count, values);
+    return count;
+}
+
 uint64_t nf9_get_stat(const nf9_stats* stats, int stat)
 {
-    switch (stat) {
-        case NF9_STAT_PROCESSED_PACKETS:
-            return stats->processed_packets;
-        case NF9_STAT_MALFORMED_PACKETS:
-            return stats->malformed_packets;
-        case NF9_STAT_TOTAL_RECORDS:
-            return stats->records;
-        case NF9_STAT_TOTAL_DATA_TEMPLATES:
-            return stats->data_templates;
-        case NF9_STAT_TOTAL_OPTION_TEMPLATES:
-            return stats->option_templates;
-        case NF9_STAT_MISSING_TEMPLATE_ERRORS:
-            return stats->missing_template_errors;
-        case NF9_STAT_EXPIRED_OBJECTS:
-            return stats->expired_templates;
-        case NF9_STAT_MEMORY_USAGE:
-            return stats->memory_usage;
-    }
-    return 0;
+    if (stat < 0 || stat >= NF9_NUM_STATS)
+        return 0;
+    return stats->values[stat];
 }
 
 void nf9_free_stats(const nf9_stats* stats)
@@ -273,6 +569,92 @@ void nf9_free_stats(const nf9_stats* stats)
     delete stats;
 }
 
+int nf9_get_stage_quantile(const nf9_state* state, int stage,
+                           double quantile, uint64_t* nanoseconds)
+{
+    uint64_t counts[NF9_HISTOGRAM_BUCKETS];
+    if (int err = nf9_get_stage_histogram(state, stage, counts); err != 0)
+        return err;
+    if (!(quantile >= 0 && quantile <= 1))
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    uint64_t total = 0;
+    for (uint64_t count : counts)
+        total += count;
+    if (total == 0)
+        return NF9_ERR_NOT_FOUND;
+
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(quantile * total));
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket < NF9_HISTOGRAM_BUCKETS - 1; ++bucket) {
+        seen += counts[bucket];
+        if (seen >= rank)
+            break;
+    }
+
+    if (bucket == NF9_HISTOGRAM_BUCKETS - 1)
+        *nanoseconds = UINT64_MAX;
+    else
+        *nanoseconds = latency_histogram::bucket_lower_bound(bucket + 1) - 1;
+    return 0;
+}
+
+int nf9_get_stage_histogram(const nf9_state* state, int stage,
+                            uint64_t* counts)
+{
+#ifdef NF9_ENABLE_TIMING
+    if (stage < 0 || stage >= NF9_NUM_STAGES)
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    for (size_t i = 0; i < NF9_HISTOGRAM_BUCKETS; ++i)
+        counts[i] = state->timings[stage].count(i);
+    return 0;
+#else
+    return NF9_ERR_INVALID_ARGUMENT;
+#endif
+}
+
+uint64_t nf9_get_histogram_bucket_bound(unsigned bucket)
+{
+    if (bucket >= NF9_HISTOGRAM_BUCKETS)
+        return UINT64_MAX;
+    return latency_histogram::bucket_lower_bound(bucket);
+}
+
+size_t nf9_get_num_exporters(const nf9_state* state)
+{
+    return state->exporter_ids.size();
+}
+
+int nf9_get_exporter_stats(const nf9_state* state, nf9_exporter_stats* out,
+                           size_t* size)
+{
+    size_t i = 0;
+    for (const auto& [dev_id, index] : state->exporter_ids) {
+        if (i >= *size)
+            break;
+
+        const exporter& exp = state->exporters[index];
+        out[i].addr = dev_id.addr;
+        out[i].source_id = dev_id.id;
+        out[i].exporter_index = index;
+        out[i].last_seen = exp.timestamp;
+        out[i].packets = exp.counters.packets;
+        out[i].bytes = exp.counters.bytes;
+        out[i].records = exp.counters.records;
+        out[i].templates = exp.counters.templates;
+        out[i].missing_templates = exp.counters.missing_templates;
+        out[i].malformed_packets = exp.counters.malformed_packets;
+        out[i].quota_hits = exp.counters.quota_hits;
+        out[i].memory_usage = exporter_memory(*state, index);
+        ++i;
+    }
+
+    *size = i;
+    return 0;
+}
+
 int nf9_ctl(nf9_state* state, int opt, long value)
 {
     switch (opt) {
@@ -300,6 +682,64 @@ int nf9_ctl(nf9_state* state, int opt, long value)
             else {
                 return NF9_ERR_INVALID_ARGUMENT;
             }
+        case NF9_OPT_MAX_PENDING_BYTES:
+            if (value >= 0) {
+                state->max_pending_bytes = static_cast<size_t>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_MAX_PENDING_AGE:
+            if (value > 0) {
+                state->max_pending_age = static_cast<uint32_t>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_MAX_PACKET_MEM_USAGE:
+            if (value >= 0) {
+                state->max_packet_memory = static_cast<size_t>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_MAX_EXPORTER_MEM_USAGE:
+            if (value >= 0) {
+                state->max_exporter_memory = static_cast<size_t>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_MAX_STRING_MEM_USAGE:
+            if (value >= 0) {
+                state->max_string_memory = static_cast<size_t>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_EVICTION_POLICY:
+            if (value == NF9_EVICTION_EXPIRED || value == NF9_EVICTION_LRU ||
+                value == NF9_EVICTION_LFU) {
+                state->eviction_policy =
+                    static_cast<nf9_eviction_policy>(value);
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
+        case NF9_OPT_STATS_PUBLISH_INTERVAL:
+            if (value >= 0 && state->shm_stats) {
+                state->shm_stats->set_interval(static_cast<uint64_t>(value));
+                return 0;
+            }
+            else {
+                return NF9_ERR_INVALID_ARGUMENT;
+            }
     }
     return NF9_ERR_INVALID_ARGUMENT;
 }
@@ -362,30 +802,14 @@ bool operator==(const device_id& lhs, const device_id& rhs) noexcept
     return compare_nf9addr_id(lhs, rhs);
 }
 
-size_t std::hash<stream_id>::operator()(const stream_id& sid) const noexcept
-{
-    size_t ret = std::hash<device_id>()(sid.dev_id);
-    ret |= sid.tid << 16;
-
-    return ret;
-}
-
-bool operator==(const stream_id& lhs, const stream_id& rhs) noexcept
-{
-    return lhs.dev_id == rhs.dev_id && lhs.tid == rhs.tid;
-}
-
 size_t std::hash<sampler_id>::operator()(const sampler_id& sid) const noexcept
 {
-    size_t ret = std::hash<device_id>()(sid.did);
-    ret ^= std::hash<uint16_t>()(sid.sid);
-
-    return ret;
+    return std::hash<uint64_t>()(uint64_t(sid.exporter) << 32 | sid.sid);
 }
 
 bool operator==(const sampler_id& lhs, const sampler_id& rhs) noexcept
 {
-    return lhs.did == rhs.did && lhs.sid == rhs.sid;
+    return lhs.exporter == rhs.exporter && lhs.sid == rhs.sid;
 }
 
 size_t std::hash<simple_sampler_id>::operator()(
@@ -399,3 +823,13 @@ bool operator==(const simple_sampler_id& lhs,
 {
     return compare_nf9addr_id(lhs, rhs);
 }
+
+size_t std::hash<scope_key>::operator()(const scope_key& key) const noexcept
+{
+    return std::hash<uint64_t>()(key.value ^ uint64_t(key.field) << 32);
+}
+
+bool operator==(const scope_key& lhs, const scope_key& rhs) noexcept
+{
+    return lhs.field == rhs.field && lhs.value == rhs.value;
+}
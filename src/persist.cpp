@@ -0,0 +1,628 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include <fcntl.h>
+#include <netflow9.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include "storage.h"
+
+/*
+ * Saved decoder state.
+ *
+ * The file starts with state_file_header, followed by `num_exporters'
+ * exporter records.  Each exporter record is:
+ *   - saved_exporter
+ *   - `num_templates' times: saved_template followed by `num_fields'
+ *     saved_field structures
+ *   - the most recent option record: `num_options' fields, each of them
+ *     saved_option followed by `length' bytes of the value, padded to a
+ *     multiple of 4 bytes
+ *   - `num_scoped' times: saved_scope followed by the option record stored
+ *     under that scope, as `num_fields' fields like above
+ *   - `num_interfaces' times: saved_interface followed by the name and the
+ *     description, each padded to a multiple of 4 bytes
+ *   - `num_sampling_rates' saved_sampling_rate structures
+ *
+ * All values are in host byte order and all structures are 4-byte aligned,
+ * so the file can be read in place after mmap().  `checksum' is the FNV-1a
+ * hash of everything after the header.
+ */
+namespace {
+
+const char STATE_MAGIC[8] = {'N', 'F', '9', 'S', 'T', 'A', 'T', 'E'};
+const uint32_t STATE_VERSION = 2;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct state_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint64_t checksum;
+    uint32_t num_exporters;
+    uint32_t reserved;
+};
+
+struct saved_exporter
+{
+    nf9_addr addr;
+    uint32_t source_id;
+    uint32_t timestamp;
+    uint32_t num_templates;
+    uint32_t has_options;
+    uint32_t num_options;
+    uint32_t options_timestamp;
+    uint32_t num_scoped;
+    uint32_t num_interfaces;
+    uint32_t num_sampling_rates;
+};
+
+struct saved_template
+{
+    uint16_t template_id;
+    uint16_t num_fields;
+    uint32_t timestamp;
+    uint32_t total_length;
+    uint32_t is_option;
+};
+
+struct saved_field
+{
+    nf9_field type;
+    uint32_t length;
+};
+
+struct saved_option
+{
+    nf9_field field;
+    uint32_t length;
+};
+
+struct saved_scope
+{
+    nf9_field field;
+    uint32_t value_high;
+    uint32_t value_low;
+    uint32_t num_fields;
+};
+
+struct saved_interface
+{
+    uint32_t index;
+    uint32_t name_length;
+    uint32_t description_length;
+};
+
+struct saved_sampling_rate
+{
+    uint32_t sampler_id;
+    uint32_t rate;
+};
+
+uint64_t fnv1a(const uint8_t* data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+size_t padded(size_t len)
+{
+    return (len + 3) & ~size_t(3);
+}
+
+class state_writer
+{
+public:
+    explicit state_writer(pmr::memory_resource* mr) : buf_(mr)
+    {
+    }
+
+    template <typename T>
+    void put(const T& value)
+    {
+        put_bytes(&value, sizeof(value));
+    }
+
+    void put_bytes(const void* data, size_t len)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        buf_.insert(buf_.end(), bytes, bytes + len);
+        buf_.resize(padded(buf_.size()));
+    }
+
+    pmr::vector<uint8_t>& data()
+    {
+        return buf_;
+    }
+
+private:
+    pmr::vector<uint8_t> buf_;
+};
+
+// Cursor for the mapped file.  Like `buffer' in decode.cpp, every read is
+// checked against the end of the file.
+class state_reader
+{
+public:
+    state_reader(const uint8_t* ptr, size_t len) : ptr_(ptr), end_(ptr + len)
+    {
+    }
+
+    template <typename T>
+    const T* get()
+    {
+        return static_cast<const T*>(get_bytes(sizeof(T)));
+    }
+
+    const void* get_bytes(size_t len)
+    {
+        if (size_t(end_ - ptr_) < padded(len))
+            return nullptr;
+        const void* ret = ptr_;
+        ptr_ += padded(len);
+        return ret;
+    }
+
+    bool at_end() const
+    {
+        return ptr_ == end_;
+    }
+
+private:
+    const uint8_t* ptr_;
+    const uint8_t* end_;
+};
+
+void put_record(state_writer& out, const flow& f)
+{
+    for (const auto& [field, value] : f) {
+        out.put(saved_option{field, static_cast<uint32_t>(value.size())});
+        out.put_bytes(value.data(), value.size());
+    }
+}
+
+// Text of an interface, from the dictionary or from its copy.
+std::string_view interface_text(const nf9_state& state, uint32_t id,
+                                const pmr::string& copy)
+{
+    const char* text = id != 0 ? state.strings.find(id) : nullptr;
+    return text ? std::string_view(text) : std::string_view(copy);
+}
+
+void save_exporter(state_writer& out, const nf9_state& state,
+                   const device_id& dev_id, uint32_t index)
+{
+    const exporter& exp = state.exporters[index];
+    const option_snapshot* options = exp.options.get();
+
+    uint32_t num_rates = 0;
+    for (const auto& [sid, rate] : state.sampling_rates)
+        if (sid.exporter == index)
+            ++num_rates;
+
+    saved_exporter se = {};
+    se.addr = dev_id.addr;
+    se.source_id = dev_id.id;
+    se.timestamp = exp.timestamp;
+    se.num_templates = static_cast<uint32_t>(exp.templates.size());
+    if (options) {
+        se.has_options = 1;
+        se.num_options = static_cast<uint32_t>(options->options_flow.size());
+        se.options_timestamp = exp.options_timestamp;
+        se.num_scoped = static_cast<uint32_t>(options->scoped.size());
+        se.num_interfaces = static_cast<uint32_t>(options->interfaces.size());
+    }
+    se.num_sampling_rates = num_rates;
+    out.put(se);
+
+    for (size_t i = 0; i < exp.templates.size(); ++i) {
+        const data_template& tmpl = *exp.templates.templates[i];
+        saved_template st = {};
+        st.template_id = exp.templates.ids[i];
+        st.num_fields = static_cast<uint16_t>(tmpl.num_fields());
+        st.timestamp = tmpl.timestamp;
+        st.total_length = tmpl.total_length;
+        st.is_option = tmpl.is_option();
+        out.put(st);
+
+        for (size_t j = 0; j < tmpl.num_fields(); ++j)
+            out.put(saved_field{tmpl.field_type(j), tmpl.fields()[j].length});
+    }
+
+    if (options) {
+        put_record(out, options->options_flow);
+        for (const auto& [key, record] : options->scoped) {
+            out.put(saved_scope{key.field, uint32_t(key.value >> 32),
+                                uint32_t(key.value),
+                                static_cast<uint32_t>(record.size())});
+            put_record(out, record);
+        }
+        for (const auto& [ifindex, info] : options->interfaces) {
+            std::string_view name =
+                interface_text(state, info.name, info.name_copy);
+            std::string_view description =
+                interface_text(state, info.description, info.description_copy);
+            out.put(saved_interface{ifindex, uint32_t(name.size()),
+                                    uint32_t(description.size())});
+            out.put_bytes(name.data(), name.size());
+            out.put_bytes(description.data(), description.size());
+        }
+    }
+
+    for (const auto& [sid, rate] : state.sampling_rates)
+        if (sid.exporter == index)
+            out.put(saved_sampling_rate{sid.sid, rate});
+}
+
+bool get_record(state_reader& in, uint32_t num_fields, flow& f)
+{
+    for (uint32_t i = 0; i < num_fields; ++i) {
+        const saved_option* so = in.get<saved_option>();
+        if (so == nullptr)
+            return false;
+        const uint8_t* value =
+            static_cast<const uint8_t*>(in.get_bytes(so->length));
+        if (value == nullptr)
+            return false;
+        f[so->field].assign(value, value + so->length);
+    }
+    return true;
+}
+
+std::optional<std::string_view> get_text(state_reader& in, uint32_t length)
+{
+    const char* text = static_cast<const char*>(in.get_bytes(length));
+    if (text == nullptr)
+        return std::nullopt;
+    return std::string_view(text, length);
+}
+
+struct loaded_template
+{
+    uint16_t template_id;
+    parsed_template tmpl;
+};
+
+// Objects of an exporter read from the file, which are not stored in the
+// decoder yet.
+struct loaded_exporter
+{
+    explicit loaded_exporter(pmr::memory_resource* mr)
+        : templates(mr),
+          options{flow(mr), scoped_options(mr), interface_table(mr), 0, 0},
+          sampling_rates(mr)
+    {
+    }
+
+    device_id dev_id = {};
+    uint32_t timestamp = 0;
+    pmr::vector<loaded_template> templates;
+    bool has_options = false;
+    option_snapshot options;
+    uint32_t options_timestamp = 0;
+    pmr::vector<saved_sampling_rate> sampling_rates;
+};
+
+int read_exporter(state_reader& in, loaded_exporter& le)
+{
+    const saved_exporter* se = in.get<saved_exporter>();
+    if (se == nullptr)
+        return NF9_ERR_MALFORMED;
+    le.dev_id = device_id{se->addr, se->source_id};
+    le.timestamp = se->timestamp;
+    pmr::memory_resource* mr = le.templates.get_allocator().resource();
+
+    for (uint32_t i = 0; i < se->num_templates; ++i) {
+        const saved_template* st = in.get<saved_template>();
+        if (st == nullptr)
+            return NF9_ERR_MALFORMED;
+        const saved_field* fields = static_cast<const saved_field*>(
+            in.get_bytes(sizeof(saved_field) * st->num_fields));
+        if (fields == nullptr)
+            return NF9_ERR_MALFORMED;
+
+        parsed_template tmpl(mr);
+        tmpl.timestamp = st->timestamp;
+        tmpl.is_option = st->is_option;
+        for (uint16_t j = 0; j < st->num_fields; ++j) {
+            if (fields[j].length > UINT16_MAX ||
+                !tmpl.add_field(fields[j].type, fields[j].length))
+                return NF9_ERR_MALFORMED;
+        }
+        if (tmpl.total_length != st->total_length ||
+            tmpl.total_length == 0 || tmpl.total_length > UINT16_MAX)
+            return NF9_ERR_MALFORMED;
+        le.templates.push_back(
+            loaded_template{st->template_id, std::move(tmpl)});
+    }
+
+    le.has_options = se->has_options;
+    le.options_timestamp = se->options_timestamp;
+    if (!get_record(in, se->num_options, le.options.options_flow))
+        return NF9_ERR_MALFORMED;
+    for (uint32_t i = 0; i < se->num_scoped; ++i) {
+        const saved_scope* ss = in.get<saved_scope>();
+        if (ss == nullptr)
+            return NF9_ERR_MALFORMED;
+        scope_key key = {ss->field,
+                         uint64_t(ss->value_high) << 32 | ss->value_low};
+        if (!get_record(in, ss->num_fields, le.options.scoped[key]))
+            return NF9_ERR_MALFORMED;
+    }
+    for (uint32_t i = 0; i < se->num_interfaces; ++i) {
+        const saved_interface* si = in.get<saved_interface>();
+        if (si == nullptr)
+            return NF9_ERR_MALFORMED;
+        auto name = get_text(in, si->name_length);
+        auto description = name ? get_text(in, si->description_length)
+                                : std::nullopt;
+        if (!description)
+            return NF9_ERR_MALFORMED;
+        interface_info& info = le.options.interfaces[si->index];
+        info.name_copy.assign(*name);
+        info.description_copy.assign(*description);
+    }
+
+    for (uint32_t i = 0; i < se->num_sampling_rates; ++i) {
+        const saved_sampling_rate* sr = in.get<saved_sampling_rate>();
+        if (sr == nullptr)
+            return NF9_ERR_MALFORMED;
+        le.sampling_rates.push_back(*sr);
+    }
+
+    return 0;
+}
+
+// Objects added to the decoder by nf9_load_state(), so that they can be
+// removed if loading fails.
+struct added_objects
+{
+    explicit added_objects(pmr::memory_resource* mr)
+        : exporters(mr), templates(mr), options(mr), sampling_rates(mr)
+    {
+    }
+
+    struct sampling_rate
+    {
+        sampler_id id;
+        nf9_addr addr;
+        std::optional<uint32_t> replaced_simple_rate;
+    };
+
+    pmr::vector<device_id> exporters;
+    pmr::vector<stream_id> templates;
+    pmr::vector<uint32_t> options;
+    pmr::vector<sampling_rate> sampling_rates;
+};
+
+// Store objects of an exporter which the decoder doesn't know yet.  Objects
+// it knows were received after the state was saved, so they are kept.
+int store_exporter(nf9_state& state, loaded_exporter& le,
+                   added_objects& added)
+{
+    uint32_t index;
+    bool known = state.exporter_ids.count(le.dev_id) != 0;
+    if (known) {
+        index = state.exporter_ids.at(le.dev_id);
+    }
+    else {
+        added.exporters.push_back(le.dev_id);
+        if (int err = register_exporter(state, le.dev_id, le.timestamp, index);
+            err != 0)
+            return err;
+    }
+
+    for (loaded_template& lt : le.templates) {
+        if (state.exporters[index].templates.find(lt.template_id))
+            continue;
+        stream_id sid = {index, lt.template_id};
+        added.templates.push_back(sid);
+        if (int err = save_template(lt.tmpl, sid, state); err != 0)
+            return err;
+    }
+
+    if (le.has_options && !state.exporters[index].options) {
+        added.options.push_back(index);
+        if (int err = restore_options(state, index, le.options,
+                                      le.options_timestamp);
+            err != 0)
+            return err;
+    }
+
+    nf9_addr addr = le.dev_id.addr;
+    for (const saved_sampling_rate& sr : le.sampling_rates) {
+        sampler_id id = {index, sr.sampler_id};
+        if (state.sampling_rates.count(id) != 0)
+            continue;
+        std::optional<uint32_t> simple_rate;
+        if (auto it = state.simple_sampling_rates.find(
+                simple_sampler_id{addr, sr.sampler_id});
+            it != state.simple_sampling_rates.end())
+            simple_rate = it->second;
+        added.sampling_rates.push_back({id, addr, simple_rate});
+        if (int err = save_sampling_rate(state, index, sr.sampler_id, sr.rate);
+            err != 0)
+            return err;
+    }
+
+    return 0;
+}
+
+// Undo store_exporter(), newest objects first.
+void remove_added(nf9_state& state, const added_objects& added)
+{
+    for (auto it = added.sampling_rates.rbegin();
+         it != added.sampling_rates.rend(); ++it) {
+        state.sampling_rates.erase(it->id);
+        simple_sampler_id simple_id = {it->addr, it->id.sid};
+        if (it->replaced_simple_rate)
+            state.simple_sampling_rates[simple_id] = *it->replaced_simple_rate;
+        else
+            state.simple_sampling_rates.erase(simple_id);
+    }
+    for (uint32_t index : added.options)
+        state.exporters[index].options.reset();
+    for (const stream_id& sid : added.templates)
+        delete_template(state, sid);
+    for (const device_id& dev_id : added.exporters) {
+        if (auto it = state.exporter_ids.find(dev_id);
+            it != state.exporter_ids.end())
+            remove_exporter(state, it->second);
+    }
+}
+
+// Store all loaded exporters, or none of them if it fails.
+int store_exporters(nf9_state& state, pmr::vector<loaded_exporter>& exporters)
+{
+    added_objects added(state.heap);
+    int err = 0;
+    try {
+        for (loaded_exporter& le : exporters) {
+            if ((err = store_exporter(state, le, added)) != 0)
+                break;
+        }
+    } catch (const std::exception&) {
+        err = NF9_ERR_OUT_OF_MEMORY;
+    }
+    if (err != 0)
+        remove_added(state, added);
+    return err;
+}
+
+// Make a rename in the directory of `path' durable.
+int sync_directory(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    std::string dir = slash ? std::string(path, slash - path + 1) : ".";
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return NF9_ERR_SYSTEM;
+    int ret = fsync(fd);
+    close(fd);
+    return ret == 0 ? 0 : NF9_ERR_SYSTEM;
+}
+
+}  // namespace
+
+int nf9_save_state(const nf9_state* state, const char* path)
+{
+    state_writer out(state->heap);
+    try {
+        out.put(state_file_header{});
+        for (const auto& [dev_id, index] : state->exporter_ids)
+            save_exporter(out, *state, dev_id, index);
+    } catch (const std::exception&) {
+        return NF9_ERR_OUT_OF_MEMORY;
+    }
+
+    pmr::vector<uint8_t>& data = out.data();
+    state_file_header hdr = {};
+    memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+    hdr.version = STATE_VERSION;
+    hdr.byte_order = BYTE_ORDER_MARK;
+    hdr.size = data.size();
+    hdr.checksum = fnv1a(data.data() + sizeof(hdr), data.size() - sizeof(hdr));
+    hdr.num_exporters = static_cast<uint32_t>(state->exporter_ids.size());
+    memcpy(data.data(), &hdr, sizeof(hdr));
+
+    // Write to a temporary file first, so that a crash doesn't leave a
+    // truncated state behind.  The data must reach the disk before the
+    // rename does.
+    std::string tmp_path = std::string(path) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NF9_ERR_SYSTEM;
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            close(fd);
+            unlink(tmp_path.c_str());
+            return NF9_ERR_SYSTEM;
+        }
+        written += n;
+    }
+
+    if (fsync(fd) != 0) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return NF9_ERR_SYSTEM;
+    }
+    if (close(fd) != 0 || rename(tmp_path.c_str(), path) != 0) {
+        unlink(tmp_path.c_str());
+        return NF9_ERR_SYSTEM;
+    }
+    return sync_directory(path);
+}
+
+int nf9_load_state(nf9_state* state, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NF9_ERR_SYSTEM;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NF9_ERR_SYSTEM;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(state_file_header)) {
+        close(fd);
+        return NF9_ERR_MALFORMED;
+    }
+
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NF9_ERR_SYSTEM;
+
+    const uint8_t* data = static_cast<const uint8_t*>(addr);
+    const state_file_header* hdr =
+        reinterpret_cast<const state_file_header*>(data);
+
+    int err = 0;
+    if (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != STATE_VERSION || hdr->byte_order != BYTE_ORDER_MARK ||
+        hdr->size != size ||
+        hdr->checksum !=
+            fnv1a(data + sizeof(*hdr), size - sizeof(state_file_header))) {
+        err = NF9_ERR_MALFORMED;
+    }
+
+    // The whole file is read before anything is stored, so that a bad file
+    // leaves the decoder as it was.
+    state_reader in(data + sizeof(*hdr), size - sizeof(*hdr));
+    try {
+        pmr::vector<loaded_exporter> exporters(state->heap);
+        for (uint32_t i = 0; err == 0 && i < hdr->num_exporters; ++i) {
+            exporters.emplace_back(state->heap);
+            err = read_exporter(in, exporters.back());
+        }
+        if (err == 0 && !in.at_end())
+            err = NF9_ERR_MALFORMED;
+        if (err == 0)
+            err = store_exporters(*state, exporters);
+    } catch (const std::exception&) {
+        err = NF9_ERR_OUT_OF_MEMORY;
+    }
+
+    munmap(addr, size);
+    return err;
+}
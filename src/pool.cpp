@@ -0,0 +1,284 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include "pool.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <new>
+#include "storage.h"
+
+static const size_t SLAB_SIZE = 64 * 1024;
+static const size_t HUGE_SLAB_SIZE = 2 * 1024 * 1024;
+
+pool_memory_resource::pool_memory_resource(bool huge_pages,
+                                           pmr::memory_resource* upstream)
+    : huge_pages_(huge_pages),
+      fixed_(false),
+      slab_size_(huge_pages ? HUGE_SLAB_SIZE : SLAB_SIZE),
+      upstream_(upstream),
+      slabs_(upstream)
+{
+}
+
+pool_memory_resource::pool_memory_resource(size_t size,
+                                           pmr::memory_resource* upstream)
+    : huge_pages_(false),
+      fixed_(true),
+      slab_size_(size),
+      upstream_(upstream),
+      slabs_(upstream)
+{
+    add_slab();
+}
+
+pool_memory_resource::~pool_memory_resource()
+{
+    for (void* slab : slabs_) {
+        if (huge_pages_)
+            munmap(slab, slab_size_);
+        else
+            upstream_->deallocate(slab, slab_size_, GRANULARITY);
+    }
+}
+
+size_t pool_memory_resource::block_size(size_t bytes, size_t alignment) const
+{
+    if (alignment > GRANULARITY)
+        return 0;
+    if (bytes == 0)
+        bytes = 1;
+    if (bytes <= MAX_BLOCK_SIZE)
+        return (bytes + GRANULARITY - 1) & ~(GRANULARITY - 1);
+    if (!fixed_)
+        return 0;
+
+    size_t size = MAX_BLOCK_SIZE * 2;
+    for (size_t i = 0; i < NUM_LARGE_CLASSES; ++i, size *= 2) {
+        if (bytes <= size)
+            return size;
+    }
+    return 0;
+}
+
+size_t pool_memory_resource::size_class(size_t size)
+{
+    if (size <= MAX_BLOCK_SIZE)
+        return size / GRANULARITY - 1;
+
+    size_t index = NUM_SMALL_CLASSES;
+    for (size_t s = MAX_BLOCK_SIZE * 2; s < size; s *= 2)
+        ++index;
+    return index;
+}
+
+// Map a huge page slab.  Use preallocated huge pages if there are any,
+// otherwise ask for transparent huge pages.
+static void* map_huge_slab(size_t size)
+{
+    void* slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED)
+        return slab;
+
+    slab = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+        throw std::bad_alloc();
+    madvise(slab, size, MADV_HUGEPAGE);
+    return slab;
+}
+
+void pool_memory_resource::add_slab()
+{
+    if (fixed_ && !slabs_.empty())
+        throw out_of_memory_error("Fixed memory region is exhausted");
+
+    void* slab = huge_pages_ ? map_huge_slab(slab_size_)
+                             : upstream_->allocate(slab_size_, GRANULARITY);
+    try {
+        slabs_.push_back(slab);
+    } catch (...) {
+        if (huge_pages_)
+            munmap(slab, slab_size_);
+        else
+            upstream_->deallocate(slab, slab_size_, GRANULARITY);
+        throw;
+    }
+    slab_ptr_ = static_cast<char*>(slab);
+    slab_left_ = slab_size_;
+}
+
+void* pool_memory_resource::do_allocate(std::size_t bytes,
+                                        std::size_t alignment)
+{
+    size_t size = block_size(bytes, alignment);
+    if (size == 0 && fixed_)
+        throw out_of_memory_error("Allocation doesn't fit in fixed region");
+    if (size == 0)
+        return upstream_->allocate(bytes, alignment);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_block*& head = free_lists_[size_class(size)];
+    if (head != nullptr) {
+        free_block* block = head;
+        head = block->next;
+        return block;
+    }
+
+    // A fixed region can't grow, so free blocks of other sizes are reused.
+    if (fixed_ && slab_left_ < size) {
+        if (void* block = take_span(size))
+            return block;
+        if (dirty_)
+            coalesce();
+        if (slab_left_ < size) {
+            if (void* block = take_span(size))
+                return block;
+        }
+    }
+
+    // The rest of the current slab is too small, it's lost.
+    if (slab_left_ < size)
+        add_slab();
+    void* block = slab_ptr_;
+    slab_ptr_ += size;
+    slab_left_ -= size;
+    return block;
+}
+
+void pool_memory_resource::do_deallocate(void* p, std::size_t bytes,
+                                         std::size_t alignment)
+{
+    size_t size = block_size(bytes, alignment);
+    if (size == 0) {
+        upstream_->deallocate(p, bytes, alignment);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_block*& head = free_lists_[size_class(size)];
+    head = new (p) free_block{head, size};
+    dirty_ = true;
+}
+
+bool pool_memory_resource::can_allocate(size_t bytes)
+{
+    if (!fixed_)
+        return true;
+    size_t size = block_size(bytes, GRANULARITY);
+    if (size == 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (has_block(size))
+        return true;
+    if (!dirty_)
+        return false;
+    coalesce();
+    return has_block(size);
+}
+
+bool pool_memory_resource::has_block(size_t size) const
+{
+    if (slab_left_ >= size)
+        return true;
+    for (size_t i = size_class(size); i < std::size(free_lists_); ++i) {
+        if (free_lists_[i])
+            return true;
+    }
+    for (free_block* span = spans_; span; span = span->next) {
+        if (span->size >= size)
+            return true;
+    }
+    return false;
+}
+
+void* pool_memory_resource::take_span(size_t size)
+{
+    for (free_block** span = &spans_; *span; span = &(*span)->next) {
+        free_block* block = *span;
+        if (block->size < size)
+            continue;
+        if (block->size == size)
+            *span = block->next;
+        else
+            *span = new (reinterpret_cast<char*>(block) + size)
+                free_block{block->next, block->size - size};
+        return block;
+    }
+    return nullptr;
+}
+
+pool_memory_resource::free_block* pool_memory_resource::merge(free_block* a,
+                                                              free_block* b)
+{
+    free_block* head = nullptr;
+    free_block** tail = &head;
+    while (a && b) {
+        free_block*& next = std::less<free_block*>()(a, b) ? a : b;
+        *tail = next;
+        tail = &next->next;
+        next = next->next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+pool_memory_resource::free_block* pool_memory_resource::sort(
+    free_block* list)
+{
+    if (!list || !list->next)
+        return list;
+
+    free_block* slow = list;
+    for (free_block* fast = list->next; fast && fast->next;
+         fast = fast->next->next)
+        slow = slow->next;
+    free_block* second = slow->next;
+    slow->next = nullptr;
+    return merge(sort(list), sort(second));
+}
+
+void pool_memory_resource::coalesce()
+{
+    dirty_ = false;
+    free_block* blocks = spans_;
+    for (free_block*& head : free_lists_) {
+        while (head) {
+            free_block* block = head;
+            head = block->next;
+            block->next = blocks;
+            blocks = block;
+        }
+    }
+    spans_ = sort(blocks);
+
+    free_block** last = &spans_;
+    for (free_block* span = spans_; span; span = span->next) {
+        while (reinterpret_cast<char*>(span) + span->size ==
+               reinterpret_cast<char*>(span->next)) {
+            span->size += span->next->size;
+            span->next = span->next->next;
+        }
+        if (span->next)
+            last = &span->next;
+    }
+
+    if (free_block* span = *last;
+        span && reinterpret_cast<char*>(span) + span->size == slab_ptr_) {
+        slab_ptr_ = reinterpret_cast<char*>(span);
+        slab_left_ += span->size;
+        *last = nullptr;
+    }
+}
+
+bool pool_memory_resource::do_is_equal(
+    const pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <mutex>
+#include "types.h"
+
+/*
+ * Memory resource that keeps freed blocks of the same size class on free
+ * lists and hands them out again, instead of going to malloc for every
+ * template, option and hash node.  Blocks are carved from large slabs, so
+ * constant churn of templates doesn't fragment the heap.  Slabs are
+ * returned to the system only when the resource is destroyed.
+ *
+ * A pool can also be created over a single fixed region.  Then large
+ * blocks are carved from the region too, in power-of-two size classes,
+ * and allocations fail with out_of_memory_error when the region is used
+ * up, instead of falling back to the upstream resource.  Throwing
+ * allocates, so callers check can_allocate() first.  Before a region runs
+ * out, adjacent free blocks of all size classes are merged, so that
+ * memory freed by small blocks can be reused for larger ones.
+ *
+ * Options pinned by packets can be released from other threads, so the
+ * free lists are protected by a mutex.
+ */
+class pool_memory_resource : public pmr::memory_resource
+{
+public:
+    /* Allocations are rounded up to a multiple of this size. */
+    static constexpr size_t GRANULARITY = 16;
+
+    /* Larger allocations are passed to the upstream resource, or rounded
+     * up to a power of two in a fixed region. */
+    static constexpr size_t MAX_BLOCK_SIZE = 1024;
+
+    /* Slabs and large blocks are allocated from `upstream'.  If
+     * `huge_pages' is true, slabs are instead mapped from the system and
+     * backed by huge pages when it allows it. */
+    pool_memory_resource(bool huge_pages, pmr::memory_resource* upstream);
+
+    /* Allocate a fixed region of `size' bytes from `upstream' now, and
+     * never allocate from it again. */
+    pool_memory_resource(size_t size, pmr::memory_resource* upstream);
+
+    pool_memory_resource(const pool_memory_resource&) = delete;
+    pool_memory_resource& operator=(const pool_memory_resource&) = delete;
+    ~pool_memory_resource();
+
+    /* Size of the block used for an allocation, or 0 if the allocation
+     * doesn't come from the pool. */
+    size_t block_size(size_t bytes, size_t alignment) const;
+
+    /* True if the pool was created over a fixed region. */
+    bool fixed() const
+    {
+        return fixed_;
+    }
+
+    /* True if a block of `bytes' can be allocated now.  Only a fixed
+     * region can run out, and adjacent free blocks are merged first if
+     * anything was freed since they were last merged. */
+    bool can_allocate(size_t bytes);
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes,
+                       std::size_t alignment) override;
+    bool do_is_equal(const pmr::memory_resource& other) const
+        noexcept override;
+
+    /* Map a new slab and make it the current one. */
+    void add_slab();
+
+    /* Index of the free list for blocks of given size. */
+    static size_t size_class(size_t size);
+
+    struct free_block
+    {
+        free_block* next;
+        size_t size;
+    };
+
+    /* Carve a block of `size' bytes from the first free span which is
+     * large enough, or return null if there isn't one. */
+    void* take_span(size_t size);
+
+    /* True if the current slab, a free span or a free block of a size
+     * class is large enough for a block of `size' bytes. */
+    bool has_block(size_t size) const;
+
+    /* Merge two lists of blocks sorted by address. */
+    static free_block* merge(free_block* a, free_block* b);
+
+    /* Sort a list of blocks by address. */
+    static free_block* sort(free_block* list);
+
+    /* Move all free blocks to the list of spans, merging adjacent ones,
+     * and return the span at the end of the region to the current slab. */
+    void coalesce();
+
+    static constexpr size_t NUM_SMALL_CLASSES = MAX_BLOCK_SIZE / GRANULARITY;
+
+    /* Power-of-two classes above MAX_BLOCK_SIZE, for fixed regions. */
+    static constexpr size_t NUM_LARGE_CLASSES = 20;
+
+    const bool huge_pages_;
+    const bool fixed_;
+    const size_t slab_size_;
+    pmr::memory_resource* const upstream_;
+
+    std::mutex mutex_;
+    free_block* free_lists_[NUM_SMALL_CLASSES + NUM_LARGE_CLASSES] = {};
+
+    /* Merged free blocks of a fixed region of any size, sorted by
+     * address. */
+    free_block* spans_ = nullptr;
+
+    /* True if blocks were freed since the last coalesce(), so that merging
+     * could produce larger spans. */
+    bool dirty_ = false;
+
+    /* Unused part of the current slab. */
+    char* slab_ptr_ = nullptr;
+    size_t slab_left_ = 0;
+
+    pmr::vector<void*> slabs_;
+};
+
+#endif
@@ -5,18 +5,24 @@
  */
 
 #include "sampling.h"
+#include <endian.h>
 #include <climits>
 #include <cstring>
 #include "storage.h"
 
+static const nf9_field COUNTER_FIELDS[NF9_NUM_COUNTERS] = {
+    NF9_FIELD_IN_BYTES,
+    NF9_FIELD_IN_PKTS,
+    NF9_FIELD_OUT_BYTES,
+    NF9_FIELD_OUT_PKTS,
+};
+
 static int extract_u32_field(const flow& f, nf9_field field, uint32_t* dst)
 {
-    const pmr::vector<uint8_t>* value_bytes = nullptr;
-    try {
-        value_bytes = &f.at(field);
-    } catch (std::exception& e) {
+    auto it = f.find(field);
+    if (it == f.end())
         return NF9_ERR_NOT_FOUND;
-    }
+    const pmr::vector<uint8_t>* value_bytes = &it->second;
     size_t size = value_bytes->size();
 
     if (size > sizeof(*dst)) {
@@ -38,7 +44,7 @@ static int extract_u32_field(const flow& f, nf9_field field, uint32_t* dst)
     return 0;
 }
 
-int save_sampling_info(nf9_state& st, const flow& f, const device_id& did)
+int save_sampling_info(nf9_state& st, const flow& f, uint32_t exporter)
 {
     uint32_t rate = 0;
     uint32_t sampler = 0;
@@ -55,8 +61,91 @@ int save_sampling_info(nf9_state& st, const flow& f, const device_id& did)
         return err;
     }
 
-    if (int err = save_sampling_rate(st, did, sampler, rate); err != 0)
+    if (int err = save_sampling_rate(st, exporter, sampler, rate); err != 0)
         return err;
 
     return 0;
 }
+
+record_sampling find_sampling_rate(const nf9_state& st, uint32_t exporter,
+                                   uint32_t sampler)
+{
+    // Lookup the value in stored sampling rates
+    if (auto it = st.sampling_rates.find(sampler_id{exporter, sampler});
+        it != st.sampling_rates.end())
+        return {it->second, NF9_SAMPLING_MATCH_IP_SOURCE_ID_SAMPLER_ID};
+
+    // Lookup the value in stored simple sampling rates -
+    // don't match by source_id
+    simple_sampler_id simple_sid = {st.exporters[exporter].dev_id.addr,
+                                    sampler};
+    if (auto it = st.simple_sampling_rates.find(simple_sid);
+        it != st.simple_sampling_rates.end())
+        return {it->second, NF9_SAMPLING_MATCH_IP_SAMPLER_ID};
+
+    return {0, NF9_SAMPLING_OPTION_RECORD_NOT_FOUND};
+}
+
+// Widen and byte-swap a counter field of every record into @dst.
+template <typename T>
+static void gather_counter(const uint8_t* src, size_t stride, size_t n,
+                           uint64_t* dst)
+{
+    for (size_t i = 0; i < n; ++i) {
+        T value;
+        memcpy(&value, src + i * stride, sizeof(value));
+        if constexpr (sizeof(T) == sizeof(uint64_t))
+            dst[i] = be64toh(value);
+        else
+            dst[i] = be32toh(value);
+    }
+}
+
+// Same as above, for counters of unusual lengths (up to 8 bytes).
+static void gather_counter_slow(const uint8_t* src, size_t stride,
+                                size_t length, size_t n, uint64_t* dst)
+{
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t bytes[sizeof(uint64_t)] = {};
+        memcpy(bytes + sizeof(bytes) - length, src + i * stride, length);
+        uint64_t value;
+        memcpy(&value, bytes, sizeof(value));
+        dst[i] = be64toh(value);
+    }
+}
+
+void upscale_counters(const data_template& tmpl, const uint8_t* records,
+                      flowset& f)
+{
+    const size_t n = f.flows.size();
+    f.upscaled.assign(NF9_NUM_COUNTERS * n, 0);
+
+    // Records without a known sampling rate are left as they are.
+    pmr::vector<uint64_t> rates(n, 1, f.upscaled.get_allocator().resource());
+    for (size_t i = 0; i < f.samplings.size(); ++i) {
+        if (f.samplings[i].info == NF9_SAMPLING_MATCH_IP_SOURCE_ID_SAMPLER_ID ||
+            f.samplings[i].info == NF9_SAMPLING_MATCH_IP_SAMPLER_ID)
+            rates[i] = f.samplings[i].rate;
+    }
+
+    for (size_t counter = 0; counter < NF9_NUM_COUNTERS; ++counter) {
+        size_t offset;
+        size_t length;
+        if (!tmpl.find_field(COUNTER_FIELDS[counter], offset, length) ||
+            length > sizeof(uint64_t))
+            continue;
+
+        uint64_t* column = f.upscaled.data() + counter * n;
+        const uint8_t* src = records + offset;
+        if (length == sizeof(uint32_t))
+            gather_counter<uint32_t>(src, tmpl.total_length, n, column);
+        else if (length == sizeof(uint64_t))
+            gather_counter<uint64_t>(src, tmpl.total_length, n, column);
+        else
+            gather_counter_slow(src, tmpl.total_length, length, n, column);
+
+        // Separate pass, so that the compiler can vectorize it.
+        for (size_t i = 0; i < n; ++i)
+            column[i] *= rates[i];
+    }
+}
@@ -12,6 +12,16 @@
 
 /* Extract sampling rate from given *options* flow and save it for given
  * Exporter device. */
-int save_sampling_info(nf9_state& st, const flow& f, const device_id& did);
+int save_sampling_info(nf9_state& st, const flow& f, uint32_t exporter);
+
+/* Look up the sampling rate of a sampler of given Exporter device. */
+record_sampling find_sampling_rate(const nf9_state& st, uint32_t exporter,
+                                   uint32_t sampler);
+
+/* Fill f.upscaled with byte and packet counters of records of a data flowset,
+ * multiplied by sampling rates in f.samplings.  Records were read back to back
+ * from @records. */
+void upscale_counters(const data_template& tmpl, const uint8_t* records,
+                      flowset& f);
 
 #endif
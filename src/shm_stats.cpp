@@ -0,0 +1,260 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include "shm_stats.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <ctime>
+#include <new>
+#include "types.h"
+
+// How many times a reader retries while the values are being updated.  A
+// decoder that crashed in the middle of an update leaves the segment
+// inconsistent forever, so readers can't wait indefinitely.
+static const int MAX_RETRIES = 1000;
+
+struct nf9_stats_reader
+{
+    const shm_stats_segment* segment;
+};
+
+static uint64_t now(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+uint64_t shm_stats_writer::now_coarse()
+{
+    return now(CLOCK_MONOTONIC_COARSE);
+}
+
+// Map a segment which already exists and isn't held by another writer.
+// Readers may have it mapped, so it's neither truncated nor cleared, and
+// its header must match.
+static shm_stats_segment* map_existing(int fd)
+{
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK)
+            errno = EBUSY;
+        return nullptr;
+    }
+
+    // The writer which created the segment may not have sized it yet.
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return nullptr;
+    if (size_t(st.st_size) < sizeof(shm_stats_segment)) {
+        errno = EAGAIN;
+        return nullptr;
+    }
+
+    void* addr = mmap(nullptr, sizeof(shm_stats_segment),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+
+    // A writer which crashed before initializing the segment left it
+    // zeroed.
+    auto* segment = static_cast<shm_stats_segment*>(addr);
+    if (segment->magic.load(std::memory_order_relaxed) == 0) {
+        segment->version = shm_stats_segment::VERSION;
+        segment->num_stats = NF9_NUM_STATS;
+        segment->magic.store(shm_stats_segment::MAGIC,
+                             std::memory_order_release);
+    }
+    if (segment->magic.load(std::memory_order_relaxed) !=
+            shm_stats_segment::MAGIC ||
+        segment->version != shm_stats_segment::VERSION) {
+        munmap(addr, sizeof(shm_stats_segment));
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    // A writer which crashed in the middle of an update left the sequence
+    // odd.  It no longer holds the lock, so nobody else writes it.
+    uint64_t seq = segment->sequence.load(std::memory_order_relaxed);
+    if (seq % 2 != 0)
+        segment->sequence.store(seq + 1, std::memory_order_release);
+    return segment;
+}
+
+// Map a segment created by this writer.
+static shm_stats_segment* map_new(int fd)
+{
+    // Another writer may hold the lock for a moment, until it sees that the
+    // segment isn't initialized yet.
+    if (flock(fd, LOCK_EX) != 0 ||
+        ftruncate(fd, sizeof(shm_stats_segment)) != 0)
+        return nullptr;
+
+    void* addr = mmap(nullptr, sizeof(shm_stats_segment),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+
+    // The memory is zeroed by ftruncate(), so the sequence starts at 0.
+    // Readers check the magic number before anything else.
+    auto* segment = new (addr) shm_stats_segment;
+    segment->version = shm_stats_segment::VERSION;
+    segment->num_stats = NF9_NUM_STATS;
+    segment->magic.store(shm_stats_segment::MAGIC, std::memory_order_release);
+    return segment;
+}
+
+std::unique_ptr<shm_stats_writer> shm_stats_writer::create(const char* name)
+{
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0)
+        return nullptr;
+
+    shm_stats_segment* segment = created ? map_new(fd) : map_existing(fd);
+    if (segment == nullptr) {
+        int err = errno;
+        close(fd);
+        if (created)
+            shm_unlink(name);
+        errno = err;
+        return nullptr;
+    }
+
+    return std::unique_ptr<shm_stats_writer>(
+        new shm_stats_writer(name, fd, segment, created));
+}
+
+shm_stats_writer::~shm_stats_writer()
+{
+    munmap(segment_, sizeof(shm_stats_segment));
+    if (created_)
+        shm_unlink(name_.c_str());
+    close(fd_);
+}
+
+void shm_stats_writer::publish(const nf9_state& state)
+{
+    uint64_t values[NF9_NUM_STATS];
+    nf9_get_stats_into(&state, values, NF9_NUM_STATS);
+
+    uint64_t seq = segment_->sequence.load(std::memory_order_relaxed);
+    segment_->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t i = 0; i < NF9_NUM_STATS; ++i)
+        segment_->values[i].store(values[i], std::memory_order_relaxed);
+    segment_->timestamp.store(now(CLOCK_REALTIME), std::memory_order_relaxed);
+
+    segment_->sequence.store(seq + 2, std::memory_order_release);
+    next_publish_ = now_coarse() + interval_;
+}
+
+int nf9_publish_stats(nf9_state* state, const char* name)
+{
+    // The segment is already published.  Replacing the writer would remove
+    // it.
+    if (state->shm_stats && state->shm_stats->name() == name) {
+        state->shm_stats->publish(*state);
+        return 0;
+    }
+
+    std::unique_ptr<shm_stats_writer> writer = shm_stats_writer::create(name);
+    if (!writer)
+        return NF9_ERR_SYSTEM;
+
+    writer->publish(*state);
+    state->shm_stats = std::move(writer);
+    return 0;
+}
+
+nf9_stats_reader* nf9_open_stats_reader(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return nullptr;
+
+    // Accessing the mapping beyond the end of the object would raise
+    // SIGBUS, and the writer may not have sized it yet.
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return nullptr;
+    }
+    if (size_t(st.st_size) < sizeof(shm_stats_segment)) {
+        close(fd);
+        errno = EAGAIN;
+        return nullptr;
+    }
+
+    void* addr = mmap(nullptr, sizeof(shm_stats_segment), PROT_READ,
+                      MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+        errno = err;
+        return nullptr;
+    }
+
+    auto* segment = static_cast<const shm_stats_segment*>(addr);
+    uint32_t magic = segment->magic.load(std::memory_order_acquire);
+    if (magic != shm_stats_segment::MAGIC ||
+        segment->version != shm_stats_segment::VERSION) {
+        munmap(addr, sizeof(shm_stats_segment));
+        errno = magic == 0 ? EAGAIN : EINVAL;
+        return nullptr;
+    }
+
+    return new nf9_stats_reader{segment};
+}
+
+int nf9_read_published_stats(const nf9_stats_reader* reader, uint64_t* values,
+                             size_t* count, uint64_t* timestamp)
+{
+    const shm_stats_segment* segment = reader->segment;
+    size_t n = std::min<size_t>(*count, segment->num_stats);
+    n = std::min<size_t>(n, shm_stats_segment::MAX_STATS);
+
+    for (int attempt = 0; attempt < MAX_RETRIES; ++attempt) {
+        uint64_t seq = segment->sequence.load(std::memory_order_acquire);
+        if (seq % 2 != 0) {
+            sched_yield();
+            continue;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            values[i] = segment->values[i].load(std::memory_order_relaxed);
+        uint64_t ts = segment->timestamp.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (segment->sequence.load(std::memory_order_relaxed) == seq) {
+            if (timestamp != nullptr)
+                *timestamp = ts;
+            *count = n;
+            return 0;
+        }
+    }
+
+    errno = EAGAIN;
+    return NF9_ERR_SYSTEM;
+}
+
+void nf9_close_stats_reader(nf9_stats_reader* reader)
+{
+    munmap(const_cast<shm_stats_segment*>(reader->segment),
+           sizeof(shm_stats_segment));
+    delete reader;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#ifndef SHM_STATS_H
+#define SHM_STATS_H
+
+#include <netflow9.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/*
+ * Layout of the shared memory segment with decoder statistics.
+ *
+ * The segment is written only by the decoder, which holds an exclusive
+ * flock() on it, so that a second decoder can't publish to the same name.
+ * `magic' is stored last when the segment is created.  `sequence' is odd
+ * while values are being updated; readers retry if it was odd or changed
+ * while they were copying the values.
+ */
+struct shm_stats_segment
+{
+    static constexpr uint32_t MAGIC = 0x4e463953;  // "NF9S"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t MAX_STATS = 32;
+
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t num_stats;
+    uint32_t reserved;
+
+    std::atomic<uint64_t> sequence;
+
+    /* CLOCK_REALTIME of the last update, in nanoseconds. */
+    std::atomic<uint64_t> timestamp;
+
+    /* Indexed by enum nf9_stat. */
+    std::atomic<uint64_t> values[MAX_STATS];
+};
+
+static_assert(NF9_NUM_STATS <= shm_stats_segment::MAX_STATS,
+              "shm_stats_segment::MAX_STATS is too small");
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory statistics need lock-free atomics");
+
+/* Publishes statistics of a decoder to a shared memory segment. */
+class shm_stats_writer
+{
+public:
+    shm_stats_writer(const shm_stats_writer&) = delete;
+    shm_stats_writer& operator=(const shm_stats_writer&) = delete;
+    ~shm_stats_writer();
+
+    /* Create the segment, or use the existing one with the same name if
+     * no other writer holds it.  Returns nullptr and sets errno on failure,
+     * to EBUSY if another writer holds the segment. */
+    static std::unique_ptr<shm_stats_writer> create(const char* name);
+
+    /* Copy statistics of the decoder to the segment if more than `interval'
+     * milliseconds passed since the last update. */
+    void maybe_publish(const nf9_state& state)
+    {
+        if (now_coarse() >= next_publish_)
+            publish(state);
+    }
+
+    void publish(const nf9_state& state);
+
+    void set_interval(uint64_t milliseconds)
+    {
+        interval_ = milliseconds * 1000000;
+        next_publish_ = 0;
+    }
+
+    const std::string& name() const
+    {
+        return name_;
+    }
+
+private:
+    shm_stats_writer(std::string name, int fd, shm_stats_segment* segment,
+                     bool created)
+        : name_(std::move(name)), fd_(fd), segment_(segment),
+          created_(created)
+    {
+    }
+
+    static uint64_t now_coarse();
+
+    std::string name_;
+
+    /* Open for as long as the writer exists, to hold the lock. */
+    int fd_;
+    shm_stats_segment* segment_;
+
+    /* The segment is removed with the writer only if the writer created
+     * it. */
+    bool created_;
+    uint64_t interval_ = 100 * 1000000;
+    uint64_t next_publish_ = 0;
+};
+
+#endif
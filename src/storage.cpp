@@ -5,26 +5,116 @@
  */
 
 #include "storage.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <mutex>
+#include <functional>
+#include <new>
+#include <tuple>
+#include "pool.h"
+
+void* callback_memory_resource::do_allocate(std::size_t bytes,
+                                            std::size_t alignment)
+{
+    if (alignment <= alignof(std::max_align_t)) {
+        void* p = allocator_.malloc(bytes, allocator_.ctx);
+        if (p == nullptr)
+            throw out_of_memory_error("Allocator callback failed");
+        return p;
+    }
+
+    // Over-aligned memory: allocate more and keep the pointer returned by
+    // the callback right before the aligned block.  The callback returns
+    // memory aligned at least like max_align_t, so there's room for it.
+    void* raw = allocator_.malloc(bytes + alignment, allocator_.ctx);
+    if (raw == nullptr)
+        throw out_of_memory_error("Allocator callback failed");
+    uintptr_t aligned =
+        (reinterpret_cast<uintptr_t>(raw) + alignment) & ~(alignment - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+void callback_memory_resource::do_deallocate(void* p, std::size_t bytes,
+                                             std::size_t alignment)
+{
+    if (alignment > alignof(std::max_align_t))
+        p = static_cast<void**>(p)[-1];
+    allocator_.free(p, allocator_.ctx);
+}
+
+bool callback_memory_resource::do_is_equal(
+    const pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
+
+limited_memory_resource::limited_memory_resource(
+    size_t max_size, bool accurate, pmr::memory_resource* upstream,
+    std::unique_ptr<pool_memory_resource> pool)
+    : max_size_(max_size),
+      accurate_(accurate),
+      owned_pool_(std::move(pool)),
+      pool_(owned_pool_.get()),
+      upstream_(pool_ ? static_cast<pmr::memory_resource*>(pool_) : upstream),
+      used_(0)
+{
+}
+
+limited_memory_resource::limited_memory_resource(size_t max_size,
+                                                 bool accurate,
+                                                 pool_memory_resource* pool)
+    : max_size_(max_size),
+      accurate_(accurate),
+      pool_(pool),
+      upstream_(pool),
+      used_(0)
+{
+}
+
+limited_memory_resource::~limited_memory_resource() = default;
+
+size_t limited_memory_resource::charged_size(std::size_t bytes,
+                                             std::size_t alignment) const
+{
+    if (!accurate_)
+        return bytes;
+
+    if (pool_) {
+        if (size_t size = pool_->block_size(bytes, alignment))
+            return size;
+    }
+
+    // Size of the chunk that malloc carves out for the request: the size
+    // header plus the data, rounded up to the chunk alignment, and never
+    // smaller than the minimal chunk.  Over-aligned requests waste up to
+    // `alignment' bytes more.
+    const size_t header = sizeof(size_t);
+    const size_t chunk_align = 2 * sizeof(size_t);
+    const size_t min_chunk = 4 * sizeof(size_t);
+    size_t size = (bytes + header + chunk_align - 1) & ~(chunk_align - 1);
+    if (alignment > chunk_align)
+        size += alignment;
+    return std::max(size, min_chunk);
+}
 
 void* limited_memory_resource::do_allocate(std::size_t bytes,
                                            std::size_t alignment)
 {
-    if (bytes > max_size_ - used_)
+    size_t charged = charged_size(bytes, alignment);
+    size_t used = used_;
+    if (used > max_size_ || charged > max_size_ - used)
         throw out_of_memory_error("Memory limit has been reached");
-    pmr::memory_resource* mr = pmr::new_delete_resource();
-    void* result = mr->allocate(bytes, alignment);
-    used_ += bytes;
+    void* result = upstream_->allocate(bytes, alignment);
+    used_ += charged;
     return result;
 }
 
 void limited_memory_resource::do_deallocate(void* p, std::size_t bytes,
                                             std::size_t alignment)
 {
-    pmr::memory_resource* mr = pmr::new_delete_resource();
-    mr->deallocate(p, bytes, alignment);
-    used_ -= bytes;
+    upstream_->deallocate(p, bytes, alignment);
+    used_ -= charged_size(bytes, alignment);
 }
 
 bool limited_memory_resource::do_is_equal(
@@ -38,124 +128,1130 @@ size_t limited_memory_resource::get_current() const
     return used_;
 }
 
+size_t limited_memory_resource::get_limit() const
+{
+    return max_size_;
+}
+
 void limited_memory_resource::set_limit(size_t max_mem)
 {
     max_size_ = max_mem;
 }
 
-template <typename T>
-int delete_expired_objects(uint32_t timestamp, uint32_t expire_time,
-                           T& stored_map, nf9_stats& stats)
+bool limited_memory_resource::fits(size_t size) const
+{
+    size_t used = used_;
+    if (used > max_size_ || size > max_size_ - used)
+        return false;
+    // Free memory of a fixed region may be split into blocks too small for
+    // new objects, then expired objects must be deleted first.
+    return !pool_ || pool_->can_allocate(size);
+}
+
+bool parsed_template::add_field(nf9_field field, uint16_t length)
+{
+    bool scope = (field & NF9_SCOPE_FIELD(0)) != 0;
+    uint32_t type = field & ~NF9_SCOPE_FIELD(0);
+    if (type > UINT16_MAX || (scope && num_scope_fields != fields.size()))
+        return false;
+
+    fields.push_back(template_field{static_cast<uint16_t>(type), length});
+    if (scope)
+        ++num_scope_fields;
+    total_length += length;
+    return true;
+}
+
+data_template* data_template::create(const parsed_template& parsed,
+                                     pmr::memory_resource* mr)
+{
+    size_t n = parsed.fields.size();
+    void* mem = mr->allocate(allocation_size(n), alignof(data_template));
+
+    data_template* tmpl = new (mem) data_template;
+    tmpl->total_length = static_cast<uint16_t>(parsed.total_length);
+    tmpl->timestamp = parsed.timestamp;
+    tmpl->last_used = 0;
+    tmpl->hits = 0;
+    tmpl->num_fields_ = static_cast<uint16_t>(n);
+    tmpl->num_scope_fields_ = parsed.num_scope_fields;
+    tmpl->is_option_ = parsed.is_option;
+    std::copy(parsed.fields.begin(), parsed.fields.end(),
+              reinterpret_cast<template_field*>(tmpl + 1));
+    return tmpl;
+}
+
+void data_template::destroy(data_template* tmpl, pmr::memory_resource* mr)
+{
+    mr->deallocate(tmpl, allocation_size(tmpl->num_fields()),
+                   alignof(data_template));
+}
+
+bool data_template::find_field(nf9_field field, size_t& offset,
+                               size_t& length) const
+{
+    bool found = false;
+    size_t field_offset = 0;
+
+    for (size_t i = 0; i < num_fields(); ++i) {
+        if (field_type(i) == field) {
+            offset = field_offset;
+            length = fields()[i].length;
+            found = true;
+        }
+        field_offset += fields()[i].length;
+    }
+    return found;
+}
+
+data_template* template_table::assign(uint16_t tid,
+                                      const parsed_template& parsed)
+{
+    pmr::memory_resource* mr = ids.get_allocator().resource();
+    auto it = std::lower_bound(ids.begin(), ids.end(), tid);
+    size_t pos = it - ids.begin();
+    if (it != ids.end() && *it == tid) {
+        data_template* tmpl = data_template::create(parsed, mr);
+        data_template::destroy(templates[pos], mr);
+        templates[pos] = tmpl;
+        return tmpl;
+    }
+
+    // Reserve both arrays up front, so that running out of memory leaves
+    // the table unchanged.
+    ids.reserve(ids.size() + 1);
+    templates.reserve(templates.size() + 1);
+    data_template* tmpl = data_template::create(parsed, mr);
+    ids.insert(ids.begin() + pos, tid);
+    templates.insert(templates.begin() + pos, tmpl);
+    return tmpl;
+}
+
+bool template_table::erase(uint16_t tid)
+{
+    auto it = std::lower_bound(ids.begin(), ids.end(), tid);
+    if (it == ids.end() || *it != tid)
+        return false;
+
+    auto tmpl = templates.begin() + (it - ids.begin());
+    data_template::destroy(*tmpl, ids.get_allocator().resource());
+    templates.erase(tmpl);
+    ids.erase(it);
+    return true;
+}
+
+void template_table::clear()
+{
+    for (data_template* tmpl : templates)
+        data_template::destroy(tmpl, ids.get_allocator().resource());
+    templates.clear();
+    ids.clear();
+}
+
+// Memory charged to an exporter for a template with given number of fields.
+static size_t template_memory(const nf9_state& state, size_t num_fields)
+{
+    return state.memory->charged_size(
+               data_template::allocation_size(num_fields),
+               alignof(data_template)) +
+           sizeof(uint16_t) + sizeof(data_template*);
+}
+
+void delete_template(nf9_state& state, const stream_id& sid)
+{
+    exporter& exp = state.exporters[sid.exporter];
+    if (const data_template* tmpl = exp.templates.find(sid.tid)) {
+        exp.template_memory -= template_memory(state, tmpl->num_fields());
+        exp.templates.erase(sid.tid);
+    }
+}
+
+static int delete_expired_templates(uint32_t timestamp, nf9_state& state)
+{
+    NF9_TIME_STAGE(state, NF9_STAGE_EXPIRE_OBJECTS);
+
+    int deleted_objects = 0;
+    uint32_t expiration_timestamp;
+    if (timestamp > state.template_expire_time)
+        expiration_timestamp = timestamp - state.template_expire_time;
+    else
+        expiration_timestamp = 0;
+
+    for (const auto& [_, index] : state.exporter_ids) {
+        template_table& table = state.exporters[index].templates;
+        for (size_t i = 0; i < table.size();) {
+            if (table.templates[i]->timestamp <= expiration_timestamp) {
+                ++deleted_objects;
+                state.stats.add(NF9_STAT_EXPIRED_OBJECTS);
+                delete_template(state, stream_id{index, table.ids[i]});
+            }
+            else {
+                ++i;
+            }
+        }
+    }
+    return deleted_objects;
+}
+
+static int delete_expired_options(uint32_t timestamp, nf9_state& state)
 {
+    NF9_TIME_STAGE(state, NF9_STAGE_EXPIRE_OBJECTS);
+
     int deleted_objects = 0;
     uint32_t expiration_timestamp;
+    if (timestamp > state.option_expire_time)
+        expiration_timestamp = timestamp - state.option_expire_time;
+    else
+        expiration_timestamp = 0;
+
+    for (const auto& [_, index] : state.exporter_ids) {
+        exporter& exp = state.exporters[index];
+        if (exp.options && exp.options_timestamp <= expiration_timestamp) {
+            ++deleted_objects;
+            state.stats.add(NF9_STAT_EXPIRED_OBJECTS);
+            exp.options.reset();
+        }
+    }
+    return deleted_objects;
+}
+
+/* Drop everything that is stored for the exporter with given index and put the
+ * index on the free list. */
+static void delete_exporter(nf9_state& state, uint32_t index)
+{
+    state.exporters[index].templates.clear();
+    state.exporters[index].template_memory = 0;
+    state.exporters[index].options.reset();
+
+    state.exporters[index].pending.clear();
+    state.exporters[index].pending_bytes = 0;
+
+    for (auto it = state.sampling_rates.begin();
+         it != state.sampling_rates.end();) {
+        if (it->first.exporter == index)
+            it = state.sampling_rates.erase(it);
+        else
+            ++it;
+    }
+
+    state.exporters[index].next_free = state.free_exporter;
+    state.free_exporter = index;
+}
+
+/* Delete exporters that haven't sent anything for longer than both template
+ * and option expiration times, along with their templates and options. */
+static int delete_expired_exporters(nf9_state& state, uint32_t timestamp)
+{
+    NF9_TIME_STAGE(state, NF9_STAGE_EXPIRE_OBJECTS);
+
+    int deleted_exporters = 0;
+    uint32_t expire_time =
+        std::max(state.template_expire_time, state.option_expire_time);
+    uint32_t expiration_timestamp;
     if (timestamp > expire_time)
         expiration_timestamp = timestamp - expire_time;
     else
         expiration_timestamp = 0;
 
-    for (auto it = stored_map.begin(); it != stored_map.end();) {
-        if (it->second.timestamp <= expiration_timestamp) {
-            ++deleted_objects;
-            ++stats.expired_templates;
-            it = stored_map.erase(it);
+    for (auto it = state.exporter_ids.begin();
+         it != state.exporter_ids.end();) {
+        const exporter& exp = state.exporters[it->second];
+        if (exp.timestamp <= expiration_timestamp) {
+            ++deleted_exporters;
+            state.stats.add(NF9_STAT_EXPIRED_OBJECTS,
+                            exp.templates.size() + bool(exp.options));
+            delete_exporter(state, it->second);
+            it = state.exporter_ids.erase(it);
         }
         else {
             ++it;
         }
     }
-    return deleted_objects;
+    return deleted_exporters;
 }
 
-void assign_template(nf9_state& state, data_template& tmpl, stream_id& sid)
+// Upper bounds of memory needed to store new objects.  Room is made for an
+// object before it's allocated, so that running out of memory is reported
+// with an error code instead of an exception thrown by the allocator.
+
+// Memory needed to insert a node into a hash table, including the new
+// bucket array if the table has to grow.
+template <typename Map>
+static size_t map_insert_size(const limited_memory_resource& mr,
+                              const Map& map)
 {
-    state.templates.insert_or_assign(
-        sid, data_template{
-                 {tmpl.fields.begin(), tmpl.fields.end(), state.memory.get()},
-                 tmpl.total_length,
-                 tmpl.timestamp,
-                 tmpl.is_option});
+    // A node holds the value, a pointer to the next node and possibly a
+    // cached hash.
+    size_t size =
+        mr.charged_size(2 * sizeof(void*) + sizeof(typename Map::value_type));
+    if (map.size() + 1 > map.max_load_factor() * map.bucket_count())
+        size += mr.charged_size((2 * map.bucket_count() + 16) * sizeof(void*));
+    return size;
 }
 
-int save_template(data_template& tmpl, stream_id& sid, nf9_state& state,
-                  nf9_packet& result)
+// Memory needed to append an element to a vector.
+template <typename Vector>
+static size_t vector_append_size(const limited_memory_resource& mr,
+                                 const Vector& vec)
 {
-    if (tmpl.total_length == 0)
-        return NF9_ERR_MALFORMED;
-    if (state.templates.count(sid) != 0 &&
-        (tmpl.timestamp < state.templates[sid].timestamp))
-        return NF9_ERR_OUTDATED;
+    if (vec.size() < vec.capacity())
+        return 0;
+    return mr.charged_size(std::max<size_t>(2 * vec.capacity(), 1) *
+                           sizeof(typename Vector::value_type));
+}
 
-    try {
-        assign_template(state, tmpl, sid);
-    } catch (const out_of_memory_error&) {
-        int deleted =
-            delete_expired_objects(result.timestamp, state.template_expire_time,
-                                   state.templates, state.stats);
-        if (deleted == 0)
-            return NF9_ERR_OUT_OF_MEMORY;
+static size_t exporter_size(const nf9_state& state)
+{
+    const limited_memory_resource& mr = *state.memory;
+    size_t size = map_insert_size(mr, state.exporter_ids);
+    if (state.free_exporter == NO_EXPORTER)
+        size += vector_append_size(mr, state.exporters);
+    return size;
+}
 
-        try {
-            assign_template(state, tmpl, sid);
-        } catch (const out_of_memory_error&) {
-            return NF9_ERR_OUT_OF_MEMORY;
+static size_t template_size(const nf9_state& state, const template_table& table,
+                            const parsed_template& tmpl, bool replace)
+{
+    const limited_memory_resource& mr = *state.memory;
+    size_t size =
+        mr.charged_size(data_template::allocation_size(tmpl.fields.size()),
+                        alignof(data_template));
+    // Full arrays of the table grow by one element.
+    if (!replace && table.ids.size() == table.ids.capacity())
+        size += mr.charged_size((table.size() + 1) * sizeof(uint16_t));
+    if (!replace && table.templates.size() == table.templates.capacity())
+        size += mr.charged_size((table.size() + 1) * sizeof(data_template*));
+    return size;
+}
+
+// Memory needed to store a copy of an option record.
+static size_t record_size(const nf9_state& state, const flow& f)
+{
+    const limited_memory_resource& mr = *state.memory;
+    size_t size = mr.charged_size((2 * f.size() + 16) * sizeof(void*));
+    for (const auto& [_, value] : f)
+        size += mr.charged_size(2 * sizeof(void*) + sizeof(flow::value_type)) +
+                mr.charged_size(value.size());
+    return size;
+}
+
+// Memory needed for a new option snapshot without records.  The snapshot
+// shares its allocation with the control block.
+static size_t snapshot_size(const nf9_state& state)
+{
+    const limited_memory_resource& mr = *state.memory;
+    return mr.charged_size(sizeof(option_snapshot) + 4 * sizeof(void*)) +
+           record_size(state, flow());
+}
+
+static size_t options_memory(const nf9_state& state,
+                             const option_snapshot& snapshot)
+{
+    const limited_memory_resource& mr = *state.memory;
+    return snapshot.memory +
+           mr.charged_size(snapshot.scoped.bucket_count() * sizeof(void*)) +
+           mr.charged_size(snapshot.interfaces.bucket_count() * sizeof(void*));
+}
+
+// SNMP index of the interface described by an option record, if it has
+// interface scope and carries the name or description of the interface.
+static std::optional<uint32_t> interface_index(const flow& f)
+{
+    auto it = f.find(NF9_SCOPE_FIELD_INTERFACE);
+    if (it == f.end() || it->second.empty() ||
+        it->second.size() > sizeof(uint32_t))
+        return std::nullopt;
+    if (f.count(NF9_FIELD_IF_NAME) == 0 && f.count(NF9_FIELD_IF_DESC) == 0)
+        return std::nullopt;
+
+    uint32_t index = 0;
+    for (uint8_t byte : it->second)
+        index = index << 8 | byte;
+    return index;
+}
+
+// Text of a string field without its null padding, or nullopt if there is
+// no such field.
+static std::optional<std::string_view> field_text(const flow& f,
+                                                  nf9_field field)
+{
+    auto it = f.find(field);
+    if (it == f.end())
+        return std::nullopt;
+
+    const char* begin = reinterpret_cast<const char*>(it->second.data());
+    const char* end = begin + it->second.size();
+    return std::string_view(begin, std::find(begin, end, '\0') - begin);
+}
+
+// Whether `size' more bytes fit in the memory limit of the dictionary.
+static bool string_fits(const nf9_state& state, size_t size)
+{
+    size_t limit = state.max_string_memory;
+    if (limit == 0)
+        limit = state.memory->get_limit() / 4;
+    return state.strings.memory() + size <= limit;
+}
+
+// Memory charged for a copy of text which didn't fit in the dictionary.
+static size_t text_copy_size(const nf9_state& state, size_t length)
+{
+    return length == 0 ? 0 : state.memory->charged_size(length + 1);
+}
+
+// Memory needed to store text: in the dictionary of the decoder, or as a
+// copy if the dictionary is full.
+static size_t string_size(const nf9_state& state, std::string_view text)
+{
+    if (text.empty() || state.strings.find(text) != 0)
+        return 0;
+    size_t size = state.strings.insert_size(text.size());
+    return string_fits(state, size) ? size : text_copy_size(state, text.size());
+}
+
+// Memory needed to store a string field of an option record.
+static size_t text_size(const nf9_state& state, const flow& f,
+                        nf9_field field)
+{
+    auto text = field_text(f, field);
+    return text ? string_size(state, *text) : 0;
+}
+
+// Call `fn' with the key of each scope of an option record: its scope
+// fields and the sampler ID, whose values fit in 64 bits.
+template <typename Function>
+static void for_each_scope(const flow& f, Function fn)
+{
+    for (const auto& [field, value] : f) {
+        if (!(field & NF9_SCOPE_FIELD(0)) &&
+            field != NF9_FIELD_FLOW_SAMPLER_ID)
+            continue;
+        if (value.empty() || value.size() > sizeof(uint64_t))
+            continue;
+
+        uint64_t key = 0;
+        for (uint8_t byte : value)
+            key = key << 8 | byte;
+        fn(scope_key{field, key});
+    }
+}
+
+// Memory needed to add an option record to `snapshot', which is null if
+// there are no options yet.
+static size_t option_size(const nf9_state& state,
+                          const option_snapshot* snapshot, const flow& f)
+{
+    const limited_memory_resource& mr = *state.memory;
+    size_t record = record_size(state, f);
+    size_t size = snapshot ? record : snapshot_size(state) + record;
+    size_t num_scopes = 0;
+    for_each_scope(f, [&](const scope_key&) {
+        size += record;
+        ++num_scopes;
+    });
+
+    // New entries of the scope index, and its bucket array if it grows.
+    if (num_scopes > 0) {
+        size_t num_buckets = snapshot ? snapshot->scoped.bucket_count() : 0;
+        size_t node = 2 * sizeof(void*) + sizeof(scoped_options::value_type);
+        size += num_scopes * mr.charged_size(node);
+        size += mr.charged_size((2 * (num_buckets + num_scopes) + 16) *
+                                sizeof(void*));
+    }
+
+    // A new entry of the interface table, and its bucket array if it grows.
+    // Names are interned, so they're shared by all exporters and copies of
+    // the snapshot.
+    if (interface_index(f)) {
+        size_t num_buckets = snapshot ? snapshot->interfaces.bucket_count() : 0;
+        size += mr.charged_size(2 * sizeof(void*) +
+                                sizeof(interface_table::value_type)) +
+                mr.charged_size((2 * num_buckets + 16) * sizeof(void*)) +
+                text_size(state, f, NF9_FIELD_IF_NAME) +
+                text_size(state, f, NF9_FIELD_IF_DESC);
+    }
+    return size;
+}
+
+// Memory of the option records replaced by a new one.
+static size_t replaced_option_size(const nf9_state& state,
+                                   const option_snapshot& snapshot,
+                                   const flow& f)
+{
+    size_t size = record_size(state, snapshot.options_flow);
+    for_each_scope(f, [&](const scope_key& key) {
+        if (auto it = snapshot.scoped.find(key); it != snapshot.scoped.end())
+            size += record_size(state, it->second);
+    });
+    if (auto index = interface_index(f)) {
+        if (auto it = snapshot.interfaces.find(*index);
+            it != snapshot.interfaces.end())
+            size += text_copy_size(state, it->second.name_copy.size()) +
+                    text_copy_size(state, it->second.description_copy.size());
+    }
+    return size;
+}
+
+static bool fits(const nf9_state& state, size_t size)
+{
+    return state.memory->fits(size);
+}
+
+uint32_t intern_string(nf9_state& state, std::string_view text)
+{
+    if (text.empty())
+        return 0;
+    if (uint32_t id = state.strings.find(text); id != 0)
+        return id;
+
+    // Strings are never removed, so they are kept within their own limit,
+    // and nothing is evicted to make room for them.
+    size_t size = state.strings.insert_size(text.size());
+    if (!string_fits(state, size) || !fits(state, size))
+        return 0;
+    return state.strings.intern(text);
+}
+
+// Memory charged for data flowsets queued for an exporter.
+static size_t pending_memory(const nf9_state& state, const exporter& exp)
+{
+    const limited_memory_resource& mr = *state.memory;
+    size_t size = 0;
+    if (exp.pending.capacity() > 0)
+        size += mr.charged_size(exp.pending.capacity() *
+                                sizeof(pending_flowset));
+    for (const pending_flowset& pf : exp.pending)
+        size += mr.charged_size(pf.data.size());
+    return size;
+}
+
+size_t exporter_memory(const nf9_state& state, uint32_t index)
+{
+    const exporter& exp = state.exporters[index];
+    size_t size = exp.template_memory + pending_memory(state, exp);
+    if (exp.options)
+        size += options_memory(state, *exp.options);
+    return size;
+}
+
+// Order of deleting objects which haven't expired: the lowest key goes
+// first.
+using eviction_key = std::pair<uint64_t, uint32_t>;
+
+static eviction_key get_eviction_key(const nf9_state& state, uint32_t received,
+                                     uint32_t last_used, uint32_t hits)
+{
+    switch (state.eviction_policy) {
+        case NF9_EVICTION_LRU:
+            return {std::max(received, last_used), 0};
+        case NF9_EVICTION_LFU:
+            return {hits, std::max(received, last_used)};
+        default:
+            return {received, 0};
+    }
+}
+
+static eviction_key get_eviction_key(const nf9_state& state,
+                                     const data_template& tmpl)
+{
+    return get_eviction_key(state, tmpl.timestamp, tmpl.last_used, tmpl.hits);
+}
+
+void age_hits(nf9_state& state)
+{
+    for (const auto& [_, index] : state.exporter_ids) {
+        exporter& exp = state.exporters[index];
+        for (size_t i = 0; i < exp.templates.size(); ++i)
+            exp.templates.templates[i]->hits /= 2;
+        exp.options_hits /= 2;
+    }
+}
+
+// Values of `keep' which don't name a template.
+const int KEEP_NOTHING = -1;
+const int KEEP_OPTIONS = -2;
+
+// A template that can be evicted, or the options if the ID is -1, with the
+// exporter index and its eviction key.  Candidates are kept in a min-heap,
+// so that only the victims are ordered.
+using eviction_candidate = std::tuple<eviction_key, uint32_t, int>;
+using eviction_heap = pmr::vector<eviction_candidate>;
+
+// Add templates and options of an exporter to `heap', except template
+// `keep', or the options if it's KEEP_OPTIONS.  make_eviction_heap() must
+// be called afterwards.
+static void add_eviction_candidates(const nf9_state& state, uint32_t index,
+                                    int keep, eviction_heap& heap)
+{
+    const exporter& exp = state.exporters[index];
+    const template_table& table = exp.templates;
+    for (size_t i = 0; i < table.size(); ++i)
+        if (table.ids[i] != keep)
+            heap.emplace_back(get_eviction_key(state, *table.templates[i]),
+                              index, table.ids[i]);
+    if (exp.options && keep != KEEP_OPTIONS)
+        heap.emplace_back(get_eviction_key(state, exp.options_timestamp,
+                                           exp.options_last_used,
+                                           exp.options_hits),
+                          index, -1);
+}
+
+static void make_eviction_heap(eviction_heap& heap)
+{
+    std::make_heap(heap.begin(), heap.end(),
+                   std::greater<eviction_candidate>());
+}
+
+// Delete the candidate which comes first in the order of the eviction
+// policy, and set `freed' to the memory it was charged to its exporter.
+// Returns false if there's nothing to delete.
+static bool evict_object(nf9_state& state, eviction_heap& heap,
+                         size_t& freed)
+{
+    if (heap.empty())
+        return false;
+    std::pop_heap(heap.begin(), heap.end(),
+                  std::greater<eviction_candidate>());
+    auto [_, index, tid] = heap.back();
+    heap.pop_back();
+
+    exporter& exp = state.exporters[index];
+    state.stats.add(NF9_STAT_EVICTED_OBJECTS);
+    if (tid >= 0) {
+        size_t before = exp.template_memory;
+        delete_template(state, stream_id{index, uint16_t(tid)});
+        freed = before - exp.template_memory;
+    }
+    else {
+        freed = options_memory(state, *exp.options);
+        exp.options.reset();
+    }
+    return true;
+}
+
+// Delete data flowsets queued for an exporter, oldest first, and then its
+// templates and options in the order of the eviction policy, until it uses
+// at most `target' bytes.  Template `keep', or the options if it's
+// KEEP_OPTIONS, and flowsets waiting for the template are kept.  Returns
+// false if that's not possible.
+static bool trim_exporter(nf9_state& state, uint32_t index, size_t target,
+                          int keep)
+{
+    exporter& exp = state.exporters[index];
+    size_t memory = exporter_memory(state, index);
+    if (memory <= target)
+        return true;
+
+    // The capacity of the queue stays charged, only the flowsets are freed.
+    auto kept = exp.pending.begin();
+    for (auto it = exp.pending.begin(); it != exp.pending.end(); ++it) {
+        if (memory > target && it->tid != keep) {
+            memory -= state.memory->charged_size(it->data.size());
+            exp.pending_bytes -= it->data.size();
+            state.stats.add(NF9_STAT_MISSING_TEMPLATE_ERRORS);
+            ++exp.counters.missing_templates;
         }
+        else {
+            if (kept != it)
+                *kept = std::move(*it);
+            ++kept;
+        }
+    }
+    exp.pending.erase(kept, exp.pending.end());
+    if (memory <= target)
+        return true;
+
+    eviction_heap heap(state.heap);
+    add_eviction_candidates(state, index, keep, heap);
+    make_eviction_heap(heap);
+    size_t freed;
+    while (memory > target) {
+        if (!evict_object(state, heap, freed))
+            return false;
+        memory -= freed;
+    }
+    return true;
+}
+
+// Trim exporters which use more than their quota, which happens when the
+// quota is lowered.  Returns the number of deleted templates.
+static int trim_exporters_over_quota(nf9_state& state)
+{
+    if (state.max_exporter_memory == 0)
+        return 0;
+
+    int deleted = 0;
+    for (const auto& [_, index] : state.exporter_ids) {
+        size_t num_templates = state.exporters[index].templates.size();
+        trim_exporter(state, index, state.max_exporter_memory, KEEP_NOTHING);
+        deleted += num_templates - state.exporters[index].templates.size();
     }
-    assert(state.templates[sid].fields.get_allocator().resource() ==
-           state.memory.get());
+    return deleted;
+}
+
+// Make room in the quota of an exporter for a new template or options of
+// `size' bytes, which replace an object of `replaced' bytes.  Queued
+// flowsets, templates and options of the exporter are deleted if needed,
+// see trim_exporter().
+static int check_quota(nf9_state& state, uint32_t index, size_t size,
+                       size_t replaced, int keep)
+{
+    size_t quota = state.max_exporter_memory;
+    if (quota == 0 || exporter_memory(state, index) - replaced + size <= quota)
+        return 0;
 
+    state.stats.add(NF9_STAT_QUOTA_HITS);
+    ++state.exporters[index].counters.quota_hits;
+    if (size > quota ||
+        !trim_exporter(state, index, quota - size + replaced, keep))
+        return NF9_ERR_OUT_OF_MEMORY;
     return 0;
 }
 
-void assign_option(nf9_state& state, device_options& dev_opts,
-                   device_id& dev_id)
+// Delete objects until `needed()' more bytes fit in the memory limit:
+// first templates of exporters over their quota, then objects deleted by
+// `expire()', and then other objects if the eviction policy allows it.
+template <typename Needed, typename Expire>
+static bool make_room(nf9_state& state, Needed needed, Expire expire)
 {
-    std::lock_guard<std::mutex> lock(state.options_mutex);
-    state.options.insert_or_assign(
-        dev_id, device_options{flow(flow::allocator_type(state.memory.get())),
-                               dev_opts.timestamp});
-    for (auto& [field, value] : dev_opts.options_flow) {
-        auto [inserted_value, _] =
-            state.options[dev_id].options_flow.insert_or_assign(
-                field, pmr::vector<uint8_t>(state.memory.get()));
-        inserted_value->second.assign(value.begin(), value.end());
+    if (fits(state, needed()))
+        return true;
+
+    trim_exporters_over_quota(state);
+    if (!fits(state, needed()))
+        expire();
+    if (state.eviction_policy != NF9_EVICTION_EXPIRED &&
+        !fits(state, needed())) {
+        // Nothing else deletes objects while the heap is used.
+        eviction_heap heap(state.heap);
+        for (const auto& [_, index] : state.exporter_ids)
+            add_eviction_candidates(state, index, KEEP_NOTHING, heap);
+        make_eviction_heap(heap);
+        size_t freed;
+        while (!fits(state, needed()) && evict_object(state, heap, freed))
+            ;
     }
+    return fits(state, needed());
 }
 
-int save_option(nf9_state& state, device_id& dev_id, device_options& dev_opts)
+static uint32_t assign_exporter(nf9_state& state, const device_id& did)
 {
-    try {
-        assign_option(state, dev_opts, dev_id);
-    } catch (const out_of_memory_error&) {
-        int deleted =
-            delete_expired_objects(dev_opts.timestamp, state.option_expire_time,
-                                   state.options, state.stats);
-        if (deleted == 0)
-            return NF9_ERR_OUT_OF_MEMORY;
+    uint32_t index;
+
+    if (state.free_exporter != NO_EXPORTER) {
+        index = state.free_exporter;
+        state.exporter_ids.emplace(did, index);
+        state.free_exporter = state.exporters[index].next_free;
+    }
+    else {
+        index = static_cast<uint32_t>(state.exporters.size());
+        state.exporters.push_back(exporter{
+            did, 0, NO_EXPORTER, template_table(state.memory.get()), 0,
+            nullptr, 0, 0, 0, exporter_counters(),
+            pmr::vector<pending_flowset>(state.memory.get()), 0});
+        state.exporter_ids.emplace(did, index);
+    }
+
+    exporter& exp = state.exporters[index];
+    exp.dev_id = did;
+    exp.timestamp = 0;
+    exp.next_free = NO_EXPORTER;
+    exp.options_timestamp = 0;
+    exp.options_last_used = 0;
+    exp.options_hits = 0;
+    exp.counters = exporter_counters();
+    return index;
+}
+
+void remove_exporter(nf9_state& state, uint32_t index)
+{
+    state.exporter_ids.erase(state.exporters[index].dev_id);
+    delete_exporter(state, index);
+}
 
-        try {
-            assign_option(state, dev_opts, dev_id);
-        } catch (const out_of_memory_error&) {
+int register_exporter(nf9_state& state, const device_id& did,
+                      uint32_t timestamp, uint32_t& index)
+{
+    if (auto it = state.exporter_ids.find(did);
+        it != state.exporter_ids.end()) {
+        index = it->second;
+    }
+    else {
+        // With LRU or LFU eviction, objects of other exporters make room
+        // for a new one, so that a full decoder still accepts new devices.
+        if (!make_room(
+                state, [&] { return exporter_size(state); },
+                [&] { delete_expired_exporters(state, timestamp); }))
             return NF9_ERR_OUT_OF_MEMORY;
-        }
+
+        index = assign_exporter(state, did);
     }
-    assert(state.options[dev_id]
-               .options_flow.begin()
+
+    state.exporters[index].timestamp = timestamp;
+    return 0;
+}
+
+void assign_template(nf9_state& state, const parsed_template& tmpl,
+                     stream_id& sid)
+{
+    exporter& exp = state.exporters[sid.exporter];
+    const data_template* stored = exp.templates.find(sid.tid);
+    size_t replaced = stored ? template_memory(state, stored->num_fields()) : 0;
+
+    // Usage carries over to the refreshed template, but for LFU old uses
+    // count less and less.
+    uint32_t last_used = stored ? stored->last_used : 0;
+    uint16_t hits = stored ? stored->hits / 2 : 0;
+
+    data_template* assigned = exp.templates.assign(sid.tid, tmpl);
+    assigned->last_used = last_used;
+    assigned->hits = hits;
+    exp.template_memory = exp.template_memory - replaced +
+                          template_memory(state, tmpl.fields.size());
+}
+
+int save_template(parsed_template& tmpl, stream_id& sid, nf9_state& state)
+{
+    if (tmpl.total_length == 0 || tmpl.total_length > UINT16_MAX)
+        return NF9_ERR_MALFORMED;
+
+    template_table& table = state.exporters[sid.exporter].templates;
+    const data_template* stored = table.find(sid.tid);
+    if (stored != nullptr && tmpl.timestamp < stored->timestamp)
+        return NF9_ERR_OUTDATED;
+
+    if (int err = check_quota(state, sid.exporter,
+                              template_memory(state, tmpl.fields.size()),
+                              stored ? template_memory(state,
+                                                       stored->num_fields())
+                                     : 0,
+                              sid.tid);
+        err != 0)
+        return err;
+
+    // The template being replaced may be deleted while making room.
+    auto needed = [&] {
+        return template_size(state, table, tmpl,
+                             table.find(sid.tid) != nullptr);
+    };
+    if (!make_room(state, needed, [&] {
+            delete_expired_templates(tmpl.timestamp, state);
+        }))
+        return NF9_ERR_OUT_OF_MEMORY;
+
+    assign_template(state, tmpl, sid);
+
+    if (state.template_store)
+        state.template_store->put(state.exporters[sid.exporter].dev_id, sid.tid,
+                                  tmpl);
+
+    return 0;
+}
+
+// Overwrite values of `stored' which differ from those of `f', if both
+// records have the same fields.  Values of the same size are overwritten
+// without allocating.  Returns false if the fields differ.
+static bool update_values(flow& stored, const flow& f)
+{
+    if (stored.size() != f.size())
+        return false;
+
+    for (const auto& [field, value] : f) {
+        auto it = stored.find(field);
+        if (it == stored.end())
+            return false;
+        if (it->second != value)
+            it->second.assign(value.begin(), value.end());
+    }
+    return true;
+}
+
+// Make `stored' a copy of option record `f' and update the memory charged
+// for the snapshot.
+static void assign_record(const nf9_state& state, option_snapshot& snapshot,
+                          flow& stored, const flow& f)
+{
+    snapshot.memory -= record_size(state, stored);
+    if (!update_values(stored, f))
+        stored = f;
+    snapshot.memory += record_size(state, stored);
+}
+
+// Store the name or description of an interface in the dictionary, or
+// copy it if it doesn't fit there.
+static void assign_text(nf9_state& state, option_snapshot& snapshot,
+                        std::string_view text, uint32_t& id,
+                        pmr::string& copy)
+{
+    snapshot.memory -= text_copy_size(state, copy.size());
+    id = intern_string(state, text);
+    if (id != 0 || text.empty())
+        copy = pmr::string(copy.get_allocator());
+    else
+        copy.assign(text);
+    snapshot.memory += text_copy_size(state, copy.size());
+}
+
+// Add an entry for the interface with given index to `snapshot'.
+static interface_info& add_interface(const nf9_state& state,
+                                     option_snapshot& snapshot,
+                                     uint32_t index)
+{
+    auto [it, inserted] = snapshot.interfaces.try_emplace(index);
+    if (inserted)
+        snapshot.memory += state.memory->charged_size(
+            2 * sizeof(void*) + sizeof(interface_table::value_type));
+    return it->second;
+}
+
+// Update the interface with given index from option record `f'.  Fields
+// missing from the record are left as they are.
+static void assign_interface(nf9_state& state, option_snapshot& snapshot,
+                             uint32_t index, const flow& f)
+{
+    interface_info& info = add_interface(state, snapshot, index);
+    if (auto text = field_text(f, NF9_FIELD_IF_NAME))
+        assign_text(state, snapshot, *text, info.name, info.name_copy);
+    if (auto text = field_text(f, NF9_FIELD_IF_DESC))
+        assign_text(state, snapshot, *text, info.description,
+                    info.description_copy);
+}
+
+void assign_option(nf9_state& state, const device_options& dev_opts,
+                   uint32_t exporter)
+{
+    pmr::memory_resource* mr = state.memory.get();
+    pmr::polymorphic_allocator<option_snapshot> alloc(mr);
+    std::shared_ptr<option_snapshot>& snapshot =
+        state.exporters[exporter].options;
+
+    // Packets decoded earlier keep the snapshot they pinned, so it's copied
+    // before it's updated.
+    if (!snapshot) {
+        snapshot = std::allocate_shared<option_snapshot>(
+            alloc,
+            option_snapshot{flow(mr), scoped_options(mr), interface_table(mr),
+                            snapshot_size(state), 0});
+    }
+    else if (snapshot.use_count() > 1) {
+        snapshot = std::allocate_shared<option_snapshot>(
+            alloc, option_snapshot{flow(snapshot->options_flow, mr),
+                                   scoped_options(snapshot->scoped, mr),
+                                   interface_table(snapshot->interfaces, mr),
+                                   snapshot->memory, snapshot->version});
+    }
+    else {
+        // The last packet that pinned the snapshot may have been freed in
+        // another thread.  use_count() is a relaxed load, so this orders
+        // that thread's reads of the snapshot before our writes to it.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    const flow& f = dev_opts.options_flow;
+    assign_record(state, *snapshot, snapshot->options_flow, f);
+    for_each_scope(f, [&](const scope_key& key) {
+        auto [it, inserted] = snapshot->scoped.try_emplace(key);
+        if (inserted)
+            snapshot->memory += state.memory->charged_size(
+                2 * sizeof(void*) + sizeof(scoped_options::value_type));
+        assign_record(state, *snapshot, it->second, f);
+    });
+    if (auto index = interface_index(f))
+        assign_interface(state, *snapshot, *index, f);
+    snapshot->version = ++state.options_version;
+    state.exporters[exporter].options_timestamp = dev_opts.timestamp;
+}
+
+int save_option(nf9_state& state, uint32_t exporter,
+                const device_options& dev_opts)
+{
+    const flow& f = dev_opts.options_flow;
+    option_snapshot* stored = state.exporters[exporter].options.get();
+
+    // The most recent record is stored under each of its scopes, so if it
+    // didn't change, nothing did.  Such a refresh only extends the lifetime
+    // of the options, and packets keep seeing the same version.
+    if (stored && stored->options_flow == f) {
+        state.exporters[exporter].options_timestamp = dev_opts.timestamp;
+        return 0;
+    }
+
+    size_t size = option_size(state, stored, f);
+    size_t replaced = stored ? replaced_option_size(state, *stored, f) : 0;
+    if (int err = check_quota(state, exporter, size, replaced, KEEP_OPTIONS);
+        err != 0)
+        return err;
+
+    // The options may be deleted while making room.  If they are pinned by
+    // packets, they are copied.  The count is only an estimate here;
+    // assign_option() checks it again before writing.
+    auto needed = [&] {
+        const auto& options = state.exporters[exporter].options;
+        size_t needed_size = option_size(state, options.get(), f);
+        if (options.use_count() > 1)
+            needed_size += options_memory(state, *options);
+        return needed_size;
+    };
+    if (!make_room(state, needed, [&] {
+            delete_expired_options(dev_opts.timestamp, state);
+        }))
+        return NF9_ERR_OUT_OF_MEMORY;
+
+    assign_option(state, dev_opts, exporter);
+    assert(state.exporters[exporter]
+               .options->options_flow.begin()
                ->second.get_allocator()
                .resource() == state.memory.get());
 
     return 0;
 }
 
-int save_sampling_rate(nf9_state& state, const device_id& did, uint32_t sid,
+int restore_options(nf9_state& state, uint32_t exporter,
+                    const option_snapshot& saved, uint32_t timestamp)
+{
+    const limited_memory_resource& mr = *state.memory;
+    const size_t scope_node =
+        mr.charged_size(2 * sizeof(void*) + sizeof(scoped_options::value_type));
+    const size_t interface_node = mr.charged_size(
+        2 * sizeof(void*) + sizeof(interface_table::value_type));
+
+    size_t size = snapshot_size(state) + record_size(state, saved.options_flow);
+    for (const auto& [_, record] : saved.scoped)
+        size += scope_node + record_size(state, record);
+    for (const auto& [_, info] : saved.interfaces)
+        size += interface_node + string_size(state, info.name_copy) +
+                string_size(state, info.description_copy);
+    size += mr.charged_size((2 * saved.scoped.size() + 16) * sizeof(void*)) +
+            mr.charged_size((2 * saved.interfaces.size() + 16) * sizeof(void*));
+
+    const auto& options = state.exporters[exporter].options;
+    size_t replaced = options ? options_memory(state, *options) : 0;
+    if (int err = check_quota(state, exporter, size, replaced, KEEP_OPTIONS);
+        err != 0)
+        return err;
+    if (!make_room(
+            state, [&] { return size; },
+            [&] { delete_expired_options(timestamp, state); }))
+        return NF9_ERR_OUT_OF_MEMORY;
+
+    pmr::memory_resource* mem = state.memory.get();
+    pmr::polymorphic_allocator<option_snapshot> alloc(mem);
+    auto snapshot = std::allocate_shared<option_snapshot>(
+        alloc, option_snapshot{flow(saved.options_flow, mem),
+                               scoped_options(saved.scoped, mem),
+                               interface_table(mem), 0,
+                               ++state.options_version});
+
+    snapshot->memory = snapshot_size(state) - record_size(state, flow()) +
+                       record_size(state, snapshot->options_flow);
+    for (const auto& [_, record] : snapshot->scoped)
+        snapshot->memory += scope_node + record_size(state, record);
+    for (const auto& [index, text] : saved.interfaces) {
+        interface_info& info = add_interface(state, *snapshot, index);
+        assign_text(state, *snapshot, text.name_copy, info.name,
+                    info.name_copy);
+        assign_text(state, *snapshot, text.description_copy, info.description,
+                    info.description_copy);
+    }
+
+    state.exporters[exporter].options = std::move(snapshot);
+    state.exporters[exporter].options_timestamp = timestamp;
+    return 0;
+}
+
+int save_sampling_rate(nf9_state& state, uint32_t exporter, uint32_t sid,
                        uint32_t rate)
 {
-    try {
-        state.sampling_rates.insert_or_assign(sampler_id{did, sid}, rate);
-        state.simple_sampling_rates.insert_or_assign(
-            simple_sampler_id{did.addr, sid}, rate);
-        return 0;
-    } catch (const out_of_memory_error&) {
+    const limited_memory_resource& mr = *state.memory;
+    if (!fits(state, map_insert_size(mr, state.sampling_rates) +
+                         map_insert_size(mr, state.simple_sampling_rates)))
         return NF9_ERR_OUT_OF_MEMORY;
+
+    state.sampling_rates.insert_or_assign(sampler_id{exporter, sid}, rate);
+    state.simple_sampling_rates.insert_or_assign(
+        simple_sampler_id{state.exporters[exporter].dev_id.addr, sid}, rate);
+    return 0;
+}
+
+static bool pending_expired(const nf9_state& state, const pending_flowset& pf,
+                            uint32_t timestamp)
+{
+    return timestamp > pf.timestamp &&
+           timestamp - pf.timestamp > state.max_pending_age;
+}
+
+// Drop queued flowsets of an exporter from the front of the queue while
+// `drop' returns true for them.
+template <typename Predicate>
+static void drop_pending_flowsets(nf9_state& state, exporter& exp,
+                                  Predicate drop)
+{
+    auto it = exp.pending.begin();
+    while (it != exp.pending.end() && drop(*it)) {
+        exp.pending_bytes -= it->data.size();
+        state.stats.add(NF9_STAT_MISSING_TEMPLATE_ERRORS);
+        ++exp.counters.missing_templates;
+        ++it;
+    }
+    exp.pending.erase(exp.pending.begin(), it);
+}
+
+bool queue_pending_flowset(nf9_state& state, uint32_t exporter_index,
+                           uint16_t tid, uint32_t timestamp,
+                           const uint8_t* data, size_t len)
+{
+    if (len > state.max_pending_bytes)
+        return false;
+
+    exporter& exp = state.exporters[exporter_index];
+    drop_pending_flowsets(state, exp, [&](const pending_flowset& pf) {
+        return pending_expired(state, pf, timestamp) ||
+               exp.pending_bytes + len > state.max_pending_bytes;
+    });
+
+    // Queued flowsets count against the quota of the exporter, but nothing
+    // is deleted to make room for them.
+    size_t size = state.memory->charged_size(len) +
+                  vector_append_size(*state.memory, exp.pending);
+    if (state.max_exporter_memory > 0 &&
+        exporter_memory(state, exporter_index) + size >
+            state.max_exporter_memory) {
+        state.stats.add(NF9_STAT_QUOTA_HITS);
+        ++exp.counters.quota_hits;
+        return false;
+    }
+    if (!fits(state, size))
+        return false;
+
+    exp.pending.push_back(pending_flowset{
+        tid, timestamp,
+        pmr::vector<uint8_t>(data, data + len, state.memory.get())});
+    exp.pending_bytes += len;
+    state.stats.add(NF9_STAT_QUEUED_FLOWSETS);
+    return true;
+}
+
+pmr::vector<pending_flowset> take_pending_flowsets(nf9_state& state,
+                                                   uint32_t exporter_index,
+                                                   uint16_t tid,
+                                                   uint32_t timestamp)
+{
+    pmr::vector<pending_flowset> ret(state.heap);
+    exporter& exp = state.exporters[exporter_index];
+    if (exp.pending.empty())
+        return ret;
+
+    drop_pending_flowsets(state, exp, [&](const pending_flowset& pf) {
+        return pending_expired(state, pf, timestamp);
+    });
+
+    auto it = std::stable_partition(
+        exp.pending.begin(), exp.pending.end(),
+        [tid](const pending_flowset& pf) { return pf.tid != tid; });
+    for (auto taken = it; taken != exp.pending.end(); ++taken) {
+        exp.pending_bytes -= taken->data.size();
+        ret.push_back(std::move(*taken));
     }
+    exp.pending.erase(it, exp.pending.end());
+    return ret;
 }
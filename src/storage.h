@@ -16,12 +16,52 @@ struct out_of_memory_error : public std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
-int save_template(data_template& tmpl, stream_id& sid, nf9_state& state,
-                  nf9_packet& result);
+int register_exporter(nf9_state& state, const device_id& did,
+                      uint32_t timestamp, uint32_t& index);
 
-int save_option(nf9_state& state, device_id& dev_id, device_options& dev_opts);
+/* Forget an exporter along with everything stored for it. */
+void remove_exporter(nf9_state& state, uint32_t exporter);
 
-int save_sampling_rate(nf9_state& state, const device_id& did, uint32_t sid,
+int save_template(parsed_template& tmpl, stream_id& sid, nf9_state& state);
+
+int save_option(nf9_state& state, uint32_t exporter,
+                const device_options& dev_opts);
+
+/* Replace options of an exporter with a snapshot loaded from a saved state,
+ * whose most recent record was received at `timestamp'.  Text of interfaces
+ * is taken from `name_copy' and `description_copy' of `saved'. */
+int restore_options(nf9_state& state, uint32_t exporter,
+                    const option_snapshot& saved, uint32_t timestamp);
+
+/* ID of `text' in nf9_state::strings.  It's added if it's new and there's
+ * enough memory.  Returns 0 for an empty string or if it wasn't added. */
+uint32_t intern_string(nf9_state& state, std::string_view text);
+
+/* Halve the use counts of all templates and options, so that they keep
+ * their order when one of them saturates.  See NF9_EVICTION_LFU. */
+void age_hits(nf9_state& state);
+
+/* Delete the template if it's stored. */
+void delete_template(nf9_state& state, const stream_id& sid);
+
+/* Memory used by templates and options of an exporter, which is counted
+ * against NF9_OPT_MAX_EXPORTER_MEM_USAGE. */
+size_t exporter_memory(const nf9_state& state, uint32_t exporter);
+
+int save_sampling_rate(nf9_state& state, uint32_t exporter, uint32_t sid,
                        uint32_t rate);
 
+/* Queue a data flowset whose template is not known yet.  Returns false if
+ * the flowset was not queued. */
+bool queue_pending_flowset(nf9_state& state, uint32_t exporter, uint16_t tid,
+                           uint32_t timestamp, const uint8_t* data,
+                           size_t len);
+
+/* Remove queued data flowsets with given template ID and return them, oldest
+ * first.  Flowsets older than the age limit are dropped. */
+pmr::vector<pending_flowset> take_pending_flowsets(nf9_state& state,
+                                                   uint32_t exporter,
+                                                   uint16_t tid,
+                                                   uint32_t timestamp);
+
 #endif
@@ -0,0 +1,394 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#include "template_store.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstring>
+#include "storage.h"
+
+namespace {
+
+const uint32_t STORE_MAGIC = 0x4e463954;  // "NF9T"
+const uint32_t STORE_INITIALIZING = 1;
+const uint32_t STORE_VERSION = 2;
+
+// How many slots are checked for a key before giving up.
+const size_t MAX_PROBES = 16;
+
+// How many times to retry reading or locking a slot which is being
+// written.  A writer that crashed in the middle of an update leaves the
+// slot locked forever, so we can't wait indefinitely.
+const int MAX_SPINS = 1000;
+
+struct template_key
+{
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+    uint32_t source_id;
+    uint16_t template_id;
+    uint16_t reserved;
+};
+
+struct shared_field
+{
+    nf9_field type;
+    uint16_t length;
+    uint16_t reserved;
+};
+
+struct shared_template
+{
+    template_key key;
+    uint32_t timestamp;
+    uint16_t num_fields;
+    uint8_t is_option;
+    uint8_t reserved[5];
+    shared_field fields[shared_template_store::MAX_FIELDS];
+};
+
+static_assert(sizeof(shared_template) % sizeof(uint64_t) == 0,
+              "shared_template must consist of whole words");
+
+const size_t SLOT_WORDS = sizeof(shared_template) / sizeof(uint64_t);
+
+// Words of a slot which hold the key and the timestamp.
+const size_t HEADER_WORDS =
+    (offsetof(shared_template, timestamp) + sizeof(uint32_t) +
+     sizeof(uint64_t) - 1) /
+    sizeof(uint64_t);
+
+// The template is kept in atomic words, so that readers racing with a
+// writer don't cause undefined behaviour; the sequence number tells them
+// to retry.
+struct shared_template_slot
+{
+    // Hash of the key the slot is claimed for, or 0 if it's free.  A key
+    // is claimed with a compare-and-swap before its template is written,
+    // so that decoders adding the same key at once use the same slot.
+    std::atomic<uint64_t> owner;
+
+    // 0 if the slot was never written, odd while it's being written.
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> words[SLOT_WORDS];
+};
+
+template_key make_key(const device_id& dev_id, uint16_t tid)
+{
+    template_key key = {};
+    key.family = dev_id.addr.family;
+    if (dev_id.addr.family == AF_INET) {
+        key.port = dev_id.addr.in.sin_port;
+        memcpy(key.addr, &dev_id.addr.in.sin_addr,
+               sizeof(dev_id.addr.in.sin_addr));
+    }
+    else if (dev_id.addr.family == AF_INET6) {
+        key.port = dev_id.addr.in6.sin6_port;
+        memcpy(key.addr, &dev_id.addr.in6.sin6_addr,
+               sizeof(dev_id.addr.in6.sin6_addr));
+    }
+    key.source_id = dev_id.id;
+    key.template_id = tid;
+    return key;
+}
+
+bool same_key(const template_key& lhs, const template_key& rhs)
+{
+    return memcmp(&lhs, &rhs, sizeof(lhs)) == 0;
+}
+
+// Hash of a key, which is never 0.
+uint64_t hash_key(const template_key& key)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&key);
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash | 1;
+}
+
+enum class read_result
+{
+    empty,
+    busy,
+    ok,
+};
+
+// Copy the first `num_words' words of a slot to `out'.
+read_result read_slot(const shared_template_slot& slot, shared_template& out,
+                      size_t num_words = SLOT_WORDS)
+{
+    for (int i = 0; i < MAX_SPINS; ++i) {
+        uint64_t seq = slot.sequence.load(std::memory_order_acquire);
+        if (seq == 0)
+            return read_result::empty;
+        if (seq % 2 != 0) {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t words[SLOT_WORDS];
+        for (size_t w = 0; w < num_words; ++w)
+            words[w] = slot.words[w].load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == seq) {
+            memcpy(&out, words, num_words * sizeof(uint64_t));
+            return read_result::ok;
+        }
+    }
+    return read_result::busy;
+}
+
+// Write `tmpl' to a slot, unless the slot already holds exactly the same
+// template.  A template received by a decoder replaces the stored one even
+// if it's older: the clock of the exporter may have stepped back.
+void write_slot(shared_template_slot& slot, const shared_template& tmpl)
+{
+    uint64_t words[SLOT_WORDS];
+    memcpy(words, &tmpl, sizeof(words));
+
+    uint64_t seq = slot.sequence.load(std::memory_order_relaxed);
+    for (int i = 0;; ++i) {
+        if (i == MAX_SPINS)
+            return;
+        if (seq % 2 == 0 &&
+            slot.sequence.compare_exchange_weak(seq, seq + 1,
+                                                std::memory_order_acquire,
+                                                std::memory_order_relaxed))
+            break;
+        sched_yield();
+        seq = slot.sequence.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Refreshes of a template don't disturb readers.
+    if (seq != 0) {
+        size_t w = 0;
+        while (w < SLOT_WORDS &&
+               slot.words[w].load(std::memory_order_relaxed) == words[w])
+            ++w;
+        if (w == SLOT_WORDS) {
+            slot.sequence.store(seq, std::memory_order_release);
+            return;
+        }
+    }
+
+    for (size_t w = 0; w < SLOT_WORDS; ++w)
+        slot.words[w].store(words[w], std::memory_order_relaxed);
+
+    slot.sequence.store(seq + 2, std::memory_order_release);
+}
+
+}  // namespace
+
+struct shared_template_segment
+{
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint64_t num_slots;
+
+    shared_template_slot* slots()
+    {
+        return reinterpret_cast<shared_template_slot*>(this + 1);
+    }
+};
+
+static size_t segment_size(size_t num_slots)
+{
+    return sizeof(shared_template_segment) +
+           num_slots * sizeof(shared_template_slot);
+}
+
+int shared_template_store::open(const char* name, size_t num_slots,
+                                std::unique_ptr<shared_template_store>& result)
+{
+    if (num_slots == 0)
+        return NF9_ERR_INVALID_ARGUMENT;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NF9_ERR_SYSTEM;
+
+    size_t size = segment_size(num_slots);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NF9_ERR_SYSTEM;
+    }
+    // Processes racing to create the segment set the same size.
+    if (st.st_size == 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        return NF9_ERR_SYSTEM;
+    }
+    if (st.st_size != 0 && size_t(st.st_size) != size) {
+        close(fd);
+        return NF9_ERR_INVALID_ARGUMENT;
+    }
+
+    void* addr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NF9_ERR_SYSTEM;
+
+    auto* segment = static_cast<shared_template_segment*>(addr);
+    uint32_t magic = 0;
+    if (segment->magic.compare_exchange_strong(magic, STORE_INITIALIZING)) {
+        segment->version = STORE_VERSION;
+        segment->num_slots = num_slots;
+        segment->magic.store(STORE_MAGIC, std::memory_order_release);
+    }
+    else {
+        for (int i = 0; i < MAX_SPINS && magic == STORE_INITIALIZING; ++i) {
+            sched_yield();
+            magic = segment->magic.load(std::memory_order_acquire);
+        }
+    }
+
+    if (segment->magic.load(std::memory_order_acquire) != STORE_MAGIC ||
+        segment->version != STORE_VERSION || segment->num_slots != num_slots) {
+        munmap(addr, size);
+        return NF9_ERR_INVALID_ARGUMENT;
+    }
+
+    result.reset(new shared_template_store(segment, size));
+    return 0;
+}
+
+shared_template_store::~shared_template_store()
+{
+    munmap(segment_, size_);
+}
+
+void shared_template_store::put(const device_id& dev_id, uint16_t tid,
+                                const parsed_template& tmpl)
+{
+    if (tmpl.fields.size() > MAX_FIELDS)
+        return;
+
+    template_key key = make_key(dev_id, tid);
+    uint64_t hash = hash_key(key);
+    size_t num_slots = segment_->num_slots;
+    size_t start = hash % num_slots;
+
+    // Use the slot claimed for this key or claim the first free one.  If
+    // all probed slots are taken, claim the one with the oldest template.
+    shared_template_slot* target = nullptr;
+    shared_template_slot* oldest = nullptr;
+    uint64_t oldest_owner = 0;
+    uint32_t oldest_timestamp = UINT32_MAX;
+    for (size_t i = 0; i < MAX_PROBES && i < num_slots; ++i) {
+        shared_template_slot& slot = segment_->slots()[(start + i) % num_slots];
+        uint64_t owner = 0;
+        if (slot.owner.compare_exchange_strong(owner, hash,
+                                               std::memory_order_acq_rel) ||
+            owner == hash) {
+            target = &slot;
+            break;
+        }
+
+        shared_template stored;
+        if (read_slot(slot, stored, HEADER_WORDS) == read_result::ok &&
+            stored.timestamp < oldest_timestamp) {
+            oldest = &slot;
+            oldest_owner = owner;
+            oldest_timestamp = stored.timestamp;
+        }
+    }
+    // If another decoder took the oldest slot meanwhile, the template is
+    // not stored.
+    if (target == nullptr && oldest != nullptr &&
+        oldest->owner.compare_exchange_strong(oldest_owner, hash,
+                                              std::memory_order_acq_rel))
+        target = oldest;
+    if (target == nullptr)
+        return;
+
+    shared_template shared = {};
+    shared.key = key;
+    shared.timestamp = tmpl.timestamp;
+    shared.num_fields = static_cast<uint16_t>(tmpl.fields.size());
+    shared.is_option = tmpl.is_option;
+    for (size_t i = 0; i < tmpl.fields.size(); ++i) {
+        shared.fields[i].type =
+            field_type(tmpl.fields[i], i < tmpl.num_scope_fields);
+        shared.fields[i].length = tmpl.fields[i].length;
+    }
+    write_slot(*target, shared);
+}
+
+// Slot claimed for a key, or nullptr.
+static const shared_template_slot* find_slot(
+    shared_template_segment* segment, const template_key& key)
+{
+    uint64_t hash = hash_key(key);
+    size_t num_slots = segment->num_slots;
+    size_t start = hash % num_slots;
+
+    for (size_t i = 0; i < MAX_PROBES && i < num_slots; ++i) {
+        const shared_template_slot& slot =
+            segment->slots()[(start + i) % num_slots];
+        uint64_t owner = slot.owner.load(std::memory_order_acquire);
+        if (owner == 0)
+            return nullptr;
+        if (owner == hash)
+            return &slot;
+    }
+    return nullptr;
+}
+
+bool shared_template_store::newer(const device_id& dev_id, uint16_t tid,
+                                  uint32_t timestamp) const
+{
+    template_key key = make_key(dev_id, tid);
+    const shared_template_slot* slot = find_slot(segment_, key);
+    shared_template stored;
+    return slot != nullptr &&
+           read_slot(*slot, stored, HEADER_WORDS) == read_result::ok &&
+           same_key(stored.key, key) && stored.timestamp > timestamp;
+}
+
+bool shared_template_store::get(const device_id& dev_id, uint16_t tid,
+                                parsed_template& tmpl) const
+{
+    template_key key = make_key(dev_id, tid);
+    const shared_template_slot* slot = find_slot(segment_, key);
+    shared_template stored;
+    if (slot == nullptr || read_slot(*slot, stored) != read_result::ok ||
+        !same_key(stored.key, key))
+        return false;
+
+    tmpl.fields.clear();
+    tmpl.num_scope_fields = 0;
+    tmpl.total_length = 0;
+    for (uint16_t f = 0; f < stored.num_fields && f < MAX_FIELDS; ++f) {
+        if (!tmpl.add_field(stored.fields[f].type, stored.fields[f].length))
+            return false;
+    }
+    tmpl.timestamp = stored.timestamp;
+    tmpl.is_option = stored.is_option;
+    return true;
+}
+
+int nf9_attach_template_store(nf9_state* state, const char* name,
+                              size_t num_slots)
+{
+    std::unique_ptr<shared_template_store> store;
+    if (int err = shared_template_store::open(name, num_slots, store);
+        err != 0)
+        return err;
+
+    state->template_store = std::move(store);
+    return 0;
+}
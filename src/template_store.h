@@ -0,0 +1,71 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#ifndef TEMPLATE_STORE_H
+#define TEMPLATE_STORE_H
+
+#include <netflow9.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+struct parsed_template;
+struct device_id;
+struct shared_template_segment;
+
+/*
+ * Template store in a POSIX shared memory segment, which can be attached
+ * to decoders in different processes.
+ *
+ * The segment is a fixed-size open-addressing hash table keyed by exporter
+ * address, source ID and template ID.  A slot is claimed for a key with a
+ * compare-and-swap of the hash of the key, so that every key has at most
+ * one slot.  Every slot is protected by its own sequence lock: writers take
+ * it with a compare-and-swap, and readers copy the slot without locking and
+ * retry if it changed meanwhile.
+ */
+class shared_template_store
+{
+public:
+    /* Maximum number of fields in a shared template.  Larger templates are
+     * not shared. */
+    static constexpr size_t MAX_FIELDS = 64;
+
+    shared_template_store(const shared_template_store&) = delete;
+    shared_template_store& operator=(const shared_template_store&) = delete;
+    ~shared_template_store();
+
+    /* Create or open the segment.  Returns 0 or a value from enum
+     * nf9_error. */
+    static int open(const char* name, size_t num_slots,
+                    std::unique_ptr<shared_template_store>& result);
+
+    /* Store a template received by this decoder, replacing the one with the
+     * same key, even if that one has a later timestamp. */
+    void put(const device_id& dev_id, uint16_t tid,
+             const parsed_template& tmpl);
+
+    /* Copy a template to `tmpl'.  Returns false if it's not in the store. */
+    bool get(const device_id& dev_id, uint16_t tid,
+             parsed_template& tmpl) const;
+
+    /* Whether the store has the template with a timestamp later than
+     * `timestamp', i.e. another decoder received a newer definition.  This
+     * reads only the key and the timestamp of the template. */
+    bool newer(const device_id& dev_id, uint16_t tid,
+               uint32_t timestamp) const;
+
+private:
+    shared_template_store(shared_template_segment* segment, size_t size)
+        : segment_(segment), size_(size)
+    {
+    }
+
+    shared_template_segment* segment_;
+    size_t size_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright © 2019-2020 Exatel S.A.
+ * Contact: opensource@exatel.pl
+ * LICENSE: LGPL-3.0-or-later, See COPYING*.md files.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <netflow9.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "config.h"
+
+/* Log-linear histogram of durations in nanoseconds.  Values below
+ * HISTOGRAM_SUB_BUCKETS have their own buckets; above that, every power of
+ * two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so the relative
+ * error of a bucket is at most 1/HISTOGRAM_SUB_BUCKETS. */
+class latency_histogram
+{
+public:
+    void record(uint64_t value) noexcept
+    {
+        counts_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static constexpr size_t bucket_index(uint64_t value) noexcept
+    {
+        if (value < SUB_BUCKETS)
+            return value;
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BUCKET_BITS;
+        return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+               ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that falls into given bucket.
+    static constexpr uint64_t bucket_lower_bound(size_t index) noexcept
+    {
+        if (index < SUB_BUCKETS)
+            return index;
+        size_t shift = index / SUB_BUCKETS - 1;
+        return (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    }
+
+    uint64_t count(size_t index) const noexcept
+    {
+        return counts_[index].load(std::memory_order_relaxed);
+    }
+
+    // Sum of all recorded values.
+    uint64_t sum() const noexcept
+    {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const int SUB_BUCKET_BITS = 3;
+    static const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+    std::atomic<uint64_t> counts_[NF9_HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> sum_ = {};
+};
+
+static_assert(latency_histogram::bucket_index(UINT64_MAX) <
+                  NF9_HISTOGRAM_BUCKETS,
+              "NF9_HISTOGRAM_BUCKETS is too small");
+
+#ifdef NF9_ENABLE_TIMING
+
+/* Measures the time from construction to destruction and records it in a
+ * histogram.  At most one timer can be started with NF9_TIME_STAGE() in a
+ * scope. */
+class stage_timer
+{
+public:
+    explicit stage_timer(latency_histogram& hist) noexcept
+        : hist_(hist), start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~stage_timer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        hist_.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                .count());
+    }
+
+    stage_timer(const stage_timer&) = delete;
+    stage_timer& operator=(const stage_timer&) = delete;
+
+private:
+    latency_histogram& hist_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define NF9_TIME_STAGE(state, stage) \
+    stage_timer nf9_stage_timer_((state).timings[(stage)])
+
+#else
+
+#define NF9_TIME_STAGE(state, stage) \
+    do {                             \
+    } while (0)
+
+#endif
+
+#endif
@@ -9,13 +9,22 @@
 
 #include <netflow9.h>
 #include <netinet/in.h>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <optional>
 
 #include "config.h"
+#include "shm_stats.h"
+#include "template_store.h"
+#include "timing.h"
 
 #ifdef NF9_HAVE_MEMORY_RESOURCE
 #include <memory_resource>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -23,6 +32,7 @@ namespace pmr = std::pmr;
 
 #elif defined(NF9_HAVE_EXPERIMENTAL_MEMORY_RESOURCE)
 #include <experimental/memory_resource>
+#include <experimental/string>
 #include <experimental/unordered_map>
 #include <experimental/vector>
 
@@ -34,38 +44,268 @@ namespace pmr = std::experimental::pmr;
 
 struct nf9_stats
 {
-    unsigned processed_packets = 0;
-    unsigned malformed_packets = 0;
-    unsigned records = 0;
-    unsigned data_templates = 0;
-    unsigned option_templates = 0;
-    unsigned missing_template_errors = 0;
-    unsigned expired_templates = 0;
+    uint64_t values[NF9_NUM_STATS] = {};
+};
+
+/* Decoder statistics, split into cache-line-sized shards.  Each thread
+ * increments counters in its own shard, so that decoding threads don't
+ * contend on the same cache line; readers sum all shards. */
+class stat_counters
+{
+public:
+    void add(nf9_stat stat, uint64_t n = 1) noexcept
+    {
+        shards_[shard_index()].values[stat].fetch_add(
+            n, std::memory_order_relaxed);
+    }
+
+    /* Store sums of all counters in values, indexed by enum nf9_stat. */
+    void read(uint64_t *values) const noexcept
+    {
+        for (size_t stat = 0; stat < NF9_NUM_STATS; ++stat)
+            values[stat] = 0;
+        for (const shard &sh : shards_)
+            for (size_t stat = 0; stat < NF9_NUM_STATS; ++stat)
+                values[stat] += sh.values[stat].load(std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t NUM_SHARDS = 16;
+
+    struct alignas(64) shard
+    {
+        std::atomic<uint64_t> values[NF9_NUM_STATS] = {};
+    };
+
+    static size_t shard_index() noexcept
+    {
+        static std::atomic<size_t> next_index{0};
+        thread_local size_t index =
+            next_index.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS;
+        return index;
+    }
+
+    shard shards_[NUM_SHARDS];
+};
 
-    size_t memory_usage = 0;
+/* A field of a template: its type and length, as sent by the exporter.
+ * Whether it's a scope field is kept separately. */
+struct template_field
+{
+    uint16_t type;
+    uint16_t length;
 };
 
-using template_field = std::pair<nf9_field, uint16_t>;
 using flow = pmr::unordered_map<nf9_field, pmr::vector<uint8_t>>;
 
-struct data_template
+/* Type of a field in decoded flows: the type from the template, with the
+ * scope bit for scope fields of option templates. */
+inline nf9_field field_type(const template_field &tf, bool scope)
+{
+    return scope ? NF9_SCOPE_FIELD(uint32_t(tf.type)) : NF9_DATA_FIELD(tf.type);
+}
+
+/*
+ * Template as decoded from a template flowset, before it's stored.  Scope
+ * fields of option templates come first, and their number is kept in
+ * `num_scope_fields'.
+ */
+struct parsed_template
 {
+    explicit parsed_template(pmr::memory_resource *mr) : fields(mr)
+    {
+    }
+
+    /* Append a field.  Returns false if the field can't be stored: its type
+     * without the scope bit doesn't fit in 16 bits, or it's a scope field
+     * which follows data fields. */
+    bool add_field(nf9_field field, uint16_t length);
+
     pmr::vector<template_field> fields;
-    size_t total_length;
+    uint16_t num_scope_fields = 0;
+    uint32_t total_length = 0;
+    uint32_t timestamp = 0;
+    bool is_option = false;
+};
+
+/*
+ * Template stored in a template_table.  It takes a single allocation: this
+ * header, followed by its fields.  Scope fields of option templates come
+ * first and are counted in the header, instead of being flagged one by one.
+ */
+class data_template
+{
+public:
+    /* Allocate a copy of `parsed' from `mr'. */
+    static data_template *create(const parsed_template &parsed,
+                                 pmr::memory_resource *mr);
+
+    static void destroy(data_template *tmpl, pmr::memory_resource *mr);
+
+    /* Size of the allocation for a template with given number of fields. */
+    static size_t allocation_size(size_t num_fields)
+    {
+        return sizeof(data_template) + num_fields * sizeof(template_field);
+    }
+
+    size_t num_fields() const
+    {
+        return num_fields_;
+    }
+
+    const template_field *fields() const
+    {
+        return reinterpret_cast<const template_field *>(this + 1);
+    }
+
+    /* Type of the i-th field, as in decoded flows. */
+    nf9_field field_type(size_t i) const
+    {
+        return ::field_type(fields()[i], i < num_scope_fields_);
+    }
+
+    bool is_option() const
+    {
+        return is_option_;
+    }
+
+    /* Find the offset and length of a field within records described by this
+     * template.  If the field is repeated, the last occurrence is used, like
+     * in decoded flows.  Returns false if there is no such field. */
+    bool find_field(nf9_field field, size_t &offset, size_t &length) const;
+
     uint32_t timestamp;
-    bool is_option;
+
+    /* Timestamp of the last packet decoded with this template, and the
+     * number of flowsets decoded with it.  Use counts of all templates and
+     * options are halved when one reaches UINT16_MAX.  See
+     * NF9_OPT_EVICTION_POLICY. */
+    uint32_t last_used;
+    uint16_t hits;
+
+    /* Records must fit in a flowset, so their length fits in 16 bits. */
+    uint16_t total_length;
+
+private:
+    data_template() = default;
+
+    uint16_t num_fields_;
+    uint16_t num_scope_fields_ : 15;
+    uint16_t is_option_ : 1;
+};
+
+static_assert(sizeof(data_template) == 16, "data_template header is packed");
+static_assert(alignof(data_template) >= alignof(template_field) &&
+                  sizeof(data_template) % alignof(template_field) == 0,
+              "fields must be aligned after the header");
+
+/*
+ * Templates of a single exporter, sorted by template ID.  Exporters use only a
+ * few dozen template IDs, so a binary search over a compact array of IDs
+ * touches one or two cache lines and needs no hashing.
+ */
+struct template_table
+{
+    explicit template_table(pmr::memory_resource *mr) : ids(mr), templates(mr)
+    {
+    }
+
+    template_table(template_table &&other) = default;
+    ~template_table()
+    {
+        clear();
+    }
+
+    /* Find the template with given ID, or return nullptr. */
+    data_template *find(uint16_t tid)
+    {
+        // Branchless binary search: the loop does not depend on the
+        // outcome of comparisons, so it does not suffer from mispredictions.
+        size_t n = ids.size();
+        if (n == 0)
+            return nullptr;
+
+        const uint16_t *base = ids.data();
+        while (n > 1) {
+            size_t half = n / 2;
+            base = base[half] <= tid ? base + half : base;
+            n -= half;
+        }
+        if (*base != tid)
+            return nullptr;
+        return templates[base - ids.data()];
+    }
+
+    /* Insert or replace the template with given ID by a copy of `parsed'.
+     * Returns the stored template. */
+    data_template *assign(uint16_t tid, const parsed_template &parsed);
+
+    /* Remove the template with given ID.  Returns false if there was none. */
+    bool erase(uint16_t tid);
+
+    /* Remove all templates. */
+    void clear();
+
+    size_t size() const
+    {
+        return ids.size();
+    }
+
+    /* Template IDs in ascending order. */
+    pmr::vector<uint16_t> ids;
+
+    /* templates[i] is the template with ID ids[i].  Templates are allocated
+     * from the same resource as the arrays. */
+    pmr::vector<data_template *> templates;
 };
 
 static const size_t MAX_MEMORY_USAGE = 10000;
 static const uint32_t TEMPLATE_EXPIRE_TIME = 5 * 60;
 static const uint32_t OPTION_EXPIRE_TIME = 15 * 60;
+static const uint32_t MAX_PENDING_AGE = 30;
+
+/* Memory resource which calls user-supplied allocation callbacks.  See
+ * nf9_init_ex(). */
+class callback_memory_resource : public pmr::memory_resource
+{
+public:
+    explicit callback_memory_resource(const nf9_allocator &allocator)
+        : allocator_(allocator)
+    {
+    }
+
+    virtual void *do_allocate(std::size_t bytes,
+                              std::size_t alignment) override;
+
+    virtual void do_deallocate(void *p, std::size_t bytes,
+                               std::size_t alignment) override;
+
+    virtual bool do_is_equal(const pmr::memory_resource &other) const
+        noexcept override;
+
+private:
+    nf9_allocator allocator_;
+};
+
+class pool_memory_resource;
 
 class limited_memory_resource : public pmr::memory_resource
 {
 public:
-    limited_memory_resource(size_t max_size) : max_size_(max_size), used_(0){};
+    /* Memory is allocated from `upstream', or from `pool' if it's not
+     * null. */
+    limited_memory_resource(
+        size_t max_size, bool accurate = false,
+        pmr::memory_resource *upstream = pmr::new_delete_resource(),
+        std::unique_ptr<pool_memory_resource> pool = {});
+
+    /* Memory is allocated from `pool', which is shared with other
+     * resources and must outlive this one. */
+    limited_memory_resource(size_t max_size, bool accurate,
+                            pool_memory_resource *pool);
     limited_memory_resource(const limited_memory_resource &other) = delete;
     limited_memory_resource(limited_memory_resource &&other) = delete;
+    ~limited_memory_resource();
 
     virtual void *do_allocate(std::size_t bytes,
                               std::size_t alignment) override;
@@ -78,22 +318,178 @@ public:
 
     size_t get_current() const;
 
+    size_t get_limit() const;
+
     void set_limit(size_t max_mem);
 
+    /* True if `size' more bytes can be charged without reaching the limit,
+     * and a fixed region can still provide them in one block. */
+    bool fits(size_t size) const;
+
+    /* Number of bytes charged for an allocation. */
+    size_t charged_size(size_t bytes,
+                        size_t alignment = alignof(std::max_align_t)) const;
+
 private:
+
     /* Max memory allocation in bytes */
     size_t max_size_;
 
-    /* Counter of allocated bytes*/
-    size_t used_;
+    /* If true, allocations are charged with the overhead of the heap, not
+     * just the requested size.  See NF9_ACCURATE_MEMORY_USAGE. */
+    bool accurate_;
+
+    std::unique_ptr<pool_memory_resource> owned_pool_;
+    pool_memory_resource *pool_;
+    pmr::memory_resource *upstream_;
+
+    /* Counter of allocated bytes.  Option snapshots pinned by packets can be
+     * released from other threads, hence the atomic. */
+    std::atomic<size_t> used_;
+};
+
+/*
+ * Distinct strings seen by a decoder, each with a small integer ID.  IDs
+ * start at 1 and stay valid as long as the decoder: strings are never
+ * removed.
+ *
+ * Only the decoder adds strings, but they can be looked up by ID from any
+ * thread.  Entries are stored in blocks which never move, each twice as
+ * large as the previous one, and each new entry is published by a release
+ * store of the number of entries.
+ *
+ * The dictionary never shrinks, so callers keep it within its own limit,
+ * NF9_OPT_MAX_STRING_MEM_USAGE.  See intern_string().
+ */
+class string_dictionary
+{
+public:
+    static constexpr size_t FIRST_BLOCK_SIZE = 16;
+    static constexpr size_t MAX_BLOCKS = 24;
+
+    explicit string_dictionary(limited_memory_resource *mr)
+        : mr_(mr), ids_(mr)
+    {
+    }
+
+    string_dictionary(const string_dictionary &) = delete;
+    string_dictionary &operator=(const string_dictionary &) = delete;
+    ~string_dictionary();
+
+    /* ID of `text', or 0 if it's not in the dictionary. */
+    uint32_t find(std::string_view text) const;
+
+    /* Null-terminated string with given ID, or nullptr. */
+    const char *find(uint32_t id) const;
+
+    /* Upper bound of memory needed to add a string of given length. */
+    size_t insert_size(size_t length) const;
+
+    /* Memory charged for the strings and the index. */
+    size_t memory() const;
+
+    /* Return the ID of `text', adding it if it's new, or 0 if the
+     * dictionary is full. */
+    uint32_t intern(std::string_view text);
+
+    size_t size() const
+    {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+private:
+    limited_memory_resource *mr_;
+    size_t memory_ = 0;
+    const char **blocks_[MAX_BLOCKS] = {};
+    std::atomic<uint32_t> size_{0};
+    pmr::unordered_map<std::string_view, uint32_t> ids_;
 };
 
+/* An option record to be stored, and the timestamp of its packet.  The
+ * record is referenced rather than copied: it's copied only into the
+ * decoder's memory, and only the values which changed. */
 struct device_options
 {
-    flow options_flow;
+    const flow &options_flow;
     uint32_t timestamp;
 };
 
+/*
+ * Identifies an option record by the value of one of its scope fields, or
+ * of NF9_FIELD_FLOW_SAMPLER_ID.
+ */
+struct scope_key
+{
+    nf9_field field;
+    uint64_t value;
+};
+
+template <>
+struct std::hash<scope_key>
+{
+    size_t operator()(const scope_key &) const noexcept;
+};
+
+bool operator==(const scope_key &, const scope_key &) noexcept;
+
+using scoped_options = pmr::unordered_map<scope_key, flow>;
+
+/* Name and description of an interface, from option records with
+ * interface scope.  They are IDs in nf9_state::strings, or 0 if the text
+ * is not known or didn't fit in the dictionary.  Text which didn't fit is
+ * copied to `name_copy' and `description_copy' instead, which live as long
+ * as the snapshot, so names returned to packets are only guaranteed to be
+ * valid while the packet pins it. */
+struct interface_info
+{
+    using allocator_type = pmr::polymorphic_allocator<char>;
+
+    explicit interface_info(const allocator_type &alloc = {})
+        : name_copy(alloc), description_copy(alloc)
+    {
+    }
+
+    interface_info(const interface_info &other, const allocator_type &alloc)
+        : name(other.name), description(other.description),
+          name_copy(other.name_copy, alloc),
+          description_copy(other.description_copy, alloc)
+    {
+    }
+
+    uint32_t name = 0;
+    uint32_t description = 0;
+    pmr::string name_copy;
+    pmr::string description_copy;
+};
+
+/* Interfaces of an exporter by their SNMP index. */
+using interface_table = pmr::unordered_map<uint32_t, interface_info>;
+
+/*
+ * Set of option values received from an exporter.  Every option record that
+ * changes them publishes a new version, and each decoded packet pins the
+ * snapshot that was current at the time, so reading options needs no
+ * locking and the values stay consistent with the packet.  A snapshot is
+ * updated in place only while no packet pins it, and copied otherwise.
+ */
+struct option_snapshot
+{
+    /* The most recent option record. */
+    flow options_flow;
+
+    /* The most recent option record for each scope. */
+    scoped_options scoped;
+
+    interface_table interfaces;
+
+    /* Memory charged for the snapshot, except the bucket arrays of
+     * `scoped' and `interfaces'. */
+    size_t memory;
+
+    /* Increases with every snapshot published by a decoder. */
+    uint64_t version;
+};
+
 /*
  * Collector devices should use the combination of the source IP address plus
  * the Source ID field to associate an incoming NetFlow export packet with a
@@ -105,14 +501,86 @@ struct device_id
     uint32_t id;
 };
 
+/*
+ * Marks the end of the free exporter list in nf9_state.
+ */
+static const uint32_t NO_EXPORTER = UINT32_MAX;
+
+/* Counters of packets received from a single exporter.  See
+ * struct nf9_exporter_stats. */
+struct exporter_counters
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t templates;
+    uint64_t missing_templates;
+    uint64_t malformed_packets;
+    uint64_t quota_hits;
+};
+
+/* A data flowset received before its template. */
+struct pending_flowset
+{
+    uint16_t tid;
+
+    /* Timestamp of the packet that carried the flowset. */
+    uint32_t timestamp;
+    pmr::vector<uint8_t> data;
+};
+
+/*
+ * An entry in the exporter registry.  Each distinct device_id seen by the
+ * decoder is assigned a dense index into nf9_state::exporters, so that
+ * per-exporter data can be keyed by a single integer instead of the full
+ * address and source ID.
+ */
+struct exporter
+{
+    device_id dev_id;
+
+    /* Timestamp of the last packet received from this exporter. */
+    uint32_t timestamp;
+
+    /* Next free index if this entry is unused, NO_EXPORTER otherwise. */
+    uint32_t next_free;
+
+    template_table templates;
+
+    /* Memory charged for templates of this exporter, counted against
+     * nf9_state::max_exporter_memory. */
+    size_t template_memory;
+
+    /* Current option values of this exporter, or null. */
+    std::shared_ptr<option_snapshot> options;
+
+    /* Timestamp of the most recent option record.  It's not part of the
+     * snapshot, because it changes when an unchanged record is received
+     * again, while packets may be reading the snapshot. */
+    uint32_t options_timestamp;
+
+    /* Timestamp of the last packet that pinned the options, and the number
+     * of such packets, aged like data_template::hits. */
+    uint32_t options_last_used;
+    uint16_t options_hits;
+
+    exporter_counters counters;
+
+    /* Data flowsets waiting for their templates, oldest first, and their
+     * total size. */
+    pmr::vector<pending_flowset> pending;
+    size_t pending_bytes;
+};
+
 /*
  * Objects of this type uniquely identify flow streams across all
- * exporter devices by using a combination of the exporter source IP
- * address, the source_id field in the NetFlow header, and template id.
+ * exporter devices by using a combination of the exporter index and
+ * template id.  The template itself is stored in the exporter's
+ * template_table.
  */
 struct stream_id
 {
-    device_id dev_id;
+    uint32_t exporter;
     uint16_t tid;
 };
 
@@ -121,7 +589,7 @@ struct stream_id
  */
 struct sampler_id
 {
-    device_id did;
+    uint32_t exporter;
     uint32_t sid;
 };
 
@@ -134,12 +602,6 @@ struct simple_sampler_id
     uint32_t id;
 };
 
-template <>
-struct std::hash<stream_id>
-{
-    size_t operator()(const stream_id &) const noexcept;
-};
-
 template <>
 struct std::hash<device_id>
 {
@@ -158,47 +620,139 @@ struct std::hash<simple_sampler_id>
     size_t operator()(const simple_sampler_id &) const noexcept;
 };
 
-bool operator==(const stream_id &, const stream_id &) noexcept;
 bool operator==(const device_id &, const device_id &) noexcept;
 bool operator==(const sampler_id &, const sampler_id &) noexcept;
 bool operator==(const simple_sampler_id &, const simple_sampler_id &) noexcept;
 
 struct nf9_state
 {
+    /* Resource for all memory of the decoder and its packets: user
+     * callbacks passed to nf9_init_ex(), or null to use the global heap.
+     * Declared first, so that it outlives everything allocated from it. */
+    std::unique_ptr<callback_memory_resource> allocator;
+
+    /* Fixed region for packets of a decoder created with
+     * nf9_init_fixed(), otherwise null. */
+    std::unique_ptr<pool_memory_resource> packet_pool;
+
+    /* Resource for packets and temporary objects: `packet_pool',
+     * `allocator' or new_delete_resource(). */
+    pmr::memory_resource *heap;
+
     int flags;
-    nf9_stats stats;
+    stat_counters stats;
     uint32_t template_expire_time;
     uint32_t option_expire_time;
+
+    /* Limits of queues of data flowsets waiting for templates, per
+     * exporter.  Flowsets are not queued if max_pending_bytes is 0. */
+    size_t max_pending_bytes;
+    uint32_t max_pending_age;
+
+    /* Memory limit for records of a single decoded packet, or 0. */
+    size_t max_packet_memory;
+
+    /* Memory limit for templates and options of a single exporter, or 0. */
+    size_t max_exporter_memory;
+
+    /* Memory limit for nf9_state::strings, or 0 for a quarter of the memory
+     * limit of the decoder. */
+    size_t max_string_memory;
+    nf9_eviction_policy eviction_policy;
     std::unique_ptr<limited_memory_resource> memory;
 
-    pmr::unordered_map<stream_id, data_template> templates;
-    pmr::unordered_map<device_id, device_options> options;
+    /* Registry of exporter devices: maps (address, source ID) to a dense
+     * index into `exporters'.  Unused entries form a free list starting at
+     * `free_exporter'. */
+    pmr::unordered_map<device_id, uint32_t> exporter_ids;
+    pmr::vector<exporter> exporters;
+    uint32_t free_exporter;
 
-    /* Mutex for options unordered_map */
-    std::mutex options_mutex;
+    /* Version of the most recently published option snapshot. */
+    uint64_t options_version;
 
     bool store_sampling_rates;
+    bool upscale_counters;
+    bool intern_strings;
     pmr::unordered_map<sampler_id, uint32_t> sampling_rates;
     pmr::unordered_map<simple_sampler_id, uint32_t> simple_sampling_rates;
+
+    /* Shared memory segment where statistics are published, or null. */
+    std::unique_ptr<shm_stats_writer> shm_stats;
+
+    /* Templates shared with decoders in other processes, or null. */
+    std::unique_ptr<shared_template_store> template_store;
+
+    /* Names of interfaces and, with NF9_INTERN_STRINGS, values of text
+     * fields of records. */
+    string_dictionary strings;
+
+#ifdef NF9_ENABLE_TIMING
+    /* Durations of decoding stages, indexed by enum nf9_stage. */
+    latency_histogram timings[NF9_NUM_STAGES];
+#endif
+};
+
+/*
+ * Sampling rate of a data record, resolved when the record is decoded.
+ */
+struct record_sampling
+{
+    uint32_t rate;
+
+    /* One of the values of enum nf9_sampling_info. */
+    int info;
 };
 
 struct flowset
 {
-    nf9_flowset_type type;
+    explicit flowset(pmr::memory_resource *mr)
+        : flows(mr), samplings(mr), upscaled(mr), string_ids(mr)
+    {
+    }
 
-    /* Empty if this is not a data template flowset. */
-    data_template dtemplate;
+    nf9_flowset_type type;
 
     /* This contains flows in data records.  Empty if this is not a data record
      * flowset. */
-    std::vector<flow> flows;
+    pmr::vector<flow> flows;
+
+    /* Sampling rates of records in `flows', in the same order.  Empty unless
+     * NF9_STORE_SAMPLING_RATES is set. */
+    pmr::vector<record_sampling> samplings;
+
+    /* Byte and packet counters of records in `flows' multiplied by their
+     * sampling rates, one column of flows.size() values per counter from
+     * enum nf9_counter.  Empty unless NF9_UPSCALE_COUNTERS is set. */
+    pmr::vector<uint64_t> upscaled;
+
+    /* IDs of values of text fields of records in `flows' in
+     * nf9_state::strings, one column of flows.size() IDs per field from
+     * TEXT_FIELDS, or 0 if a record has no such field.  Empty unless
+     * NF9_INTERN_STRINGS is set. */
+    pmr::vector<uint32_t> string_ids;
 };
 
 struct nf9_packet
 {
-    std::vector<flowset> flowsets;
+    /* Allocated from the heap of `st'. */
+    nf9_packet(nf9_state *st, const nf9_addr &address);
+
+    /* Limits memory for decoded records if nf9_state::max_packet_memory is
+     * set.  Declared first, so that it outlives the records. */
+    std::optional<limited_memory_resource> memory;
+
+    /* Resource for decoded records: `memory' or the heap of the decoder. */
+    pmr::memory_resource *mr;
+
+    pmr::vector<flowset> flowsets;
     nf9_addr addr;
     uint32_t src_id;
+
+    /* Index of the exporter, or NO_EXPORTER if the header couldn't be
+     * decoded. */
+    uint32_t exporter = NO_EXPORTER;
+    std::shared_ptr<const option_snapshot> options;
     uint32_t system_uptime;
     uint32_t timestamp;
     nf9_state *state;
@@ -25,6 +25,9 @@
 // options, printing actual and reported (by nf9_get_stat) memory usage to
 // stdout.
 //
+// Pass any argument to count only requested bytes, without the overhead of
+// heap allocations (see NF9_ACCURATE_MEMORY_USAGE).
+//
 // *******************************************************************************
 
 namespace
@@ -98,7 +101,7 @@ const nf9_addr* generate_address()
 
 int main(int argc, char** argv)
 {
-    nf9_state* st = nf9_init(0);
+    nf9_state* st = nf9_init(argc > 1 ? 0 : NF9_ACCURATE_MEMORY_USAGE);
     time_t print_time = 0;
 
     nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, MAX_MEM);
@@ -74,6 +74,15 @@ protected:
         return stats(nf9_get_stats(state_));
     }
 
+    // Number of templates stored for all exporters.
+    size_t num_templates() const
+    {
+        size_t ret = 0;
+        for (const auto &[_, index] : state_->exporter_ids)
+            ret += state_->exporters[index].templates.size();
+        return ret;
+    }
+
     packet decode(const uint8_t *buf, size_t len, const nf9_addr *addr)
     {
         nf9_packet *pkt;
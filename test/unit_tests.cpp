@@ -5,14 +5,22 @@
  */
 
 #include <arpa/inet.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <gtest/gtest.h>
 #include <netflow9.h>
 #include <netinet/in.h>
 #include <tins/tins.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include "test_lib.h"
 
 TEST_F(test, templates_exceptions)
@@ -305,7 +313,7 @@ TEST_F(test, multiple_data_templates)
 
     ASSERT_NE(result, nullptr);
 
-    EXPECT_EQ(state_->templates.size(), 2);
+    EXPECT_EQ(num_templates(), 2);
 }
 
 TEST_F(test, matching_template_per_address)
@@ -430,7 +438,7 @@ TEST_F(test, data_template_with_lower_timestamp)
     result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
     ASSERT_EQ(result, nullptr);
 
-    EXPECT_EQ(state_->templates.size(), 1);
+    EXPECT_EQ(num_templates(), 1);
 
     packet_bytes = netflow_packet_builder()
                        .add_data_flowset(256)
@@ -469,7 +477,7 @@ TEST_F(test, try_to_add_too_many_templates)
 
     result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
     ASSERT_NE(result, nullptr);
-    EXPECT_EQ(state_->templates.size(), 2);
+    EXPECT_EQ(num_templates(), 2);
     stats st = get_stats();
     int memory_used = nf9_get_stat(st.get(), NF9_STAT_MEMORY_USAGE);
     ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_MEM_USAGE, memory_used), 0);
@@ -483,7 +491,7 @@ TEST_F(test, try_to_add_too_many_templates)
 
     result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
     ASSERT_EQ(result, nullptr);
-    EXPECT_EQ(state_->templates.size(), 2);
+    EXPECT_EQ(num_templates(), 2);
 
     packet_bytes = netflow_packet_builder()
                        .add_data_template_flowset(0)
@@ -494,7 +502,7 @@ TEST_F(test, try_to_add_too_many_templates)
 
     result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
     ASSERT_NE(result, nullptr);
-    EXPECT_EQ(state_->templates.size(), 1);
+    EXPECT_EQ(num_templates(), 1);
 }
 
 TEST_F(test, detects_too_large_field_length_in_data_flowset)
@@ -852,3 +860,2167 @@ TEST_F(test, storing_simple_sampling_rates)
     ASSERT_EQ(sampling, 123);
     ASSERT_EQ(sampling_info, NF9_SAMPLING_MATCH_IP_SAMPLER_ID);
 }
+
+TEST_F(test, exporter_index_per_address_and_source_id)
+{
+    nf9_addr addr1 = make_inet_addr("192.168.0.123");
+    nf9_addr addr2 = make_inet_addr("169.254.0.1");
+    std::vector<uint8_t> packet_bytes;
+    packet result;
+
+    packet_bytes = netflow_packet_builder().set_source_id(1).build();
+    result = decode(packet_bytes.data(), packet_bytes.size(), &addr1);
+    ASSERT_NE(result, nullptr);
+    uint32_t first = nf9_get_exporter_index(result.get());
+
+    result = decode(packet_bytes.data(), packet_bytes.size(), &addr2);
+    ASSERT_NE(result, nullptr);
+    uint32_t second = nf9_get_exporter_index(result.get());
+    EXPECT_NE(first, second);
+
+    packet_bytes = netflow_packet_builder().set_source_id(2).build();
+    result = decode(packet_bytes.data(), packet_bytes.size(), &addr1);
+    ASSERT_NE(result, nullptr);
+    uint32_t third = nf9_get_exporter_index(result.get());
+    EXPECT_NE(first, third);
+    EXPECT_NE(second, third);
+
+    // The same exporter always gets the same index.
+    packet_bytes = netflow_packet_builder().set_source_id(1).build();
+    result = decode(packet_bytes.data(), packet_bytes.size(), &addr1);
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(nf9_get_exporter_index(result.get()), first);
+    EXPECT_EQ(state_->exporter_ids.size(), 3);
+}
+
+TEST_F(test, many_template_ids_per_exporter)
+{
+    nf9_addr addr = make_inet_addr("192.168.0.123");
+    const uint16_t template_ids[] = {1024, 300, 65535, 256, 700, 301};
+    std::vector<uint8_t> packet_bytes;
+    packet result;
+
+    // Templates arrive in arbitrary order, each one with a different field.
+    for (uint16_t tid : template_ids) {
+        packet_bytes = netflow_packet_builder()
+                           .add_data_template_flowset(0)
+                           .add_data_template(tid)
+                           .add_data_template_field(tid, 4)
+                           .build();
+        result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+        ASSERT_NE(result, nullptr);
+    }
+    EXPECT_EQ(num_templates(), 6);
+
+    for (uint16_t tid : template_ids) {
+        packet_bytes = netflow_packet_builder()
+                           .add_data_flowset(tid)
+                           .add_data_field(uint32_t(tid))
+                           .build();
+        result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+        ASSERT_NE(result, nullptr);
+        ASSERT_EQ(nf9_get_num_flows(result.get(), 0), 1);
+
+        uint32_t value;
+        size_t len = sizeof(value);
+        ASSERT_EQ(nf9_get_field(result.get(), 0, 0, NF9_DATA_FIELD(tid),
+                                &value, &len),
+                  0);
+        EXPECT_EQ(value, tid);
+    }
+
+    stats st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_MISSING_TEMPLATE_ERRORS), 0);
+}
+
+TEST_F(test, packets_pin_option_values)
+{
+    const int template_id = 1000;
+    nf9_addr addr = make_inet_addr("192.192.192.193");
+    std::vector<uint8_t> packet_bytes;
+
+    packet_bytes = netflow_packet_builder()
+                       .add_option_template_flowset(template_id)
+                       .add_option_field(NF9_FIELD_TOTAL_PKTS_EXP, 4)
+                       .build();
+    packet first = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(first, nullptr);
+    EXPECT_EQ(nf9_get_options_version(first.get()), 0);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(template_id)
+                       .add_data_field(uint32_t(100))
+                       .build();
+    packet second = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(second, nullptr);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(template_id)
+                       .add_data_field(uint32_t(200))
+                       .build();
+    packet third = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(third, nullptr);
+
+    // Each packet sees the options that were current when it was decoded.
+    uint32_t value;
+    size_t len = sizeof(value);
+    ASSERT_EQ(nf9_get_option(first.get(), NF9_FIELD_TOTAL_PKTS_EXP, &value,
+                             &len),
+              NF9_ERR_NOT_FOUND);
+    ASSERT_EQ(nf9_get_option(second.get(), NF9_FIELD_TOTAL_PKTS_EXP, &value,
+                             &len),
+              0);
+    EXPECT_EQ(value, 100);
+    ASSERT_EQ(nf9_get_option(third.get(), NF9_FIELD_TOTAL_PKTS_EXP, &value,
+                             &len),
+              0);
+    EXPECT_EQ(value, 200);
+    EXPECT_LT(nf9_get_options_version(second.get()),
+              nf9_get_options_version(third.get()));
+}
+
+TEST_F(test, sampling_rates_resolved_at_decode_time)
+{
+    const int option_template_id = 1000;
+    std::vector<uint8_t> packet_bytes;
+    nf9_addr addr = make_inet_addr("192.192.192.193");
+
+    packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(option_template_id)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL, 4)
+            .add_data_flowset(option_template_id)
+            .add_data_field(htons(7))
+            .add_data_field(htonl(100))
+            .build();
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_template_flowset(0)
+                       .add_data_template(257)
+                       .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                       .add_data_template_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+                       .build();
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(257)
+                       .add_data_field(htonl(55))
+                       .add_data_field(htons(7))
+                       .add_data_field(htonl(66))
+                       .add_data_field(htons(7))
+                       .build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+
+    // The sampler changes its rate after the data packet was decoded.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(option_template_id)
+                       .add_data_field(htons(7))
+                       .add_data_field(htonl(1000))
+                       .build();
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    uint32_t sampling;
+    int sampling_info;
+    for (unsigned flownum = 0; flownum < 2; ++flownum) {
+        ASSERT_EQ(nf9_get_sampling_rate(pkt.get(), 0, flownum, &sampling,
+                                        &sampling_info),
+                  0);
+        EXPECT_EQ(sampling, 100);
+        EXPECT_EQ(sampling_info, NF9_SAMPLING_MATCH_IP_SOURCE_ID_SAMPLER_ID);
+    }
+    ASSERT_EQ(
+        nf9_get_sampling_rate(pkt.get(), 0, 2, &sampling, &sampling_info),
+        NF9_ERR_NOT_FOUND);
+}
+
+TEST_F(test, upscale_counters_by_sampling_rate)
+{
+    nf9_free(state_);
+    state_ = nf9_init(NF9_UPSCALE_COUNTERS);
+
+    const int option_template_id = 1000;
+    std::vector<uint8_t> packet_bytes;
+    nf9_addr addr = make_inet_addr("192.192.192.193");
+
+    packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(option_template_id)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL, 4)
+            .add_data_flowset(option_template_id)
+            .add_data_field(htons(7))
+            .add_data_field(htonl(100))
+            .build();
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_template_flowset(0)
+                       .add_data_template(257)
+                       .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                       .add_data_template_field(NF9_FIELD_IN_PKTS, 8)
+                       .add_data_template_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+                       .add_data_flowset(257)
+                       .add_data_field(htonl(55))
+                       .add_data_field(htobe64(3))
+                       .add_data_field(htons(7))
+                       .add_data_field(htonl(66))
+                       .add_data_field(htobe64(4))
+                       .add_data_field(htons(8))
+                       .build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+    ASSERT_EQ(nf9_get_num_flows(pkt.get(), 1), 2);
+
+    uint64_t value;
+    ASSERT_EQ(nf9_get_upscaled_counter(pkt.get(), 1, 0, NF9_COUNTER_IN_BYTES,
+                                       &value),
+              0);
+    EXPECT_EQ(value, 5500);
+    ASSERT_EQ(nf9_get_upscaled_counter(pkt.get(), 1, 0, NF9_COUNTER_IN_PKTS,
+                                       &value),
+              0);
+    EXPECT_EQ(value, 300);
+
+    // Sampler 8 is unknown, so counters are not scaled.
+    const uint64_t* column =
+        nf9_get_upscaled_column(pkt.get(), 1, NF9_COUNTER_IN_BYTES);
+    ASSERT_NE(column, nullptr);
+    EXPECT_EQ(column[1], 66);
+
+    // There is no OUT_BYTES field in the template.
+    ASSERT_EQ(nf9_get_upscaled_counter(pkt.get(), 1, 1, NF9_COUNTER_OUT_BYTES,
+                                       &value),
+              0);
+    EXPECT_EQ(value, 0);
+
+    EXPECT_EQ(nf9_get_upscaled_column(pkt.get(), 0, NF9_COUNTER_IN_BYTES),
+              nullptr);
+    EXPECT_EQ(nf9_get_upscaled_counter(pkt.get(), 1, 2, NF9_COUNTER_IN_BYTES,
+                                       &value),
+              NF9_ERR_INVALID_ARGUMENT);
+}
+
+TEST_F(test, stats_from_many_threads)
+{
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .build();
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    // Counters incremented by other threads are summed on read.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([this] {
+            for (int j = 0; j < 1000; ++j)
+                state_->stats.add(NF9_STAT_PROCESSED_PACKETS);
+        });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    uint64_t values[NF9_NUM_STATS + 1];
+    ASSERT_EQ(nf9_get_stats_into(state_, values, NF9_NUM_STATS + 1),
+              NF9_NUM_STATS);
+    EXPECT_EQ(values[NF9_STAT_PROCESSED_PACKETS], 4001);
+    EXPECT_EQ(values[NF9_STAT_TOTAL_DATA_TEMPLATES], 1);
+    EXPECT_GT(values[NF9_STAT_MEMORY_USAGE], 0);
+
+    stats st = get_stats();
+    for (int stat = 0; stat < NF9_NUM_STATS; ++stat)
+        EXPECT_EQ(nf9_get_stat(st.get(), stat), values[stat]);
+
+    ASSERT_EQ(nf9_get_stats_into(state_, values, 1), 1);
+    EXPECT_EQ(values[0], 4001);
+}
+
+TEST_F(test, stage_timing_histograms)
+{
+    for (unsigned bucket = 1; bucket < NF9_HISTOGRAM_BUCKETS; ++bucket) {
+        uint64_t bound = nf9_get_histogram_bucket_bound(bucket);
+        ASSERT_GT(bound, nf9_get_histogram_bucket_bound(bucket - 1));
+        ASSERT_EQ(latency_histogram::bucket_index(bound), bucket);
+        ASSERT_EQ(latency_histogram::bucket_index(bound - 1), bucket - 1);
+    }
+
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .add_data_flowset(257)
+                                            .add_data_field(htonl(1))
+                                            .build();
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    uint64_t counts[NF9_HISTOGRAM_BUCKETS];
+    uint64_t nanoseconds;
+#ifdef NF9_ENABLE_TIMING
+    ASSERT_EQ(nf9_get_stage_histogram(state_, NF9_STAGE_DATA_FLOWSET, counts),
+              0);
+    uint64_t total = 0;
+    for (uint64_t count : counts)
+        total += count;
+    EXPECT_EQ(total, 1);
+
+    EXPECT_EQ(nf9_get_stage_quantile(state_, NF9_STAGE_HEADER, 0.99,
+                                     &nanoseconds),
+              0);
+    EXPECT_EQ(nf9_get_stage_quantile(state_, NF9_STAGE_EXPIRE_OBJECTS, 0.99,
+                                     &nanoseconds),
+              NF9_ERR_NOT_FOUND);
+    EXPECT_EQ(nf9_get_stage_quantile(state_, NF9_NUM_STAGES, 0.99,
+                                     &nanoseconds),
+              NF9_ERR_INVALID_ARGUMENT);
+#else
+    EXPECT_EQ(nf9_get_stage_histogram(state_, NF9_STAGE_DATA_FLOWSET, counts),
+              NF9_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(nf9_get_stage_quantile(state_, NF9_STAGE_HEADER, 0.99,
+                                     &nanoseconds),
+              NF9_ERR_INVALID_ARGUMENT);
+#endif
+}
+
+TEST_F(test, per_exporter_stats)
+{
+    nf9_addr addr1 = make_inet_addr("192.168.1.1");
+    nf9_addr addr2 = make_inet_addr("192.168.1.2");
+
+    std::vector<uint8_t> template_bytes = netflow_packet_builder()
+                                              .set_unix_timestamp(1000)
+                                              .add_data_template_flowset(0)
+                                              .add_data_template(257)
+                                              .add_data_template_field(1, 4)
+                                              .build();
+    std::vector<uint8_t> data_bytes = netflow_packet_builder()
+                                          .set_unix_timestamp(1001)
+                                          .add_data_flowset(257)
+                                          .add_data_field(htonl(1))
+                                          .build();
+
+    decode(template_bytes.data(), template_bytes.size(), &addr1);
+    decode(data_bytes.data(), data_bytes.size(), &addr1);
+    decode(data_bytes.data(), data_bytes.size(), &addr2);
+    decode(data_bytes.data(), data_bytes.size() - 1, &addr2);
+
+    ASSERT_EQ(nf9_get_num_exporters(state_), 2);
+
+    nf9_exporter_stats exporters[3];
+    size_t size = 3;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, exporters, &size), 0);
+    ASSERT_EQ(size, 2);
+    if (exporters[0].addr.in.sin_addr.s_addr != addr1.in.sin_addr.s_addr)
+        std::swap(exporters[0], exporters[1]);
+
+    EXPECT_EQ(exporters[0].packets, 2);
+    EXPECT_EQ(exporters[0].bytes, template_bytes.size() + data_bytes.size());
+    EXPECT_EQ(exporters[0].templates, 1);
+    EXPECT_EQ(exporters[0].records, 1);
+    EXPECT_EQ(exporters[0].missing_templates, 0);
+    EXPECT_EQ(exporters[0].malformed_packets, 0);
+    EXPECT_EQ(exporters[0].last_seen, 1001);
+
+    EXPECT_EQ(exporters[1].packets, 2);
+    EXPECT_EQ(exporters[1].missing_templates, 1);
+    EXPECT_EQ(exporters[1].malformed_packets, 1);
+
+    size = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, exporters, &size), 0);
+    EXPECT_EQ(size, 1);
+}
+
+TEST_F(test, format_metrics)
+{
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .set_source_id(12)
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .build();
+    nf9_addr addr = make_inet_addr("192.168.1.1", htons(2055));
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    nf9_exporter_stats exporter;
+    size_t num_exporters = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &exporter, &num_exporters), 0);
+    ASSERT_GT(exporter.memory_usage, 0);
+
+    size_t len = nf9_format_metrics(state_, nullptr, 0);
+    std::string text(len + 1, '\0');
+    ASSERT_EQ(nf9_format_metrics(state_, text.data(), text.size()), len);
+    text.resize(len);
+
+    EXPECT_NE(text.find("# TYPE nf9_processed_packets counter\n"
+                        "# HELP nf9_processed_packets Number of processed "
+                        "packets.\n"
+                        "nf9_processed_packets_total 1\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nf9_exporter_template_flowsets_total{exporter="
+                        "\"192.168.1.1\",port=\"2055\",source_id=\"12\"} "
+                        "1\n"),
+              std::string::npos);
+    EXPECT_NE(text.find("nf9_exporter_memory_usage_bytes{exporter="
+                        "\"192.168.1.1\",port=\"2055\",source_id=\"12\"} " +
+                        std::to_string(exporter.memory_usage) + "\n"),
+              std::string::npos);
+#ifdef NF9_ENABLE_TIMING
+    EXPECT_NE(text.find("nf9_stage_duration_seconds_sum{stage=\"header\"} "),
+              std::string::npos);
+#endif
+    EXPECT_EQ(text.substr(text.size() - 6), "# EOF\n");
+
+    // Truncated output is still null-terminated.
+    char small[16];
+    EXPECT_EQ(nf9_format_metrics(state_, small, sizeof(small)), len);
+    EXPECT_EQ(strlen(small), sizeof(small) - 1);
+}
+
+TEST_F(test, publish_stats_in_shared_memory)
+{
+    std::string name = "/nf9-unit-test-" + std::to_string(getpid());
+    EXPECT_EQ(nf9_ctl(state_, NF9_OPT_STATS_PUBLISH_INTERVAL, 0),
+              NF9_ERR_INVALID_ARGUMENT);
+    ASSERT_EQ(nf9_publish_stats(state_, name.c_str()), 0);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_STATS_PUBLISH_INTERVAL, 0), 0);
+
+    nf9_stats_reader *reader = nf9_open_stats_reader(name.c_str());
+    ASSERT_NE(reader, nullptr);
+
+    uint64_t values[NF9_NUM_STATS];
+    size_t count = NF9_NUM_STATS;
+    uint64_t timestamp;
+    ASSERT_EQ(nf9_read_published_stats(reader, values, &count, &timestamp),
+              0);
+    ASSERT_EQ(count, NF9_NUM_STATS);
+    EXPECT_EQ(values[NF9_STAT_PROCESSED_PACKETS], 0);
+    EXPECT_GT(timestamp, 0);
+
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .build();
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    ASSERT_EQ(nf9_read_published_stats(reader, values, &count, nullptr), 0);
+    EXPECT_EQ(values[NF9_STAT_PROCESSED_PACKETS], 1);
+    EXPECT_EQ(values[NF9_STAT_TOTAL_DATA_TEMPLATES], 1);
+
+    // Publishing again keeps the same segment, and another decoder can't
+    // publish to it.
+    ASSERT_EQ(nf9_publish_stats(state_, name.c_str()), 0);
+    nf9_state *other = nf9_init(0);
+    EXPECT_EQ(nf9_publish_stats(other, name.c_str()), NF9_ERR_SYSTEM);
+    EXPECT_EQ(errno, EBUSY);
+    nf9_free(other);
+    ASSERT_EQ(nf9_read_published_stats(reader, values, &count, nullptr), 0);
+    EXPECT_EQ(values[NF9_STAT_PROCESSED_PACKETS], 1);
+
+    // Readers give up on a segment left in the middle of an update.
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    void *segment = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+    close(fd);
+    ASSERT_NE(segment, MAP_FAILED);
+    uint64_t *sequence = reinterpret_cast<uint64_t *>(
+        static_cast<uint8_t *>(segment) + 4 * sizeof(uint32_t));
+    ++*sequence;
+    EXPECT_EQ(nf9_read_published_stats(reader, values, &count, nullptr),
+              NF9_ERR_SYSTEM);
+    EXPECT_EQ(errno, EAGAIN);
+    ++*sequence;
+    EXPECT_EQ(nf9_read_published_stats(reader, values, &count, nullptr), 0);
+    munmap(segment, 4096);
+    nf9_close_stats_reader(reader);
+
+    // The segment is removed with the decoder which created it.
+    nf9_free(state_);
+    state_ = nf9_init(0);
+    EXPECT_EQ(nf9_open_stats_reader(name.c_str()), nullptr);
+}
+
+TEST_F(test, publish_stats_to_uninitialized_segment)
+{
+    std::string name = "/nf9-unit-test-new-" + std::to_string(getpid());
+
+    // A decoder which has just created the segment hasn't sized it yet.
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    ASSERT_GE(fd, 0);
+    errno = 0;
+    EXPECT_EQ(nf9_open_stats_reader(name.c_str()), nullptr);
+    EXPECT_EQ(errno, EAGAIN);
+    EXPECT_EQ(nf9_publish_stats(state_, name.c_str()), NF9_ERR_SYSTEM);
+    EXPECT_EQ(errno, EAGAIN);
+
+    // A decoder which crashed before initializing it left it zeroed.
+    ASSERT_EQ(ftruncate(fd, 4096), 0);
+    close(fd);
+    errno = 0;
+    EXPECT_EQ(nf9_open_stats_reader(name.c_str()), nullptr);
+    EXPECT_EQ(errno, EAGAIN);
+
+    ASSERT_EQ(nf9_publish_stats(state_, name.c_str()), 0);
+    nf9_stats_reader *reader = nf9_open_stats_reader(name.c_str());
+    ASSERT_NE(reader, nullptr);
+    uint64_t values[NF9_NUM_STATS];
+    size_t count = NF9_NUM_STATS;
+    EXPECT_EQ(nf9_read_published_stats(reader, values, &count, nullptr), 0);
+    EXPECT_EQ(count, NF9_NUM_STATS);
+    nf9_close_stats_reader(reader);
+    shm_unlink(name.c_str());
+}
+
+TEST_F(test, save_and_load_state)
+{
+    const int option_template_id = 1000;
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .set_source_id(5)
+            .add_option_template_flowset(option_template_id)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL, 4)
+            .add_data_flowset(option_template_id)
+            .add_data_field(htons(7))
+            .add_data_field(htonl(100))
+            .add_data_template_flowset(0)
+            .add_data_template(257)
+            .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+            .add_data_template_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .build();
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    std::string path = "nf9-unit-test-state-" + std::to_string(getpid());
+    ASSERT_EQ(nf9_save_state(state_, path.c_str()), 0);
+
+    nf9_free(state_);
+    state_ = nf9_init(NF9_STORE_SAMPLING_RATES);
+    ASSERT_EQ(nf9_load_state(state_, path.c_str()), 0);
+    EXPECT_EQ(num_templates(), 2);
+
+    // Data can be decoded without receiving the templates again.
+    packet_bytes = netflow_packet_builder()
+                       .set_source_id(5)
+                       .add_data_flowset(257)
+                       .add_data_field(htonl(55))
+                       .add_data_field(htons(7))
+                       .build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+    ASSERT_EQ(nf9_get_num_flows(pkt.get(), 0), 1);
+
+    uint32_t rate;
+    int info;
+    ASSERT_EQ(nf9_get_sampling_rate(pkt.get(), 0, 0, &rate, &info), 0);
+    EXPECT_EQ(rate, 100);
+
+    uint16_t sampler;
+    size_t len = sizeof(sampler);
+    ASSERT_EQ(nf9_get_option(pkt.get(), NF9_FIELD_FLOW_SAMPLER_ID, &sampler,
+                             &len),
+              0);
+    EXPECT_EQ(ntohs(sampler), 7);
+
+    // Corrupted files are rejected.
+    FILE *file = fopen(path.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, -1, SEEK_END);
+    fputc(0xff, file);
+    fclose(file);
+    EXPECT_EQ(nf9_load_state(state_, path.c_str()), NF9_ERR_MALFORMED);
+
+    unlink(path.c_str());
+    EXPECT_EQ(nf9_load_state(state_, path.c_str()), NF9_ERR_SYSTEM);
+}
+
+TEST_F(test, save_and_load_scoped_options)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    auto text = [](const char* s) {
+        std::array<char, 8> field = {};
+        strncpy(field.data(), s, field.size());
+        return field;
+    };
+
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .set_unix_timestamp(1000)
+            .add_option_template_flowset(300)
+            .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+            .add_option_field(NF9_FIELD_IF_NAME, 8)
+            .add_option_field(NF9_FIELD_IF_DESC, 8)
+            .add_data_flowset(300)
+            .add_data_field(htonl(1))
+            .add_data_field(text("eth0"))
+            .add_data_field(text("uplink"))
+            .add_data_field(htonl(2))
+            .add_data_field(text("eth1"))
+            .add_data_field(text(""))
+            .add_option_template_flowset(301)
+            .add_option_scope_field(NF9_SCOPE_FIELD_SYSTEM & 0xffff, 4)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL, 4)
+            .add_data_flowset(301)
+            .add_data_field(uint32_t(0))
+            .add_data_field(htons(5))
+            .add_data_field(htonl(100))
+            .add_data_template_flowset(0)
+            .add_data_template(256)
+            .add_data_template_field(NF9_FIELD_INPUT_SNMP, 2)
+            .build();
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    std::string path = "nf9-unit-test-state-" + std::to_string(getpid());
+    ASSERT_EQ(nf9_save_state(state_, path.c_str()), 0);
+
+    // Loading fails as a whole if the decoder runs out of memory, at any
+    // point.
+    int failures = 0;
+    for (long limit = 100; limit < 10000; limit += 100) {
+        nf9_free(state_);
+        state_ = nf9_init(0);
+        ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_MEM_USAGE, limit), 0);
+        int err = nf9_load_state(state_, path.c_str());
+        if (err == 0)
+            break;
+        ++failures;
+        EXPECT_EQ(err, NF9_ERR_OUT_OF_MEMORY);
+        EXPECT_EQ(nf9_get_num_exporters(state_), 0);
+    }
+    EXPECT_GT(failures, 0);
+
+    nf9_free(state_);
+    state_ = nf9_init(0);
+    ASSERT_EQ(nf9_load_state(state_, path.c_str()), 0);
+
+    packet_bytes = netflow_packet_builder()
+                       .set_unix_timestamp(1001)
+                       .add_data_flowset(256)
+                       .add_data_field(htons(1))
+                       .build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+
+    // Records stored under each scope and names of interfaces are restored.
+    uint32_t interval;
+    size_t len = sizeof(interval);
+    ASSERT_EQ(nf9_get_option_scoped(pkt.get(), NF9_FIELD_FLOW_SAMPLER_ID, 5,
+                                    NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL,
+                                    &interval, &len),
+              0);
+    EXPECT_EQ(ntohl(interval), 100);
+
+    std::array<char, 8> name;
+    len = name.size();
+    ASSERT_EQ(nf9_get_option_scoped(pkt.get(), NF9_SCOPE_FIELD_INTERFACE, 2,
+                                    NF9_FIELD_IF_NAME, name.data(), &len),
+              0);
+    EXPECT_STREQ(name.data(), "eth1");
+
+    const char* if_name;
+    const char* description;
+    ASSERT_EQ(nf9_get_interface_name(pkt.get(), 1, &if_name, &description),
+              0);
+    EXPECT_STREQ(if_name, "eth0");
+    EXPECT_STREQ(description, "uplink");
+    ASSERT_EQ(nf9_get_interface_name(pkt.get(), 2, &if_name, &description),
+              0);
+    EXPECT_STREQ(if_name, "eth1");
+    EXPECT_EQ(description, nullptr);
+
+    // Exporters known to the decoder keep what they sent since then.
+    ASSERT_EQ(nf9_load_state(state_, path.c_str()), 0);
+    unlink(path.c_str());
+    nf9_exporter_stats exporter;
+    size_t size = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &exporter, &size), 0);
+    ASSERT_EQ(size, 1);
+    EXPECT_EQ(exporter.last_seen, 1001);
+}
+
+TEST_F(test, templates_shared_between_decoders)
+{
+    std::string name = "/nf9-unit-test-templates-" + std::to_string(getpid());
+    nf9_state *other = nf9_init(0);
+    ASSERT_EQ(nf9_attach_template_store(state_, name.c_str(), 128), 0);
+    ASSERT_EQ(nf9_attach_template_store(other, name.c_str(), 128), 0);
+    EXPECT_EQ(nf9_attach_template_store(other, name.c_str(), 64),
+              NF9_ERR_INVALID_ARGUMENT);
+
+    nf9_addr addr = make_inet_addr("192.168.1.1", htons(2055));
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .add_data_template_field(2, 2)
+                                            .build();
+    nf9_packet *pkt;
+    ASSERT_EQ(nf9_decode(other, &pkt, packet_bytes.data(),
+                         packet_bytes.size(), &addr),
+              0);
+    nf9_free_packet(pkt);
+
+    // The data arrives at the other decoder.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(257)
+                       .add_data_field(htonl(1234))
+                       .add_data_field(htons(5))
+                       .build();
+    packet data = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(data, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(data.get()), 1);
+    ASSERT_EQ(nf9_get_num_flows(data.get(), 0), 1);
+
+    uint32_t bytes;
+    size_t len = sizeof(bytes);
+    ASSERT_EQ(
+        nf9_get_field(data.get(), 0, 0, NF9_FIELD_IN_BYTES, &bytes, &len), 0);
+    EXPECT_EQ(ntohl(bytes), 1234);
+
+    stats st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_MISSING_TEMPLATE_ERRORS), 0);
+
+    // Other exporters don't see the template.
+    nf9_addr other_addr = make_inet_addr("192.168.1.2", 2055);
+    data = decode(packet_bytes.data(), packet_bytes.size(), &other_addr);
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(data.get()), 0);
+
+    nf9_free(other);
+    shm_unlink(name.c_str());
+}
+
+TEST_F(test, shared_template_redefinitions)
+{
+    std::string name =
+        "/nf9-unit-test-redefinitions-" + std::to_string(getpid());
+    nf9_state *other = nf9_init(0);
+    ASSERT_EQ(nf9_attach_template_store(state_, name.c_str(), 128), 0);
+    ASSERT_EQ(nf9_attach_template_store(other, name.c_str(), 128), 0);
+    nf9_addr addr = make_inet_addr("192.168.1.1", htons(2055));
+
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_template_flowset(0)
+                                            .add_data_template(257)
+                                            .add_data_template_field(1, 4)
+                                            .set_unix_timestamp(1000)
+                                            .build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+
+    // The exporter redefines the template, and the other decoder gets it.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_template_flowset(0)
+                       .add_data_template(257)
+                       .add_data_template_field(2, 4)
+                       .add_data_template_field(1, 4)
+                       .set_unix_timestamp(1010)
+                       .build();
+    nf9_packet *other_pkt;
+    ASSERT_EQ(nf9_decode(other, &other_pkt, packet_bytes.data(),
+                         packet_bytes.size(), &addr),
+              0);
+    nf9_free_packet(other_pkt);
+
+    // This decoder still has the old template, but decodes records with
+    // the new one.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(257)
+                       .add_data_field(htonl(7))
+                       .add_data_field(htonl(1234))
+                       .set_unix_timestamp(1011)
+                       .build();
+    pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(pkt.get()), 1);
+    ASSERT_EQ(nf9_get_num_flows(pkt.get(), 0), 1);
+
+    uint32_t value;
+    size_t len = sizeof(value);
+    ASSERT_EQ(
+        nf9_get_field(pkt.get(), 0, 0, NF9_FIELD_IN_BYTES, &value, &len), 0);
+    EXPECT_EQ(ntohl(value), 1234);
+    len = sizeof(value);
+    ASSERT_EQ(
+        nf9_get_field(pkt.get(), 0, 0, NF9_FIELD_IN_PKTS, &value, &len), 0);
+    EXPECT_EQ(ntohl(value), 7);
+
+    nf9_free(other);
+    shm_unlink(name.c_str());
+}
+
+TEST_F(test, shared_templates_after_clock_step)
+{
+    std::string name =
+        "/nf9-unit-test-clock-step-" + std::to_string(getpid());
+    nf9_state *other = nf9_init(0);
+    ASSERT_EQ(nf9_attach_template_store(state_, name.c_str(), 128), 0);
+    ASSERT_EQ(nf9_attach_template_store(other, name.c_str(), 128), 0);
+    nf9_addr addr = make_inet_addr("192.168.1.1", htons(2055));
+
+    auto template_packet = [](nf9_field field, uint32_t timestamp) {
+        return netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(257)
+            .add_data_template_field(field, 4)
+            .set_unix_timestamp(timestamp)
+            .build();
+    };
+    auto data_packet = [](uint32_t timestamp) {
+        return netflow_packet_builder()
+            .add_data_flowset(257)
+            .add_data_field(htonl(1234))
+            .set_unix_timestamp(timestamp)
+            .build();
+    };
+
+    // The other decoder got the template before the exporter's clock
+    // stepped back.
+    std::vector<uint8_t> packet_bytes =
+        template_packet(NF9_FIELD_IN_PKTS, 5000);
+    nf9_packet *other_pkt;
+    ASSERT_EQ(nf9_decode(other, &other_pkt, packet_bytes.data(),
+                         packet_bytes.size(), &addr),
+              0);
+    nf9_free_packet(other_pkt);
+
+    // The shared template is from the future, so it's not used.
+    packet_bytes = data_packet(1000);
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(pkt.get()), 0);
+
+    // A template received now replaces it.
+    packet_bytes = template_packet(NF9_FIELD_IN_BYTES, 1001);
+    pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+
+    for (nf9_state *decoder : {state_, other}) {
+        packet_bytes = data_packet(1002);
+        ASSERT_EQ(nf9_decode(decoder, &other_pkt, packet_bytes.data(),
+                             packet_bytes.size(), &addr),
+                  0);
+        packet data(other_pkt);
+        ASSERT_EQ(nf9_get_num_flowsets(data.get()), 1);
+        uint32_t value;
+        size_t len = sizeof(value);
+        EXPECT_EQ(nf9_get_field(data.get(), 0, 0, NF9_FIELD_IN_BYTES, &value,
+                                &len),
+                  0);
+    }
+
+    stats st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_EXPIRED_OBJECTS), 0);
+
+    nf9_free(other);
+    shm_unlink(name.c_str());
+}
+
+TEST_F(test, shared_templates_created_concurrently)
+{
+    std::string name =
+        "/nf9-unit-test-concurrent-templates-" + std::to_string(getpid());
+
+    // As many slots as templates: if any template was stored twice,
+    // another one would be missing.
+    const int num_templates = 16;
+    const int num_decoders = 4;
+    nf9_addr addr = make_inet_addr("192.168.1.1", htons(2055));
+    std::vector<uint8_t> packet_bytes;
+    {
+        netflow_packet_builder builder;
+        builder.add_data_template_flowset(0);
+        for (int tid = 256; tid < 256 + num_templates; ++tid)
+            builder.add_data_template(tid).add_data_template_field(1, 4);
+        packet_bytes = builder.build();
+    }
+
+    for (int round = 0; round < 20; ++round) {
+        shm_unlink(name.c_str());
+        std::vector<nf9_state *> decoders;
+        for (int i = 0; i < num_decoders; ++i) {
+            decoders.push_back(nf9_init(0));
+            ASSERT_EQ(nf9_attach_template_store(decoders.back(), name.c_str(),
+                                                num_templates),
+                      0);
+        }
+
+        // Threads start decoding at once, to make them race for slots.
+        std::atomic<int> ready{0};
+        std::vector<std::thread> threads;
+        for (nf9_state *st : decoders) {
+            threads.emplace_back([&, st] {
+                ++ready;
+                while (ready < num_decoders)
+                    std::this_thread::yield();
+                nf9_packet *pkt;
+                if (nf9_decode(st, &pkt, packet_bytes.data(),
+                               packet_bytes.size(), &addr) == 0)
+                    nf9_free_packet(pkt);
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+        for (nf9_state *st : decoders)
+            nf9_free(st);
+
+        nf9_state *reader = nf9_init(0);
+        ASSERT_EQ(nf9_attach_template_store(reader, name.c_str(),
+                                            num_templates),
+                  0);
+        for (int tid = 256; tid < 256 + num_templates; ++tid) {
+            std::vector<uint8_t> data = netflow_packet_builder()
+                                            .add_data_flowset(tid)
+                                            .add_data_field(htonl(1))
+                                            .build();
+            nf9_packet *pkt;
+            ASSERT_EQ(
+                nf9_decode(reader, &pkt, data.data(), data.size(), &addr), 0);
+            EXPECT_EQ(nf9_get_num_flowsets(pkt), 1) << "template " << tid;
+            nf9_free_packet(pkt);
+        }
+        nf9_free(reader);
+    }
+    shm_unlink(name.c_str());
+}
+
+TEST_F(test, pending_flowsets_replayed_with_template)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_PENDING_BYTES, 8), 0);
+
+    std::vector<uint8_t> data_bytes = netflow_packet_builder()
+                                          .set_unix_timestamp(1000)
+                                          .add_data_flowset(256)
+                                          .add_data_field(htonl(1))
+                                          .add_data_flowset(257)
+                                          .add_data_field(htonl(2))
+                                          .build();
+    packet result = decode(data_bytes.data(), data_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(result.get()), 0);
+
+    // The queue is full, so the oldest flowset is dropped.
+    data_bytes = netflow_packet_builder()
+                     .set_unix_timestamp(1001)
+                     .add_data_flowset(256)
+                     .add_data_field(htonl(3))
+                     .build();
+    decode(data_bytes.data(), data_bytes.size(), &addr);
+
+    stats st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_QUEUED_FLOWSETS), 3);
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_MISSING_TEMPLATE_ERRORS), 1);
+
+    std::vector<uint8_t> template_bytes = netflow_packet_builder()
+                                              .set_unix_timestamp(1002)
+                                              .add_data_template_flowset(0)
+                                              .add_data_template(256)
+                                              .add_data_template_field(1, 4)
+                                              .build();
+    result = decode(template_bytes.data(), template_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(result.get()), 2);
+    EXPECT_EQ(nf9_get_flowset_type(result.get(), 0), NF9_FLOWSET_TEMPLATE);
+    EXPECT_EQ(nf9_get_flowset_type(result.get(), 1), NF9_FLOWSET_DATA);
+    ASSERT_EQ(nf9_get_num_flows(result.get(), 1), 1);
+
+    uint32_t value;
+    size_t len = sizeof(value);
+    ASSERT_EQ(nf9_get_field(result.get(), 1, 0, 1, &value, &len), 0);
+    EXPECT_EQ(ntohl(value), 3);
+
+    st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_REPLAYED_FLOWSETS), 1);
+
+    // Flowsets waiting for too long are dropped.
+    template_bytes = netflow_packet_builder()
+                         .set_unix_timestamp(1100)
+                         .add_data_template_flowset(0)
+                         .add_data_template(257)
+                         .add_data_template_field(1, 4)
+                         .build();
+    result = decode(template_bytes.data(), template_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(result.get()), 1);
+
+    st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_REPLAYED_FLOWSETS), 1);
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_MISSING_TEMPLATE_ERRORS), 2);
+}
+
+TEST_F(test, accurate_memory_usage)
+{
+    nf9_state* accurate = nf9_init(NF9_ACCURATE_MEMORY_USAGE);
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(256)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+            .build();
+    decode(packet_bytes.data(), packet_bytes.size(), &addr);
+
+    nf9_packet* pkt;
+    ASSERT_EQ(nf9_decode(accurate, &pkt, packet_bytes.data(),
+                         packet_bytes.size(), &addr),
+              0);
+    nf9_free_packet(pkt);
+
+    stats st = get_stats();
+    const nf9_stats* accurate_st = nf9_get_stats(accurate);
+    uint64_t requested = nf9_get_stat(st.get(), NF9_STAT_MEMORY_USAGE);
+    uint64_t charged = nf9_get_stat(accurate_st, NF9_STAT_MEMORY_USAGE);
+    EXPECT_GT(requested, 0);
+    EXPECT_GT(charged, requested);
+    nf9_free_stats(accurate_st);
+    nf9_free(accurate);
+}
+
+TEST_F(test, packet_memory_budget)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    std::vector<uint8_t> template_bytes =
+        netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(256)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+            .build();
+    decode(template_bytes.data(), template_bytes.size(), &addr);
+
+    netflow_packet_builder builder;
+    builder.add_data_flowset(256);
+    for (uint32_t i = 0; i < 100; ++i)
+        builder.add_data_field(i).add_data_field(i);
+    std::vector<uint8_t> data_bytes = builder.build();
+
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_PACKET_MEM_USAGE, -1),
+              NF9_ERR_INVALID_ARGUMENT);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_PACKET_MEM_USAGE, 1000), 0);
+
+    nf9_packet* pkt;
+    EXPECT_EQ(nf9_decode(state_, &pkt, data_bytes.data(), data_bytes.size(),
+                         &addr),
+              NF9_ERR_OUT_OF_MEMORY);
+
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_PACKET_MEM_USAGE, 1000000), 0);
+    packet result = decode(data_bytes.data(), data_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flows(result.get(), 0), 100);
+
+    uint32_t dst;
+    size_t len = sizeof(dst);
+    ASSERT_EQ(nf9_get_field(result.get(), 0, 99, NF9_FIELD_IPV4_DST_ADDR, &dst,
+                            &len),
+              0);
+    EXPECT_EQ(dst, 99);
+}
+
+TEST_F(test, pool_allocator)
+{
+    for (int flags : {NF9_POOL_ALLOCATOR, NF9_HUGE_PAGES}) {
+        nf9_state* st = nf9_init(flags | NF9_ACCURATE_MEMORY_USAGE);
+        nf9_addr addr = make_inet_addr("192.168.1.1");
+        ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, 4000), 0);
+        ASSERT_EQ(nf9_ctl(st, NF9_OPT_TEMPLATE_EXPIRE_TIME, 10), 0);
+
+        // Templates expire and are replaced with new ones, which reuse
+        // the freed blocks.
+        for (uint32_t i = 0; i < 1000; ++i) {
+            uint16_t tid = 256 + i % 100;
+            std::vector<uint8_t> packet_bytes =
+                netflow_packet_builder()
+                    .set_unix_timestamp(i)
+                    .add_data_template_flowset(0)
+                    .add_data_template(tid)
+                    .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                    .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+                    .add_data_flowset(tid)
+                    .add_data_field(htonl(i))
+                    .add_data_field(htonl(i + 1))
+                    .build();
+
+            nf9_packet* pkt;
+            ASSERT_EQ(nf9_decode(st, &pkt, packet_bytes.data(),
+                                 packet_bytes.size(), &addr),
+                      0);
+            ASSERT_EQ(nf9_get_num_flowsets(pkt), 2);
+
+            uint32_t dst;
+            size_t len = sizeof(dst);
+            ASSERT_EQ(nf9_get_field(pkt, 1, 0, NF9_FIELD_IPV4_DST_ADDR, &dst,
+                                    &len),
+                      0);
+            EXPECT_EQ(ntohl(dst), i + 1);
+            nf9_free_packet(pkt);
+        }
+
+        const nf9_stats* stats = nf9_get_stats(st);
+        EXPECT_LE(nf9_get_stat(stats, NF9_STAT_MEMORY_USAGE), 4000);
+        EXPECT_GT(nf9_get_stat(stats, NF9_STAT_EXPIRED_OBJECTS), 0);
+        nf9_free_stats(stats);
+        nf9_free(st);
+    }
+}
+
+// Number of exceptions thrown so far.  Exceptions are allocated with
+// malloc, which a fixed decoder must not call after it's created.
+static std::atomic<size_t> exceptions_thrown;
+
+extern "C" void* __cxa_allocate_exception(size_t size) noexcept
+{
+    using allocate_function = void* (*)(size_t);
+    static allocate_function next = reinterpret_cast<allocate_function>(
+        dlsym(RTLD_NEXT, "__cxa_allocate_exception"));
+    ++exceptions_thrown;
+    return next(size);
+}
+
+struct counting_allocator
+{
+    size_t allocations = 0;
+    size_t frees = 0;
+    size_t max_allocations = SIZE_MAX;
+};
+
+static void* counting_malloc(size_t size, void* ctx)
+{
+    counting_allocator* counts = static_cast<counting_allocator*>(ctx);
+    if (counts->allocations == counts->max_allocations)
+        return nullptr;
+    ++counts->allocations;
+    return malloc(size);
+}
+
+static void counting_free(void* ptr, void* ctx)
+{
+    ++static_cast<counting_allocator*>(ctx)->frees;
+    free(ptr);
+}
+
+TEST_F(test, custom_allocator)
+{
+    counting_allocator counts;
+    nf9_allocator allocator = {counting_malloc, counting_free, &counts};
+
+    for (int flags : {0, int(NF9_POOL_ALLOCATOR)}) {
+        counts = counting_allocator();
+        nf9_state* st = nf9_init_ex(flags | NF9_UPSCALE_COUNTERS, &allocator);
+        ASSERT_NE(st, nullptr);
+        ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_PACKET_MEM_USAGE, 100000), 0);
+        nf9_addr addr = make_inet_addr("192.168.1.1");
+
+        std::vector<uint8_t> packet_bytes =
+            netflow_packet_builder()
+                .add_data_template_flowset(0)
+                .add_data_template(256)
+                .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                .add_data_flowset(256)
+                .add_data_field(htonl(1))
+                .add_data_field(htonl(1000))
+                .build();
+
+        nf9_packet* pkt;
+        ASSERT_EQ(nf9_decode(st, &pkt, packet_bytes.data(),
+                             packet_bytes.size(), &addr),
+                  0);
+        uint64_t bytes;
+        ASSERT_EQ(nf9_get_upscaled_counter(pkt, 1, 0, NF9_COUNTER_IN_BYTES,
+                                           &bytes),
+                  0);
+        EXPECT_EQ(bytes, 1000);
+        nf9_free_packet(pkt);
+        nf9_free(st);
+
+        EXPECT_GT(counts.allocations, 0);
+        EXPECT_EQ(counts.allocations, counts.frees);
+    }
+}
+
+TEST_F(test, fixed_capacity_decoder)
+{
+    counting_allocator counts;
+    nf9_allocator allocator = {counting_malloc, counting_free, &counts};
+    nf9_capacity capacity = {};
+    capacity.exporters = 2;
+    capacity.templates = 8;
+    capacity.packets = 4;
+    capacity.packet_bytes = 4096;
+
+    nf9_state* st = nf9_init_fixed(0, &capacity, &allocator);
+    ASSERT_NE(st, nullptr);
+    size_t allocations = counts.allocations;
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    // Replace templates many times.
+    for (int i = 0; i < 1000; ++i) {
+        uint16_t template_id = 256 + i % 8;
+        std::vector<uint8_t> packet_bytes =
+            netflow_packet_builder()
+                .add_data_template_flowset(0)
+                .add_data_template(template_id)
+                .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                .add_data_flowset(template_id)
+                .add_data_field(htonl(1))
+                .add_data_field(htonl(i))
+                .build();
+
+        nf9_packet* pkt;
+        ASSERT_EQ(nf9_decode(st, &pkt, packet_bytes.data(),
+                             packet_bytes.size(), &addr),
+                  0);
+        ASSERT_EQ(nf9_get_num_flows(pkt, 1), 1);
+        nf9_free_packet(pkt);
+    }
+    EXPECT_EQ(counts.allocations, allocations);
+
+    // Packets which aren't freed eventually exhaust the memory.
+    std::vector<uint8_t> packet_bytes = netflow_packet_builder()
+                                            .add_data_flowset(256)
+                                            .add_data_field(htonl(1))
+                                            .add_data_field(htonl(1000))
+                                            .build();
+    std::vector<nf9_packet*> packets;
+    packets.reserve(10000);
+    size_t exceptions = exceptions_thrown;
+    int err = 0;
+    while (err == 0 && packets.size() < 10000) {
+        nf9_packet* pkt;
+        err = nf9_decode(st, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &addr);
+        if (err == 0)
+            packets.push_back(pkt);
+    }
+    EXPECT_EQ(err, NF9_ERR_OUT_OF_MEMORY);
+    EXPECT_GE(packets.size(), capacity.packets);
+    EXPECT_EQ(counts.allocations, allocations);
+
+    // Running out of the region is detected before anything is allocated,
+    // for templates too.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_template_flowset(0)
+                       .add_data_template(256)
+                       .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                       .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                       .build();
+    err = 0;
+    while (err == 0 && packets.size() < 10000) {
+        nf9_packet* pkt;
+        err = nf9_decode(st, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &addr);
+        if (err == 0)
+            packets.push_back(pkt);
+    }
+    EXPECT_EQ(err, NF9_ERR_OUT_OF_MEMORY);
+    EXPECT_EQ(exceptions_thrown, exceptions);
+
+    for (nf9_packet* pkt : packets)
+        nf9_free_packet(pkt);
+    nf9_free(st);
+    EXPECT_EQ(counts.allocations, counts.frees);
+
+    capacity.packets = 0;
+    EXPECT_EQ(nf9_init_fixed(0, &capacity, nullptr), nullptr);
+}
+
+TEST_F(test, fixed_capacity_fragmentation)
+{
+    nf9_capacity capacity = {};
+    capacity.exporters = 1;
+    capacity.templates = 32;
+    capacity.packets = 1;
+    capacity.packet_bytes = 4096;
+    nf9_state* st = nf9_init_fixed(0, &capacity, nullptr);
+    ASSERT_NE(st, nullptr);
+    ASSERT_EQ(nf9_ctl(st, NF9_OPT_TEMPLATE_EXPIRE_TIME, 10), 0);
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    auto add_template = [&](uint16_t template_id, uint32_t timestamp,
+                             int num_fields) {
+        netflow_packet_builder builder;
+        builder.set_unix_timestamp(timestamp)
+            .add_data_template_flowset(0)
+            .add_data_template(template_id);
+        for (int i = 0; i < num_fields; ++i)
+            builder.add_data_template_field(NF9_FIELD_IN_BYTES, 4);
+        std::vector<uint8_t> packet_bytes = builder.build();
+
+        nf9_packet* pkt;
+        int err = nf9_decode(st, &pkt, packet_bytes.data(),
+                             packet_bytes.size(), &addr);
+        if (err == 0)
+            nf9_free_packet(pkt);
+        return err;
+    };
+
+    // Fill the region with small templates.
+    int num_small = 0;
+    while (num_small < 1000 && add_template(256 + num_small, 1, 1) == 0)
+        ++num_small;
+    ASSERT_GT(num_small, 32);
+
+    // Once they expire, the memory they used is merged into blocks which
+    // are large enough for templates with many fields.
+    for (uint16_t i = 0; i < 4; ++i)
+        EXPECT_EQ(add_template(2000 + i, 100, 200), 0);
+    nf9_free(st);
+}
+
+TEST_F(test, out_of_memory_errors)
+{
+    counting_allocator counts;
+    nf9_allocator allocator = {counting_malloc, counting_free, &counts};
+    nf9_state* st = nf9_init_ex(0, &allocator);
+    ASSERT_NE(st, nullptr);
+    ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, 2000), 0);
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    // Templates which don't fit are rejected before they are allocated.
+    int failures = 0;
+    for (uint16_t i = 0; i < 100; ++i) {
+        std::vector<uint8_t> packet_bytes =
+            netflow_packet_builder()
+                .add_data_template_flowset(0)
+                .add_data_template(256 + i)
+                .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+                .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+                .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                .add_data_template_field(NF9_FIELD_IN_PKTS, 4)
+                .build();
+
+        nf9_packet* pkt;
+        int err = nf9_decode(st, &pkt, packet_bytes.data(),
+                             packet_bytes.size(), &addr);
+        if (err == 0)
+            nf9_free_packet(pkt);
+        else
+            ASSERT_EQ(err, NF9_ERR_OUT_OF_MEMORY);
+        failures += err != 0;
+
+        const nf9_stats* stats = nf9_get_stats(st);
+        EXPECT_LE(nf9_get_stat(stats, NF9_STAT_MEMORY_USAGE), 2000);
+        nf9_free_stats(stats);
+    }
+    EXPECT_GT(failures, 0);
+    EXPECT_LT(failures, 100);
+
+    // Failing allocator callbacks are reported the same way.
+    ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE, 1000000), 0);
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(1000)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .build();
+    nf9_addr other_addr = make_inet_addr("192.168.1.2");
+    nf9_packet* pkt;
+    counts.max_allocations = counts.allocations + 1;
+    EXPECT_EQ(nf9_decode(st, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &other_addr),
+              NF9_ERR_OUT_OF_MEMORY);
+
+    counts.max_allocations = SIZE_MAX;
+    ASSERT_EQ(nf9_decode(st, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &other_addr),
+              0);
+    nf9_free_packet(pkt);
+    nf9_free(st);
+    EXPECT_EQ(counts.allocations, counts.frees);
+}
+
+TEST_F(test, exporter_memory_quota)
+{
+    nf9_addr noisy_addr = make_inet_addr("192.168.1.1");
+    nf9_addr quiet_addr = make_inet_addr("192.168.1.2");
+
+    auto template_packet = [](uint16_t template_id, uint32_t timestamp) {
+        return netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(template_id)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+            .set_unix_timestamp(timestamp)
+            .build();
+    };
+
+    std::vector<uint8_t> packet_bytes = template_packet(256, 1000);
+    packet result = decode(packet_bytes.data(), packet_bytes.size(),
+                           &quiet_addr);
+    ASSERT_NE(result, nullptr);
+
+    // The noisy exporter fills its own quota, but not the global limit.
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_EXPORTER_MEM_USAGE, -1),
+              NF9_ERR_INVALID_ARGUMENT);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_EXPORTER_MEM_USAGE, 500), 0);
+    for (uint16_t i = 0; i < 1000; ++i) {
+        packet_bytes = template_packet(300 + i, 1000 + i / 10);
+        result =
+            decode(packet_bytes.data(), packet_bytes.size(), &noisy_addr);
+        ASSERT_NE(result, nullptr);
+    }
+
+    nf9_exporter_stats exporters[2];
+    size_t num_exporters = 2;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, exporters, &num_exporters), 0);
+    ASSERT_EQ(num_exporters, 2);
+    for (const nf9_exporter_stats& es : exporters) {
+        EXPECT_LE(es.memory_usage, 500);
+        EXPECT_GT(es.memory_usage, 0);
+        if (es.exporter_index == 0)
+            EXPECT_EQ(es.quota_hits, 0);
+        else
+            EXPECT_GT(es.quota_hits, 0);
+    }
+
+    stats st = get_stats();
+    EXPECT_GT(nf9_get_stat(st.get(), NF9_STAT_QUOTA_HITS), 0);
+
+    // The quiet exporter keeps its template, and the noisy one keeps the
+    // most recent ones.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(256)
+                       .add_data_field(htonl(1))
+                       .add_data_field(htonl(2))
+                       .set_unix_timestamp(1200)
+                       .build();
+    result = decode(packet_bytes.data(), packet_bytes.size(), &quiet_addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(result.get()), 1);
+    EXPECT_EQ(nf9_get_num_flows(result.get(), 0), 1);
+
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(1299)
+                       .add_data_field(htonl(1))
+                       .add_data_field(htonl(2))
+                       .set_unix_timestamp(1200)
+                       .build();
+    result = decode(packet_bytes.data(), packet_bytes.size(), &noisy_addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(result.get()), 1);
+    EXPECT_EQ(nf9_get_num_flows(result.get(), 0), 1);
+
+    // A template larger than the quota is rejected.
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_EXPORTER_MEM_USAGE, 10), 0);
+    packet_bytes = template_packet(257, 1200);
+    result = decode(packet_bytes.data(), packet_bytes.size(), &quiet_addr);
+    EXPECT_EQ(result, nullptr);
+}
+
+TEST_F(test, exporter_quota_evicts_options)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    std::vector<uint8_t> packet_bytes;
+
+    auto option_template_packet = [](uint32_t timestamp) {
+        return netflow_packet_builder()
+            .set_unix_timestamp(timestamp)
+            .add_option_template_flowset(1000)
+            .add_option_field(NF9_FIELD_TOTAL_PKTS_EXP, 4)
+            .build();
+    };
+
+    // The options are older than the refreshed option template.
+    packet_bytes = option_template_packet(1000);
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+    packet_bytes = netflow_packet_builder()
+                       .set_unix_timestamp(1000)
+                       .add_data_flowset(1000)
+                       .add_data_field(uint32_t(100))
+                       .build();
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+    packet_bytes = option_template_packet(1002);
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    nf9_exporter_stats es;
+    size_t num_exporters = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &es, &num_exporters), 0);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_EXPORTER_MEM_USAGE,
+                      es.memory_usage),
+              0);
+
+    // A new template takes the place of the options, which were received
+    // first.
+    packet_bytes = netflow_packet_builder()
+                       .set_unix_timestamp(1003)
+                       .add_data_template_flowset(0)
+                       .add_data_template(256)
+                       .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+                       .build();
+    ASSERT_NE(decode(packet_bytes.data(), packet_bytes.size(), &addr),
+              nullptr);
+
+    stats st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_EVICTED_OBJECTS), 1);
+    EXPECT_EQ(num_templates(), 2);
+
+    packet_bytes = netflow_packet_builder()
+                       .set_unix_timestamp(1004)
+                       .add_data_flowset(256)
+                       .add_data_field(uint32_t(1))
+                       .build();
+    packet result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(result.get()), 1);
+    uint32_t value;
+    size_t len = sizeof(value);
+    EXPECT_EQ(nf9_get_option(result.get(), NF9_FIELD_TOTAL_PKTS_EXP, &value,
+                             &len),
+              NF9_ERR_NOT_FOUND);
+}
+
+TEST_F(test, pending_flowsets_count_against_exporter_quota)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_PENDING_BYTES, 100000), 0);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_EXPORTER_MEM_USAGE, 2000), 0);
+
+    const int num_flowsets = 100;
+    for (int i = 0; i < num_flowsets; ++i) {
+        netflow_packet_builder builder;
+        builder.set_unix_timestamp(1000).add_data_flowset(256);
+        for (int j = 0; j < 16; ++j)
+            builder.add_data_field(htonl(i));
+        std::vector<uint8_t> data_bytes = builder.build();
+        packet result = decode(data_bytes.data(), data_bytes.size(), &addr);
+        ASSERT_NE(result, nullptr);
+    }
+
+    nf9_exporter_stats es;
+    size_t num_exporters = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &es, &num_exporters), 0);
+    ASSERT_EQ(num_exporters, 1);
+    EXPECT_LE(es.memory_usage, 2000);
+    EXPECT_GT(es.memory_usage, 0);
+    EXPECT_GT(es.quota_hits, 0);
+
+    stats st = get_stats();
+    uint64_t queued = nf9_get_stat(st.get(), NF9_STAT_QUEUED_FLOWSETS);
+    EXPECT_GT(queued, 0);
+    EXPECT_LT(queued, num_flowsets);
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_MISSING_TEMPLATE_ERRORS),
+              num_flowsets - queued);
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_QUOTA_HITS),
+              num_flowsets - queued);
+
+    // A template of the exporter makes room by dropping queued flowsets
+    // waiting for other templates.
+    netflow_packet_builder builder;
+    builder.set_unix_timestamp(1001)
+        .add_data_template_flowset(0)
+        .add_data_template(300);
+    for (uint16_t field = 1; field <= 200; ++field)
+        builder.add_data_template_field(field, 4);
+    std::vector<uint8_t> template_bytes = builder.build();
+    packet result =
+        decode(template_bytes.data(), template_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+
+    num_exporters = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &es, &num_exporters), 0);
+    EXPECT_LE(es.memory_usage, 2000);
+    EXPECT_GT(es.missing_templates, num_flowsets - queued);
+
+}
+
+TEST_F(test, eviction_policies)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    auto template_packet = [](uint16_t template_id, uint32_t timestamp) {
+        return netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(template_id)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+            .set_unix_timestamp(timestamp)
+            .build();
+    };
+    auto data_packet = [](uint16_t template_id, uint32_t timestamp) {
+        return netflow_packet_builder()
+            .add_data_flowset(template_id)
+            .add_data_field(htonl(1))
+            .add_data_field(htonl(2))
+            .set_unix_timestamp(timestamp)
+            .build();
+    };
+
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_EVICTION_POLICY, 42),
+              NF9_ERR_INVALID_ARGUMENT);
+
+    for (int policy : {NF9_EVICTION_LRU, NF9_EVICTION_LFU}) {
+        nf9_state* st = nf9_init(0);
+        ASSERT_EQ(nf9_ctl(st, NF9_OPT_EVICTION_POLICY, policy), 0);
+
+        // Returns the number of flows decoded from the packet, or -1.
+        auto decode_flows = [&](const std::vector<uint8_t>& bytes) {
+            nf9_packet* pkt;
+            if (nf9_decode(st, &pkt, bytes.data(), bytes.size(), &addr) != 0)
+                return -1;
+            int flows = 0;
+            for (size_t i = 0; i < nf9_get_num_flowsets(pkt); ++i)
+                flows += nf9_get_num_flows(pkt, i);
+            nf9_free_packet(pkt);
+            return flows;
+        };
+
+        for (uint16_t tid = 256; tid < 260; ++tid)
+            ASSERT_EQ(decode_flows(template_packet(tid, 1000)), 0);
+        const nf9_stats* stats = nf9_get_stats(st);
+        ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE,
+                          nf9_get_stat(stats, NF9_STAT_MEMORY_USAGE)),
+                  0);
+        nf9_free_stats(stats);
+
+        // Template 256 carries the traffic, and new templates keep coming.
+        // None of them expire, so the cold ones have to be evicted.
+        for (uint16_t i = 0; i < 20; ++i) {
+            ASSERT_EQ(decode_flows(data_packet(256, 1001 + i)), 1);
+            ASSERT_EQ(decode_flows(template_packet(300 + i, 1001 + i)), 0);
+        }
+
+        EXPECT_EQ(decode_flows(data_packet(256, 1100)), 1);
+        EXPECT_EQ(decode_flows(data_packet(319, 1100)), 1);
+        EXPECT_EQ(decode_flows(data_packet(257, 1100)), 0);
+
+        stats = nf9_get_stats(st);
+        EXPECT_GT(nf9_get_stat(stats, NF9_STAT_EVICTED_OBJECTS), 0);
+        EXPECT_EQ(nf9_get_stat(stats, NF9_STAT_EXPIRED_OBJECTS), 0);
+        nf9_free_stats(stats);
+        nf9_free(st);
+    }
+}
+
+TEST_F(test, lfu_use_counts_age)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_EVICTION_POLICY, NF9_EVICTION_LFU), 0);
+
+    auto template_packet = [](uint16_t template_id) {
+        return netflow_packet_builder()
+            .add_data_template_flowset(0)
+            .add_data_template(template_id)
+            .add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4)
+            .add_data_template_field(NF9_FIELD_IPV4_DST_ADDR, 4)
+            .set_unix_timestamp(1000)
+            .build();
+    };
+    // Uses template `template_id' `num_flowsets' times.
+    auto use_template = [&](uint16_t template_id, int num_flowsets,
+                            uint32_t timestamp) {
+        netflow_packet_builder builder;
+        builder.set_unix_timestamp(timestamp);
+        for (int i = 0; i < 100; ++i) {
+            builder.add_data_flowset(template_id)
+                .add_data_field(htonl(1))
+                .add_data_field(htonl(2));
+        }
+        std::vector<uint8_t> bytes = builder.build();
+        for (int i = 0; i < num_flowsets / 100; ++i)
+            decode(bytes.data(), bytes.size(), &addr);
+    };
+
+    for (uint16_t tid : {256, 257}) {
+        std::vector<uint8_t> bytes = template_packet(tid);
+        decode(bytes.data(), bytes.size(), &addr);
+    }
+
+    // Both counts saturate, but template 257 was used more often, even
+    // though template 256 was used last.
+    use_template(256, 70000, 1001);
+    use_template(257, 100000, 1002);
+    use_template(256, 100, 1003);
+
+    stats st = get_stats();
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_MEM_USAGE,
+                      nf9_get_stat(st.get(), NF9_STAT_MEMORY_USAGE)),
+              0);
+    std::vector<uint8_t> bytes = template_packet(258);
+    decode(bytes.data(), bytes.size(), &addr);
+
+    st = get_stats();
+    EXPECT_EQ(nf9_get_stat(st.get(), NF9_STAT_EVICTED_OBJECTS), 1);
+
+    bytes = netflow_packet_builder()
+                .add_data_flowset(257)
+                .add_data_field(htonl(1))
+                .add_data_field(htonl(2))
+                .set_unix_timestamp(1004)
+                .build();
+    packet result = decode(bytes.data(), bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(nf9_get_num_flowsets(result.get()), 1);
+}
+
+TEST_F(test, eviction_makes_room_for_new_exporters)
+{
+    nf9_state* st = nf9_init(0);
+    ASSERT_EQ(nf9_ctl(st, NF9_OPT_EVICTION_POLICY, NF9_EVICTION_LRU), 0);
+
+    auto template_packet = [](uint16_t template_id) {
+        netflow_packet_builder builder;
+        builder.add_data_template_flowset(0).add_data_template(template_id);
+        for (int i = 0; i < 10; ++i)
+            builder.add_data_template_field(NF9_FIELD_IPV4_SRC_ADDR, 4);
+        return builder.set_unix_timestamp(1000).build();
+    };
+    auto decode = [&](const nf9_addr& addr, uint16_t template_id) {
+        std::vector<uint8_t> bytes = template_packet(template_id);
+        nf9_packet* pkt;
+        int err = nf9_decode(st, &pkt, bytes.data(), bytes.size(), &addr);
+        if (err == 0)
+            nf9_free_packet(pkt);
+        return err;
+    };
+
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    for (uint16_t tid = 256; tid < 306; ++tid)
+        ASSERT_EQ(decode(addr, tid), 0);
+    const nf9_stats* stats = nf9_get_stats(st);
+    ASSERT_EQ(nf9_ctl(st, NF9_OPT_MAX_MEM_USAGE,
+                      nf9_get_stat(stats, NF9_STAT_MEMORY_USAGE)),
+              0);
+    nf9_free_stats(stats);
+
+    // Nothing has expired, but templates of the first exporter are evicted
+    // to make room for new exporters.
+    for (const char* other : {"192.168.1.2", "192.168.1.3", "192.168.1.4"})
+        EXPECT_EQ(decode(make_inet_addr(other), 256), 0);
+
+    stats = nf9_get_stats(st);
+    EXPECT_GT(nf9_get_stat(stats, NF9_STAT_EVICTED_OBJECTS), 0);
+    EXPECT_EQ(nf9_get_stat(stats, NF9_STAT_EXPIRED_OBJECTS), 0);
+    nf9_free_stats(stats);
+    nf9_free(st);
+}
+
+TEST_F(test, compact_templates)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    const size_t num_templates = 100;
+    const size_t num_fields = 10;
+
+    for (uint16_t i = 0; i < num_templates; ++i) {
+        netflow_packet_builder builder;
+        builder.add_data_template_flowset(0).add_data_template(256 + i);
+        for (uint16_t j = 0; j < num_fields; ++j)
+            builder.add_data_template_field(NF9_FIELD_F0 + 100 + j, 4);
+        std::vector<uint8_t> packet_bytes =
+            builder.set_unix_timestamp(1000).build();
+        packet result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+        ASSERT_NE(result, nullptr);
+    }
+
+    // A template takes a single allocation with a small header and 4 bytes
+    // per field, and a slot in the table of its exporter.
+    nf9_exporter_stats es;
+    size_t num_exporters = 1;
+    ASSERT_EQ(nf9_get_exporter_stats(state_, &es, &num_exporters), 0);
+    ASSERT_EQ(num_exporters, 1);
+    EXPECT_LE(es.memory_usage, num_templates * (num_fields * 4 + 32));
+
+    // Fields of the templates are decoded in order.
+    netflow_packet_builder builder;
+    builder.add_data_flowset(256 + num_templates - 1);
+    for (uint32_t j = 0; j < num_fields; ++j)
+        builder.add_data_field(htonl(j));
+    std::vector<uint8_t> packet_bytes =
+        builder.set_unix_timestamp(1000).build();
+    packet result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(result.get()), 1);
+    ASSERT_EQ(nf9_get_num_flows(result.get(), 0), 1);
+
+    uint32_t value;
+    size_t len = sizeof(value);
+    ASSERT_EQ(nf9_get_field(result.get(), 0, 0, NF9_FIELD_F0 + 105, &value,
+                            &len),
+              0);
+    EXPECT_EQ(ntohl(value), 5);
+}
+
+TEST_F(test, scoped_options)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(300)
+            .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+            .add_option_field(NF9_FIELD_IF_NAME, 4)
+            .add_data_flowset(300)
+            .add_data_field(htonl(1))
+            .add_data_field(uint32_t(0x11111111))
+            .add_data_field(htonl(2))
+            .add_data_field(uint32_t(0x22222222))
+            .build();
+    packet first = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(first, nullptr);
+
+    uint32_t name;
+    size_t len = sizeof(name);
+    ASSERT_EQ(nf9_get_option_scoped(first.get(), NF9_SCOPE_FIELD_INTERFACE, 1,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              0);
+    EXPECT_EQ(name, 0x11111111);
+    ASSERT_EQ(nf9_get_option_scoped(first.get(), NF9_SCOPE_FIELD_INTERFACE, 2,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              0);
+    EXPECT_EQ(name, 0x22222222);
+    EXPECT_EQ(nf9_get_option_scoped(first.get(), NF9_SCOPE_FIELD_INTERFACE, 3,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              NF9_ERR_NOT_FOUND);
+
+    // Without a scope, the most recent record is used.
+    ASSERT_EQ(nf9_get_option(first.get(), NF9_FIELD_IF_NAME, &name, &len), 0);
+    EXPECT_EQ(name, 0x22222222);
+
+    // Update one interface and add a sampler with system scope.
+    packet_bytes =
+        netflow_packet_builder()
+            .add_data_flowset(300)
+            .add_data_field(htonl(1))
+            .add_data_field(uint32_t(0x33333333))
+            .add_option_template_flowset(301)
+            .add_option_scope_field(NF9_SCOPE_FIELD_SYSTEM & 0xffff, 4)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_ID, 2)
+            .add_option_field(NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL, 4)
+            .add_data_flowset(301)
+            .add_data_field(uint32_t(0))
+            .add_data_field(htons(5))
+            .add_data_field(htonl(100))
+            .build();
+    packet second = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(second, nullptr);
+
+    ASSERT_EQ(nf9_get_option_scoped(second.get(), NF9_SCOPE_FIELD_INTERFACE, 1,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              0);
+    EXPECT_EQ(name, 0x33333333);
+    ASSERT_EQ(nf9_get_option_scoped(second.get(), NF9_SCOPE_FIELD_INTERFACE, 2,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              0);
+    EXPECT_EQ(name, 0x22222222);
+
+    uint32_t interval;
+    len = sizeof(interval);
+    ASSERT_EQ(nf9_get_option_scoped(second.get(), NF9_FIELD_FLOW_SAMPLER_ID, 5,
+                                    NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL,
+                                    &interval, &len),
+              0);
+    EXPECT_EQ(ntohl(interval), 100);
+
+    // The first packet still sees options as they were when it was decoded.
+    ASSERT_EQ(nf9_get_option_scoped(first.get(), NF9_SCOPE_FIELD_INTERFACE, 1,
+                                    NF9_FIELD_IF_NAME, &name, &len),
+              0);
+    EXPECT_EQ(name, 0x11111111);
+    EXPECT_EQ(nf9_get_option_scoped(first.get(), NF9_FIELD_FLOW_SAMPLER_ID, 5,
+                                    NF9_FIELD_FLOW_SAMPLER_RANDOM_INTERVAL,
+                                    &interval, &len),
+              NF9_ERR_NOT_FOUND);
+}
+
+TEST_F(test, option_updates_in_place)
+{
+    counting_allocator counts;
+    nf9_allocator allocator = {counting_malloc, counting_free, &counts};
+    nf9_state* st = nf9_init_ex(0, &allocator);
+    ASSERT_NE(st, nullptr);
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(300)
+            .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+            .add_option_field(NF9_FIELD_IF_NAME, 4)
+            .build();
+    nf9_packet* pkt;
+    ASSERT_EQ(nf9_decode(st, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &addr),
+              0);
+    nf9_free_packet(pkt);
+
+    // Decode an option record and return the number of allocations and the
+    // options version seen by the packet.
+    auto decode_option = [&](uint32_t name) {
+        std::vector<uint8_t> bytes = netflow_packet_builder()
+                                         .add_data_flowset(300)
+                                         .add_data_field(htonl(1))
+                                         .add_data_field(name)
+                                         .build();
+        size_t allocations = counts.allocations;
+        nf9_packet* pkt;
+        EXPECT_EQ(nf9_decode(st, &pkt, bytes.data(), bytes.size(), &addr), 0);
+        allocations = counts.allocations - allocations;
+        uint64_t version = nf9_get_options_version(pkt);
+        nf9_free_packet(pkt);
+        return std::make_pair(allocations, version);
+    };
+
+    auto [first_allocations, first_version] = decode_option(0x11111111);
+    EXPECT_GT(first_version, 0);
+
+    // A refresh with the same values is not a new version.
+    auto [same_allocations, same_version] = decode_option(0x11111111);
+    EXPECT_EQ(same_version, first_version);
+
+    // New values of the same size are stored without allocating.  Interface
+    // names are interned, so the dictionary already has both names.
+    uint64_t other_version = decode_option(0x22222222).second;
+    EXPECT_GT(other_version, first_version);
+    auto [changed_allocations, changed_version] = decode_option(0x11111111);
+    EXPECT_GT(changed_version, other_version);
+    EXPECT_EQ(changed_allocations, same_allocations);
+    EXPECT_LT(changed_allocations, first_allocations);
+
+    nf9_free(st);
+    EXPECT_EQ(counts.allocations, counts.frees);
+}
+
+TEST_F(test, interface_names)
+{
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    auto text = [](const char* s) {
+        std::array<char, 8> field = {};
+        strncpy(field.data(), s, field.size());
+        return field;
+    };
+
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(300)
+            .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+            .add_option_field(NF9_FIELD_IF_NAME, 8)
+            .add_option_field(NF9_FIELD_IF_DESC, 8)
+            .add_data_flowset(300)
+            .add_data_field(htonl(1))
+            .add_data_field(text("eth0"))
+            .add_data_field(text("uplink"))
+            .add_data_field(htonl(2))
+            .add_data_field(text("eth1"))
+            .add_data_field(text(""))
+            .add_data_template_flowset(0)
+            .add_data_template(256)
+            .add_data_template_field(NF9_FIELD_INPUT_SNMP, 2)
+            .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+            .add_data_flowset(256)
+            .add_data_field(htons(1))
+            .add_data_field(htonl(100))
+            .add_data_field(htons(2))
+            .add_data_field(htonl(200))
+            .add_data_field(htons(3))
+            .add_data_field(htonl(300))
+            .build();
+    packet result = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(result, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(result.get()), 4);
+
+    const char* name;
+    const char* description;
+    ASSERT_EQ(nf9_get_interface_name(result.get(), 1, &name, &description), 0);
+    EXPECT_STREQ(name, "eth0");
+    EXPECT_STREQ(description, "uplink");
+    ASSERT_EQ(nf9_get_interface_name(result.get(), 2, &name, &description), 0);
+    EXPECT_STREQ(name, "eth1");
+    EXPECT_EQ(description, nullptr);
+    EXPECT_EQ(nf9_get_interface_name(result.get(), 3, &name, nullptr),
+              NF9_ERR_NOT_FOUND);
+
+    const char* names[4];
+    size_t size = 4;
+    ASSERT_EQ(nf9_get_interface_names(result.get(), 3, NF9_FIELD_INPUT_SNMP,
+                                      names, &size),
+              0);
+    ASSERT_EQ(size, 3);
+    EXPECT_STREQ(names[0], "eth0");
+    EXPECT_STREQ(names[1], "eth1");
+    EXPECT_EQ(names[2], nullptr);
+
+    size = 4;
+    ASSERT_EQ(nf9_get_interface_names(result.get(), 3, NF9_FIELD_OUTPUT_SNMP,
+                                      names, &size),
+              0);
+    ASSERT_EQ(size, 3);
+    EXPECT_EQ(names[0], nullptr);
+    EXPECT_EQ(nf9_get_interface_names(result.get(), 4, NF9_FIELD_INPUT_SNMP,
+                                      names, &size),
+              NF9_ERR_INVALID_ARGUMENT);
+}
+
+TEST_F(test, string_interning)
+{
+    nf9_free(state_);
+    state_ = nf9_init(NF9_INTERN_STRINGS);
+
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    auto text = [](const char* s) {
+        std::array<char, 8> field = {};
+        strncpy(field.data(), s, field.size());
+        return field;
+    };
+
+    std::vector<uint8_t> packet_bytes =
+        netflow_packet_builder()
+            .add_option_template_flowset(300)
+            .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+            .add_option_field(NF9_FIELD_IF_NAME, 8)
+            .add_data_flowset(300)
+            .add_data_field(htonl(1))
+            .add_data_field(text("eth0"))
+            .add_data_template_flowset(0)
+            .add_data_template(256)
+            .add_data_template_field(NF9_FIELD_IF_NAME, 8)
+            .add_data_template_field(NF9_FIELD_APPLICATION_NAME, 8)
+            .add_data_template_field(NF9_FIELD_IN_BYTES, 4)
+            .add_data_flowset(256)
+            .add_data_field(text("eth0"))
+            .add_data_field(text("http"))
+            .add_data_field(htonl(100))
+            .add_data_field(text("eth1"))
+            .add_data_field(text("dns"))
+            .add_data_field(htonl(200))
+            .add_data_field(text("eth0"))
+            .add_data_field(text(""))
+            .add_data_field(htonl(300))
+            .build();
+    packet first = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(first, nullptr);
+    ASSERT_EQ(nf9_get_num_flowsets(first.get()), 4);
+
+    uint32_t ids[3];
+    for (unsigned i = 0; i < 3; ++i)
+        ASSERT_EQ(nf9_get_string_id(first.get(), 3, i, NF9_FIELD_IF_NAME,
+                                    &ids[i]),
+                  0);
+    EXPECT_EQ(ids[0], ids[2]);
+    EXPECT_NE(ids[0], ids[1]);
+    EXPECT_STREQ(nf9_get_string(state_, ids[1]), "eth1");
+
+    // Interface names from options are in the same dictionary.
+    const char* name;
+    ASSERT_EQ(nf9_get_interface_name(first.get(), 1, &name, nullptr), 0);
+    EXPECT_EQ(name, nf9_get_string(state_, ids[0]));
+
+    uint32_t http;
+    ASSERT_EQ(nf9_get_string_id(first.get(), 3, 0, NF9_FIELD_APPLICATION_NAME,
+                                &http),
+              0);
+    EXPECT_STREQ(nf9_get_string(state_, http), "http");
+    uint32_t id;
+    EXPECT_EQ(nf9_get_string_id(first.get(), 3, 2, NF9_FIELD_APPLICATION_NAME,
+                                &id),
+              NF9_ERR_NOT_FOUND);
+    EXPECT_EQ(nf9_get_string_id(first.get(), 3, 0, NF9_FIELD_SAMPLER_NAME,
+                                &id),
+              NF9_ERR_NOT_FOUND);
+    EXPECT_EQ(nf9_get_string_id(first.get(), 3, 0, NF9_FIELD_IN_BYTES, &id),
+              NF9_ERR_INVALID_ARGUMENT);
+    EXPECT_EQ(nf9_get_string(state_, 0), nullptr);
+    EXPECT_EQ(nf9_get_string(state_, 1000), nullptr);
+
+    // Values keep their IDs in later packets.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_flowset(256)
+                       .add_data_field(text("eth1"))
+                       .add_data_field(text("http"))
+                       .add_data_field(htonl(400))
+                       .build();
+    packet second = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(second, nullptr);
+    ASSERT_EQ(nf9_get_string_id(second.get(), 0, 0, NF9_FIELD_IF_NAME, &id),
+              0);
+    EXPECT_EQ(id, ids[1]);
+    ASSERT_EQ(nf9_get_string_id(second.get(), 0, 0,
+                                NF9_FIELD_APPLICATION_NAME, &id),
+              0);
+    EXPECT_EQ(id, http);
+
+    // IDs are only stored with NF9_INTERN_STRINGS.
+    nf9_state* plain = nf9_init(0);
+    nf9_packet* pkt = nullptr;
+    ASSERT_EQ(nf9_decode(plain, &pkt, packet_bytes.data(), packet_bytes.size(),
+                         &addr),
+              0);
+    EXPECT_EQ(nf9_get_string_id(pkt, 0, 0, NF9_FIELD_IF_NAME, &id),
+              NF9_ERR_INVALID_ARGUMENT);
+    nf9_free_packet(pkt);
+    nf9_free(plain);
+}
+
+TEST_F(test, string_dictionary_limit)
+{
+    nf9_free(state_);
+    state_ = nf9_init(NF9_INTERN_STRINGS);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_MEM_USAGE, 1000 * 1000), 0);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_STRING_MEM_USAGE, 2000), 0);
+    ASSERT_EQ(nf9_ctl(state_, NF9_OPT_MAX_STRING_MEM_USAGE, -1),
+              NF9_ERR_INVALID_ARGUMENT);
+
+    nf9_addr addr = make_inet_addr("192.168.1.1");
+    const uint32_t num_interfaces = 200;
+    auto name_of = [](uint32_t index) {
+        std::array<char, 16> name = {};
+        snprintf(name.data(), name.size(), "if-%u", index);
+        return name;
+    };
+
+    // Every interface has a new name, as sent by a misbehaving exporter.
+    netflow_packet_builder builder;
+    builder.add_option_template_flowset(300)
+        .add_option_scope_field(NF9_SCOPE_FIELD_INTERFACE & 0xffff, 4)
+        .add_option_field(NF9_FIELD_IF_NAME, 16)
+        .add_data_flowset(300);
+    for (uint32_t i = 1; i <= num_interfaces; ++i)
+        builder.add_data_field(htonl(i)).add_data_field(name_of(i));
+    std::vector<uint8_t> packet_bytes = builder.build();
+    packet pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+
+    // Names that didn't fit in the dictionary are still known.
+    for (uint32_t i = 1; i <= num_interfaces; ++i) {
+        const char* name;
+        ASSERT_EQ(nf9_get_interface_name(pkt.get(), i, &name, nullptr), 0);
+        EXPECT_STREQ(name, name_of(i).data());
+    }
+
+    uint32_t num_strings = 0;
+    while (nf9_get_string(state_, num_strings + 1) != nullptr)
+        ++num_strings;
+    EXPECT_GT(num_strings, 0);
+    EXPECT_LT(num_strings, num_interfaces);
+
+    // Text fields of data records get no IDs once the dictionary is full.
+    packet_bytes = netflow_packet_builder()
+                       .add_data_template_flowset(0)
+                       .add_data_template(256)
+                       .add_data_template_field(NF9_FIELD_IF_NAME, 16)
+                       .add_data_flowset(256)
+                       .add_data_field(name_of(1))
+                       .add_data_field(name_of(num_interfaces))
+                       .build();
+    pkt = decode(packet_bytes.data(), packet_bytes.size(), &addr);
+    ASSERT_NE(pkt, nullptr);
+    uint32_t id;
+    ASSERT_EQ(nf9_get_string_id(pkt.get(), 1, 0, NF9_FIELD_IF_NAME, &id), 0);
+    EXPECT_STREQ(nf9_get_string(state_, id), "if-1");
+    EXPECT_EQ(nf9_get_string_id(pkt.get(), 1, 1, NF9_FIELD_IF_NAME, &id),
+              NF9_ERR_NOT_FOUND);
+}